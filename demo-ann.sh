@@ -0,0 +1,14 @@
+make
+if [ ! -e text8 ]; then
+  wget http://mattmahoney.net/dc/text8.zip -O text8.gz
+  gzip -d text8.gz -f
+fi
+if [ ! -e vectors.bin ]; then
+  time ./word2vec -train text8 -output vectors.bin -cbow 0 -size 200 -window 8 -negative 25 -hs 0 -sample 1e-4 -threads 16 -binary 1 -iter 15
+fi
+echo ---------------------------------------------------------------------------------------------------
+echo Builds vectors.bin.hnsw and reports its recall@40 and query time against the exact search
+echo for single words and for the b - a + c vectors of word-analogy
+echo ---------------------------------------------------------------------------------------------------
+time ./hnsw-build vectors.bin 16 200
+./distance vectors.bin ann=100
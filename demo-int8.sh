@@ -0,0 +1,18 @@
+make
+make bin2native
+if [ ! -e text8 ]; then
+  wget http://mattmahoney.net/dc/text8.zip -O text8.gz
+  gzip -d text8.gz -f
+fi
+if [ ! -e vectors.bin ]; then
+  time ./word2vec -train text8 -output vectors.bin -cbow 0 -size 200 -window 8 -negative 25 -hs 0 -sample 1e-4 -threads 16 -binary 1 -iter 15
+fi
+echo ---------------------------------------------------------------------------------------------------
+echo Accuracy of the float32 and int8 native copies of vectors.bin on questions-words.txt
+echo ---------------------------------------------------------------------------------------------------
+./bin2native vectors.bin vectors.w2c float32
+./bin2native vectors.bin vectors-int8.w2c int8
+ls -l vectors.w2c vectors-int8.w2c
+time ./compute-accuracy vectors.w2c 30000 < questions-words.txt | tail -3
+time ./compute-accuracy vectors-int8.w2c 30000 < questions-words.txt | tail -3
+./distance vectors-int8.w2c
@@ -0,0 +1,17 @@
+make
+if [ ! -e text8 ]; then
+  wget http://mattmahoney.net/dc/text8.zip -O text8.gz
+  gzip -d text8.gz -f
+fi
+if [ ! -e vectors.bin ]; then
+  time ./word2vec -train text8 -output vectors.bin -cbow 0 -size 200 -window 8 -negative 25 -hs 0 -sample 1e-4 -threads 16 -binary 1 -iter 15
+fi
+echo ---------------------------------------------------------------------------------------------------
+echo Compresses vectors.bin to 50 bytes per word and reports the recall@40 and query time of the
+echo compressed search against the exact one, then with the best candidates re-scored exactly
+echo ---------------------------------------------------------------------------------------------------
+time ./pq-compress vectors.bin vectors.pq 50
+./compute-accuracy vectors.bin 30000 < questions-words.txt | tail -3
+./compute-accuracy vectors.pq 30000 < questions-words.txt | tail -3
+./compute-accuracy vectors.pq 30000 rerank=vectors.bin < questions-words.txt | tail -3
+./distance vectors.pq rerank=vectors.bin
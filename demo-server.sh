@@ -0,0 +1,43 @@
+make
+if [ ! -e text8 ]; then
+  wget http://mattmahoney.net/dc/text8.zip -O text8.gz
+  gzip -d text8.gz -f
+fi
+if [ ! -e vectors.bin ]; then
+  time ./word2vec -train text8 -output vectors.bin -cbow 0 -size 200 -window 8 -negative 25 -hs 0 -sample 1e-4 -threads 16 -binary 1 -iter 15
+fi
+./vec-server vectors.bin vectors.sock -top 10 &
+SERVER=$!
+sleep 10
+echo ---------------------------------------------------------------------------------------------------
+echo One request per line on the socket, one answer per line
+echo ---------------------------------------------------------------------------------------------------
+python3 -c '
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect("vectors.sock")
+lines = ["distance france", "analogy man king woman", "score paris france", "distance notawordatall"]
+s.sendall(("\n".join(lines) + "\n").encode())
+f = s.makefile()
+for l in lines: print(l, "->", f.readline().strip())
+'
+echo ---------------------------------------------------------------------------------------------------
+echo Analogy questions of questions-words.txt from 16 concurrent clients, answered in shared batches
+echo ---------------------------------------------------------------------------------------------------
+time python3 -c '
+import socket, threading
+q = [l.lower().split() for l in open("questions-words.txt") if not l.startswith(":")]
+def run(part):
+  s = socket.socket(socket.AF_UNIX)
+  s.connect("vectors.sock")
+  s.sendall("".join("analogy %s %s %s\n" % (a, b, c) for a, b, c, d in part).encode())
+  f = s.makefile()
+  part[:] = [(d, f.readline().split()) for a, b, c, d in part]
+parts = [q[i::16] for i in range(16)]
+threads = [threading.Thread(target=run, args=(p,)) for p in parts]
+for t in threads: t.start()
+for t in threads: t.join()
+answers = [x for p in parts for x in p]
+print("%d questions, top answer correct for %d" % (len(answers), sum(len(r) > 1 and r[1] == d for d, r in answers)))
+'
+kill $SERVER
@@ -86,15 +86,14 @@ while (<>) {
 ' | normalize_text | awk '{if (NF>1) print;}' >> data.txt
 
 wget http://word2vec.googlecode.com/svn/trunk/word2vec.c
-wget http://word2vec.googlecode.com/svn/trunk/word2phrase.c
 wget http://word2vec.googlecode.com/svn/trunk/compute-accuracy.c
 wget http://word2vec.googlecode.com/svn/trunk/questions-words.txt
 wget http://word2vec.googlecode.com/svn/trunk/questions-phrases.txt
 gcc word2vec.c -o word2vec -lm -pthread -O3 -march=native -funroll-loops
-gcc word2phrase.c -o word2phrase -lm -pthread -O3 -march=native -funroll-loops
+make -C .. word2phrase && cp ../word2phrase .
 gcc compute-accuracy.c -o compute-accuracy -lm -pthread -O3 -march=native -funroll-loops
-./word2phrase -train data.txt -output data-phrase.txt -threshold 200 -debug 2
-./word2phrase -train data-phrase.txt -output data-phrase2.txt -threshold 100 -debug 2
-./word2vec -train data-phrase2.txt -output vectors.bin -cbow 1 -size 500 -window 10 -negative 10 -hs 0 -sample 1e-5 -threads 40 -binary 1 -iter 3 -min-count 10
+./word2phrase -train data.txt -output data-phrase.txt -threshold 200 -debug 2 -threads 40
+./word2phrase -train data-phrase.txt -output data-phrase2.txt -threshold 100 -debug 2 -threads 40 -save-vocab data-phrase2.vocab
+./word2vec -train data-phrase2.txt -read-vocab data-phrase2.vocab -output vectors.bin -cbow 1 -size 500 -window 10 -negative 10 -hs 0 -sample 1e-5 -threads 40 -binary 1 -iter 3 -min-count 10
 ./compute-accuracy vectors.bin 400000 < questions-words.txt     # should get to almost 78% accuracy on 99.7% of questions
 ./compute-accuracy vectors.bin 1000000 < questions-phrases.txt  # about 78% accuracy with 77% coverage
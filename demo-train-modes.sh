@@ -0,0 +1,27 @@
+make
+if [ ! -e text8 ]; then
+  wget http://mattmahoney.net/dc/text8.zip -O text8.gz
+  gzip -d text8.gz -f
+fi
+# Benchmarks the batch scheduling and kernel execution options of word2cvec_clean (training time and analogy accuracy)
+# -exec 0 = sequential Hogwild updates, -exec 1 = coalesced batch updates, -exec 2 = gathered word group kernel
+# -reorder 1 = word groups sorted by sign stream and word, -reorder 2 = pairs sorted by sign stream and target row
+# -prefetch <d> = software prefetch of the rows of the pair d positions ahead
+# -neg-buffer <n> = negatives drawn in bulk, n at a time, from a counter-based generator
+MODEL=${MODEL:-real_original}
+THREADS=${THREADS:-20}
+for opts in "-exec 0" "-exec 1" "-exec 0 -reorder 1" "-exec 1 -reorder 1" "-exec 1 -reorder 2" "-exec 0 -prefetch 8" "-exec 1 -prefetch 8" "-exec 2" "-exec 2 -prefetch 8" "-exec 0 -neg-buffer 4096" "-exec 2 -prefetch 8 -neg-buffer 4096"; do
+  name=`echo $opts | tr -d ' -'`
+  echo "Model $MODEL, options $opts"
+  time ./word2cvec_clean -train text8 -output vectors-$MODEL-$name.bin -model $MODEL -size 200 -window 8 -negative 25 -sample 1e-4 -threads $THREADS -binary 1 -iter 5 -debug 1 $opts
+  ./compute-accuracy vectors-$MODEL-$name.bin 30000 < questions-words.txt | tail -n 2
+done
+# Thread scaling of the negative sampling with and without one vocabulary partition per thread
+for threads in 1 4 8 $THREADS; do
+  for opts in "-neg-partition 0" "-neg-partition 1 -neg-global 0.2"; do
+    name=`echo $opts | tr -d ' -'`
+    echo "Model $MODEL, $threads threads, options $opts"
+    time ./word2cvec_clean -train text8 -output vectors-$MODEL-t$threads-$name.bin -model $MODEL -size 200 -window 8 -negative 25 -sample 1e-4 -threads $threads -binary 1 -iter 5 -debug 1 $opts
+    ./compute-accuracy vectors-$MODEL-t$threads-$name.bin 30000 < questions-words.txt | tail -n 2
+  done
+done
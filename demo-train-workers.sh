@@ -0,0 +1,22 @@
+make
+if [ ! -e text8 ]; then
+  wget http://mattmahoney.net/dc/text8.zip -O text8.gz
+  gzip -d text8.gz -f
+fi
+# Trains one model with several word2cvec_clean worker processes on localhost, each one on its shard of the corpus,
+# averaging their parameters 4 times per epoch through shared memory, then through TCP. Worker 0 writes the output.
+WORKERS=${WORKERS:-4}
+THREADS=${THREADS:-4}
+OPTS="-train text8 -model real_original -size 200 -window 8 -negative 25 -sample 1e-4 -threads $THREADS -binary 1 -iter 5 -debug 1 -workers $WORKERS -sync 4"
+./word2cvec_clean -train text8 -model real_original -save-vocab text8.vocab -debug 0
+for sync in "-sync-shm word2cvec_demo -sync-run $(date +%s)" "-sync-tcp localhost:5555"; do
+  echo "$WORKERS workers, $sync"
+  time (
+    for id in `seq 1 $(($WORKERS - 1))`; do
+      ./word2cvec_clean $OPTS -read-vocab text8.vocab -worker-id $id -output /dev/null $sync > /dev/null &
+    done
+    ./word2cvec_clean $OPTS -read-vocab text8.vocab -worker-id 0 -output vectors-workers.bin $sync
+    wait
+  )
+  ./compute-accuracy vectors-workers.bin 30000 < questions-words.txt | tail -n 2
+done
@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vecfile.h"
+
+//Converts a model to the native format (see vecfile.h), with float32 or int8 rows
+int main(int argc, char **argv) {
+	struct vec_model model;
+	struct vec_writer w;
+	char **word;
+	float *buf, *row;
+	const float *v;
+	long long a, b, size;
+	int precision = VEC_PRECISION_FLOAT32;
+	if (argc < 3) {
+		printf("Usage: ./bin2native <IN_FILE> <OUT_FILE> [PRECISION]\nwhere PRECISION is float32 (default) or int8: each normalized row is then stored as\n");
+		printf("int8 values with a per-row scale, 4x smaller, and the query tools score it with integer dot products\n");
+		return 0;
+	}
+	if (argc > 3) {
+		if (!strcmp(argv[3], "int8")) precision = VEC_PRECISION_INT8;
+		else if (strcmp(argv[3], "float32")) {
+			printf("Unknown precision %s\n", argv[3]);
+			return -1;
+		}
+	}
+	//The writer normalizes the rows and keeps their norms
+	if (VecOpen(argv[1], &model, 0, 0)) return -1;
+	size = model.size;
+	word = (char **)malloc(model.words * sizeof(char *));
+	for (b = 0; b < model.words; b++) word[b] = (char *)VecWord(&model, b);
+	buf = (float *)malloc(size * sizeof(float));
+	row = (float *)malloc(size * sizeof(float));
+	if (VecWriterOpen(&w, argv[2], model.words, size, model.model, model.layout, precision, word)) return -1;
+	for (b = 0; b < model.words; b++) {
+		v = VecRow(&model, b, buf);
+		for (a = 0; a < size; a++) row[a] = model.norms != NULL ? v[a] * model.norms[b] : v[a];
+		VecWriterRow(&w, row);
+	}
+	if (VecWriterClose(&w)) return -1;
+	free(word);
+	free(buf);
+	free(row);
+	VecClose(&model);
+	return 0;
+}
@@ -2,50 +2,46 @@
 #include <string.h>
 #include <math.h>
 #include <malloc.h>
+#include "vecfile.h"
 
 const long long max_size = 2000;         // max length of strings
-const long long max_w = 50;              // max length of vocabulary entries
 
 
 //Write in format readable by this evaluation script: https://github.com/mfaruqui/eval-word-vectors
 int main(int argc, char **argv) {
-	FILE *f, *fo;
-	char out_file[max_size], in_file[max_size], cur_word[max_w];
-	float cur_val;
+	FILE *fo;
+	char out_file[max_size], in_file[max_size];
+	float cur_val, norm, *buf;
+	const float *row;
 	long long words, size, a, b;
-	if (argc < 2) {
+	struct vec_model model;
+	if (argc < 3) {
 		printf("Usage: ./bin2txt <IN_FILE> <OUT_FILE>\n");
 		return 0;
 	}
 	strcpy(in_file, argv[1]);
 	strcpy(out_file, argv[2]);
-	f = fopen(in_file, "rb");
+	//Native files only hold normalized rows, their norms give back the original vectors
+	if (VecOpen(in_file, &model, 0, 0)) return -1;
 	fo = fopen(out_file, "wb");
-	if (f == NULL) {
-		printf("Input file not found\n");
-		return -1;
-	}
-
-	fscanf(f, "%lld", &words);
-	fscanf(f, "%lld", &size);
+	words = model.words;
+	size = model.size;
+	//Compressed models are written with the centroids of their codes
+	buf = (float *)malloc(size * sizeof(float));
 	fprintf(fo, "%lld %lld\n", words, size);
 
 	for (b = 0; b < words; b++) {
-		a = 0;
-		while (1) {
-			cur_word[a] = fgetc(f);
-			if (feof(f) || (cur_word[a] == ' ')) break;
-			if ((a < max_w) && (cur_word[a] != '\n')) a++;
-		}
-		cur_word[a] = 0;
-		fprintf(fo, "%s ", cur_word);
+		fprintf(fo, "%s ", VecWord(&model, b));
+		norm = model.norms != NULL ? model.norms[b] : 1;
+		row = VecRow(&model, b, buf);
 		for (a = 0; a < size; a++){
-			fread(&cur_val, sizeof(float), 1, f);
+			cur_val = row[a] * norm;
 			fprintf(fo, "%lf ", cur_val);
 		}
 		fprintf(fo, "\n");
 	}
-	fclose(f);
+	free(buf);
+	VecClose(&model);
 	fclose(fo);
 	return 0;
 }
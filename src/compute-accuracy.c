@@ -18,118 +18,168 @@
 #include <math.h>
 #include <malloc.h>
 #include <ctype.h>
+#include <strings.h>
+#include "vecfile.h"
+#include "vecsearch.h"
 
 const long long max_size = 2000;         // max length of strings
 const long long N = 1;                   // number of closest words
-const long long max_w = 50;              // max length of vocabulary entries
+const long long max_batch = 2048;        // questions scored in one pass over the vocabulary
+const long long R = 100;                 // candidates of a compressed model re-scored with the float rows
+
+// The input is read up front into a list of events, replayed once the questions are scored
+#define EVENT_END_SECTION 0
+#define EVENT_SECTION 1
+#define EVENT_QUESTION 2
+
+struct event {
+  int kind;
+  char *name;              // section name, or expected answer of a question
+  long long b[4];          // question words, -1 if not in the vocabulary
+  long long best;          // answer of the model
+};
 
 int main(int argc, char **argv)
 {
-  FILE *f;
-  char st1[max_size], st2[max_size], st3[max_size], st4[max_size], bestw[N][max_size], file_name[max_size], ch;
-  float dist, len, bestd[N], vec[max_size];
-  long long words, size, a, b, c, d, b1, b2, b3, threshold = 0;
-  float *M;
-  char *vocab;
-  int TCN, CCN = 0, TACN = 0, CACN = 0, SECN = 0, SYCN = 0, SEAC = 0, SYAC = 0, QID = 0, TQ = 0, TQS = 0;
+  char st1[max_size], st2[max_size], st3[max_size], st4[max_size], file_name[max_size];
+  float *vec, *dvec, *bestd, *row;
+  const float *wv;
+  long long size, a, b, c, nq, threshold = 0, nb_events = 0, max_events = 1024, K = N, *exclude, *best;
+  struct vec_model model, exact, *rows;
+  struct vec_query *q;
+  struct event *ev, *e;
+  int dirs = 0, rerank = 0, TCN, CCN = 0, TACN = 0, CACN = 0, SECN = 0, SYCN = 0, SEAC = 0, SYAC = 0, QID = 0, TQ = 0, TQS = 0;
   if (argc < 2) {
-    printf("Usage: ./compute-accuracy <FILE> <threshold>\nwhere FILE contains word projections, and threshold is used to reduce vocabulary of the model for fast approximate evaluation (0 = off, otherwise typical value is 30000)\n");
+    printf("Usage: ./compute-accuracy <FILE> <threshold> [MODE]...\nwhere FILE contains word projections, and threshold is used to reduce vocabulary of the model for fast approximate evaluation (0 = off, otherwise typical value is 30000)\n");
+    printf("and MODE (right or left, prefixed by complex- or 2real- for word2vec files) answers with the order-sensitive score of complex and 2real models instead of the cosine\n");
+    printf("FILE can be compressed by pq-compress: a rerank=<FLOAT FILE> mode re-scores its best candidates exactly\n");
     return 0;
   }
   strcpy(file_name, argv[1]);
   if (argc > 2) threshold = atoi(argv[2]);
-  f = fopen(file_name, "rb");
-  if (f == NULL) {
-    printf("Input file not found\n");
-    return -1;
+  //Words are compared without case
+  if (VecOpen(file_name, &model, threshold, 1)) return -1;
+  for (a = 3; a < argc; a++) {
+    if (!strncmp(argv[a], "rerank=", 7)) {
+      if (VecOpen(argv[a] + 7, &exact, threshold, 1)) return -1;
+      if (model.precision != VEC_PRECISION_PQ8 || exact.M == NULL || exact.words != model.words || exact.size != model.size) {
+        printf("rerank needs a compressed FILE and the float model it was compressed from\n");
+        return -1;
+      }
+      rerank = 1;
+      K = R;
+    } else if ((dirs = VecDirections(&model, argv[a])) < 0) return -1;
   }
-  fscanf(f, "%lld", &words);
-  if (threshold) if (words > threshold) words = threshold;
-  fscanf(f, "%lld", &size);
-  vocab = (char *)malloc(words * max_w * sizeof(char));
-  M = (float *)malloc(words * size * sizeof(float));
-  if (M == NULL) {
-    printf("Cannot allocate memory: %lld MB\n", words * size * sizeof(float) / 1048576);
+  if (dirs == (VEC_RIGHT | VEC_LEFT)) {
+    printf("One direction at a time\n");
     return -1;
   }
-  for (b = 0; b < words; b++) {
-    a = 0;
-    while (1) {
-      vocab[b * max_w + a] = fgetc(f);
-      if (feof(f) || (vocab[b * max_w + a] == ' ')) break;
-      if ((a < max_w) && (vocab[b * max_w + a] != '\n')) a++;
-    }
-    vocab[b * max_w + a] = 0;
-    for (a = 0; a < max_w; a++) vocab[b * max_w + a] = toupper(vocab[b * max_w + a]);
-    for (a = 0; a < size; a++) fread(&M[a + b * size], sizeof(float), 1, f);
-    len = 0;
-    for (a = 0; a < size; a++) len += M[a + b * size] * M[a + b * size];
-    len = sqrt(len);
-    for (a = 0; a < size; a++) M[a + b * size] /= len;
-  }
-  fclose(f);
-  TCN = 0;
+  size = model.size;
+  //Query vectors come from the float rows when there are some
+  rows = rerank ? &exact : &model;
+  row = (float *)malloc(size * sizeof(float));
+  ev = (struct event *)malloc(max_events * sizeof(struct event));
   while (1) {
-    for (a = 0; a < N; a++) bestd[a] = 0;
-    for (a = 0; a < N; a++) bestw[a][0] = 0;
+    if (nb_events + 2 >= max_events) {
+      max_events *= 2;
+      ev = (struct event *)realloc(ev, max_events * sizeof(struct event));
+    }
+    e = ev + nb_events;
     scanf("%s", st1);
     for (a = 0; a < strlen(st1); a++) st1[a] = toupper(st1[a]);
     if ((!strcmp(st1, ":")) || (!strcmp(st1, "EXIT")) || feof(stdin)) {
-      if (TCN == 0) TCN = 1;
-      if (QID != 0) {
-        printf("ACCURACY TOP1: %.2f %%  (%d / %d)\n", CCN / (float)TCN * 100, CCN, TCN);
-        printf("Total accuracy: %.2f %%   Semantic accuracy: %.2f %%   Syntactic accuracy: %.2f %% \n", CACN / (float)TACN * 100, SEAC / (float)SECN * 100, SYAC / (float)SYCN * 100);
-      }
-      QID++;
+      e->kind = EVENT_END_SECTION;
+      nb_events++;
       scanf("%s", st1);
       if (feof(stdin)) break;
-      printf("%s:\n", st1);
-      TCN = 0;
-      CCN = 0;
+      e++;
+      e->kind = EVENT_SECTION;
+      e->name = strdup(st1);
+      nb_events++;
       continue;
     }
-    if (!strcmp(st1, "EXIT")) break;
     scanf("%s", st2);
     for (a = 0; a < strlen(st2); a++) st2[a] = toupper(st2[a]);
     scanf("%s", st3);
     for (a = 0; a<strlen(st3); a++) st3[a] = toupper(st3[a]);
     scanf("%s", st4);
     for (a = 0; a < strlen(st4); a++) st4[a] = toupper(st4[a]);
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st1)) break;
-    b1 = b;
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st2)) break;
-    b2 = b;
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st3)) break;
-    b3 = b;
-    for (a = 0; a < N; a++) bestd[a] = 0;
-    for (a = 0; a < N; a++) bestw[a][0] = 0;
-    TQ++;
-    if (b1 == words) continue;
-    if (b2 == words) continue;
-    if (b3 == words) continue;
-    for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st4)) break;
-    if (b == words) continue;
-    for (a = 0; a < size; a++) vec[a] = (M[a + b2 * size] - M[a + b1 * size]) + M[a + b3 * size];
-    TQS++;
-    for (c = 0; c < words; c++) {
-      if (c == b1) continue;
-      if (c == b2) continue;
-      if (c == b3) continue;
-      dist = 0;
-      for (a = 0; a < size; a++) dist += vec[a] * M[a + c * size];
-      for (a = 0; a < N; a++) {
-        if (dist > bestd[a]) {
-          for (d = N - 1; d > a; d--) {
-            bestd[d] = bestd[d - 1];
-            strcpy(bestw[d], bestw[d - 1]);
-          }
-          bestd[a] = dist;
-          strcpy(bestw[a], &vocab[c * max_w]);
-          break;
-        }
+    e->kind = EVENT_QUESTION;
+    e->name = strdup(st4);
+    e->b[0] = VecSearchNoCase(&model, st1);
+    e->b[1] = VecSearchNoCase(&model, st2);
+    e->b[2] = VecSearchNoCase(&model, st3);
+    e->b[3] = VecSearchNoCase(&model, st4);
+    e->best = -1;
+    nb_events++;
+  }
+  //Closest word to b - a + c for all the questions, max_batch at a time
+  vec = (float *)malloc(max_batch * size * sizeof(float));
+  dvec = (float *)malloc(2 * max_batch * size * sizeof(float));
+  exclude = (long long *)malloc(max_batch * 3 * sizeof(long long));
+  best = (long long *)malloc(max_batch * K * sizeof(long long));
+  bestd = (float *)malloc(max_batch * K * sizeof(float));
+  q = (struct vec_query *)malloc(max_batch * sizeof(struct vec_query));
+  for (b = 0; b < nb_events; b = c) {
+    nq = 0;
+    for (c = b; c < nb_events && nq < max_batch; c++) {
+      e = ev + c;
+      if (e->kind != EVENT_QUESTION || e->b[0] < 0 || e->b[1] < 0 || e->b[2] < 0 || e->b[3] < 0) continue;
+      wv = VecRow(rows, e->b[1], row);
+      for (a = 0; a < size; a++) vec[nq * size + a] = wv[a];
+      wv = VecRow(rows, e->b[0], row);
+      for (a = 0; a < size; a++) vec[nq * size + a] -= wv[a];
+      wv = VecRow(rows, e->b[2], row);
+      for (a = 0; a < size; a++) vec[nq * size + a] += wv[a];
+      for (a = 0; a < 3; a++) exclude[nq * 3 + a] = e->b[a];
+      q[nq].vec = vec + nq * size;
+      q[nq].twin = NULL;
+      if (dirs != 0) {
+        VecDirectional(&model, vec + nq * size, dvec + 2 * nq * size, dvec + (2 * nq + 1) * size);
+        q[nq].vec = dvec + 2 * nq * size;
+        q[nq].twin = dvec + (2 * nq + 1) * size;
+        q[nq].sign = dirs == VEC_RIGHT ? 1 : -1;
+      }
+      q[nq].exclude = exclude + nq * 3;
+      q[nq].nb_exclude = 3;
+      q[nq].threshold = 0;
+      q[nq].best = best + nq * K;
+      q[nq].score = bestd + nq * K;
+      nq++;
+    }
+    if (nq > 0) VecTopN(&model, q, nq, K, 0);
+    if (nq > 0 && rerank) VecRerank(&exact, q, nq, K, N);
+    nq = 0;
+    for (a = b; a < c; a++) {
+      e = ev + a;
+      if (e->kind != EVENT_QUESTION || e->b[0] < 0 || e->b[1] < 0 || e->b[2] < 0 || e->b[3] < 0) continue;
+      e->best = best[nq * K];
+      nq++;
+    }
+  }
+  //Same report as when the questions were scored one by one
+  TCN = 0;
+  for (b = 0; b < nb_events; b++) {
+    e = ev + b;
+    if (e->kind == EVENT_END_SECTION) {
+      if (TCN == 0) TCN = 1;
+      if (QID != 0) {
+        printf("ACCURACY TOP1: %.2f %%  (%d / %d)\n", CCN / (float)TCN * 100, CCN, TCN);
+        printf("Total accuracy: %.2f %%   Semantic accuracy: %.2f %%   Syntactic accuracy: %.2f %% \n", CACN / (float)TACN * 100, SEAC / (float)SECN * 100, SYAC / (float)SYCN * 100);
       }
+      QID++;
+      continue;
     }
-    if (!strcmp(st4, bestw[0])) {
+    if (e->kind == EVENT_SECTION) {
+      printf("%s:\n", e->name);
+      TCN = 0;
+      CCN = 0;
+      continue;
+    }
+    TQ++;
+    if (e->b[0] < 0 || e->b[1] < 0 || e->b[2] < 0 || e->b[3] < 0) continue;
+    TQS++;
+    if (e->best >= 0 && !strcasecmp(e->name, VecWord(&model, e->best))) {
       CCN++;
       CACN++;
       if (QID <= 5) SEAC++; else SYAC++;
@@ -139,5 +189,15 @@ int main(int argc, char **argv)
     TACN++;
   }
   printf("Questions seen / total: %d %d   %.2f %% \n", TQS, TQ, TQS/(float)TQ*100);
+  for (b = 0; b < nb_events; b++) if (ev[b].kind != EVENT_END_SECTION) free(ev[b].name);
+  free(ev);
+  free(vec);
+  free(dvec);
+  free(exclude);
+  free(best);
+  free(bestd);
+  free(q);
+  if (rerank) VecClose(&exact);
+  VecClose(&model);
   return 0;
 }
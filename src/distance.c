@@ -13,130 +13,186 @@
 //  limitations under the License.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <malloc.h>
+#include <unistd.h>
+#include "vecfile.h"
+#include "vecsearch.h"
+#include "hnsw.h"
 
 const long long max_size = 2000;         // max length of strings
 const long long N = 40;                  // number of closest words that will be shown
-const long long max_w = 50;              // max length of vocabulary entries
+const long long max_batch = 1024;        // queries scored in one pass when they come from a pipe or a file
+const long long R = 400;                 // candidates of a compressed model re-scored with the float rows
+
+// Reads one line, returns 0 at the end of the input
+int ReadLine(char *st1) {
+  long long a = 0;
+  int ch;
+  while (1) {
+    ch = fgetc(stdin);
+    if (ch == EOF && a == 0) return 0;
+    if (ch == EOF || ch == '\n' || a >= max_size - 1) {
+      st1[a] = 0;
+      return 1;
+    }
+    st1[a++] = ch;
+  }
+}
+
+// Splits a line on spaces, returns the number of words
+long long SplitWords(const char *st1, char st[][max_size]) {
+  long long b = 0, c = 0, cn = 0;
+  while (1) {
+    st[cn][b] = st1[c];
+    b++;
+    c++;
+    st[cn][b] = 0;
+    if (st1[c] == 0) break;
+    if (st1[c] == ' ') {
+      cn++;
+      b = 0;
+      c++;
+    }
+  }
+  return cn + 1;
+}
 
 int main(int argc, char **argv) {
-  FILE *f;
-  char st1[max_size];
-  char *bestw[N];
-  char file_name[max_size], st[100][max_size];
-  float dist, len, bestd[N], vec[max_size];
-  long long words, size, a, b, c, d, cn, bi[100];
-  char ch;
-  float *M;
-  char *vocab;
+  char *lines, file_name[max_size], st[100][max_size];
+  float len, *vec, *dvec, *bestd, *row;
+  const float *wv;
+  long long size, a, b, i, cn, nq, nb_scored, K = N, *bi, *best;
+  int interactive, done = 0, *found, dirs = 0, d, ef = 0, rerank = 0;
+  struct vec_model model, exact, *rows;
+  struct vec_query *q;
+  struct hnsw_index index;
   if (argc < 2) {
-    printf("Usage: ./distance <FILE>\nwhere FILE contains word projections in the BINARY FORMAT\n");
+    printf("Usage: ./distance <FILE> [MODE]...\nwhere FILE contains word projections in the BINARY or native FORMAT\n");
+    printf("and MODE ranks the words of complex and 2real models by their order-sensitive score instead of the cosine:\n");
+    printf("right, left or both for the words seen on the right or on the left of the input, prefixed by complex- or\n");
+    printf("2real- for word2vec files (e.g. complex-right)\n");
+    printf("MODE can also be ann or ann=<ef> to search the approximate index FILE.hnsw built by hnsw-build, keeping the\n");
+    printf("ef best candidates (default 100, more is slower and closer to the exact results)\n");
+    printf("FILE can be compressed by pq-compress: a rerank=<FLOAT FILE> mode re-scores its best candidates exactly\n");
     return 0;
   }
   strcpy(file_name, argv[1]);
-  f = fopen(file_name, "rb");
-  if (f == NULL) {
-    printf("Input file not found\n");
-    return -1;
+  if (VecOpen(file_name, &model, 0, 1)) return -1;
+  for (i = 2; i < argc; i++) {
+    if (!strncmp(argv[i], "ann", 3)) {
+      ef = argv[i][3] == '=' ? atoi(argv[i] + 4) : 100;
+      if (ef <= 0 || (argv[i][3] != 0 && argv[i][3] != '=')) {
+        printf("Unknown mode %s\n", argv[i]);
+        return -1;
+      }
+      sprintf(file_name, "%s.hnsw", argv[1]);
+      if (HnswLoad(&index, file_name, &model)) return -1;
+    } else if (!strncmp(argv[i], "rerank=", 7)) {
+      if (VecOpen(argv[i] + 7, &exact, 0, 1)) return -1;
+      if (model.precision != VEC_PRECISION_PQ8 || exact.M == NULL || exact.words != model.words || exact.size != model.size) {
+        printf("rerank needs a compressed FILE and the float model it was compressed from\n");
+        return -1;
+      }
+      rerank = 1;
+      K = R;
+    } else if ((dirs = VecDirections(&model, argv[i])) < 0) return -1;
   }
-  fscanf(f, "%lld", &words);
-  fscanf(f, "%lld", &size);
-  vocab = (char *)malloc((long long)words * max_w * sizeof(char));
-  for (a = 0; a < N; a++) bestw[a] = (char *)malloc(max_size * sizeof(char));
-  M = (float *)malloc((long long)words * (long long)size * sizeof(float));
-  if (M == NULL) {
-    printf("Cannot allocate memory: %lld MB    %lld  %lld\n", (long long)words * size * sizeof(float) / 1048576, words, size);
+  if (ef > 0 && dirs != 0) {
+    printf("The ann mode only ranks by cosine\n");
     return -1;
   }
-  for (b = 0; b < words; b++) {
-    a = 0;
-    while (1) {
-      vocab[b * max_w + a] = fgetc(f);
-      if (feof(f) || (vocab[b * max_w + a] == ' ')) break;
-      if ((a < max_w) && (vocab[b * max_w + a] != '\n')) a++;
-    }
-    vocab[b * max_w + a] = 0;
-    for (a = 0; a < size; a++) fread(&M[a + b * size], sizeof(float), 1, f);
-    len = 0;
-    for (a = 0; a < size; a++) len += M[a + b * size] * M[a + b * size];
-    len = sqrt(len);
-    for (a = 0; a < size; a++) M[a + b * size] /= len;
-  }
-  fclose(f);
-  while (1) {
-    for (a = 0; a < N; a++) bestd[a] = 0;
-    for (a = 0; a < N; a++) bestw[a][0] = 0;
-    printf("Enter word or sentence (EXIT to break): ");
-    a = 0;
-    while (1) {
-      st1[a] = fgetc(stdin);
-      if ((st1[a] == '\n') || (a >= max_size - 1)) {
-        st1[a] = 0;
+  //Query vectors come from the float rows when there are some
+  rows = rerank ? &exact : &model;
+  size = model.size;
+  row = (float *)malloc(size * sizeof(float));
+  lines = (char *)malloc(max_batch * max_size);
+  bi = (long long *)malloc(max_batch * 100 * sizeof(long long));
+  found = (int *)malloc(max_batch * sizeof(int));
+  vec = (float *)malloc(max_batch * size * sizeof(float));
+  dvec = (float *)malloc(2 * max_batch * size * sizeof(float));
+  //Results of query i: cosine or right neighbors at 2 * i, left neighbors at 2 * i + 1
+  best = (long long *)malloc(2 * max_batch * K * sizeof(long long));
+  bestd = (float *)malloc(2 * max_batch * K * sizeof(float));
+  q = (struct vec_query *)malloc(2 * max_batch * sizeof(struct vec_query));
+  //Interactive queries are answered one by one, piped queries in batches
+  interactive = isatty(0);
+  while (!done) {
+    for (nq = 0; nq < max_batch; nq++) {
+      if (interactive) printf("Enter word or sentence (EXIT to break): ");
+      if (!ReadLine(lines + nq * max_size) || !strcmp(lines + nq * max_size, "EXIT")) {
+        done = 1;
         break;
       }
-      a++;
-    }
-    if (!strcmp(st1, "EXIT")) break;
-    cn = 0;
-    b = 0;
-    c = 0;
-    while (1) {
-      st[cn][b] = st1[c];
-      b++;
-      c++;
-      st[cn][b] = 0;
-      if (st1[c] == 0) break;
-      if (st1[c] == ' ') {
-        cn++;
-        b = 0;
-        c++;
-      }
-    }
-    cn++;
-    for (a = 0; a < cn; a++) {
-      for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st[a])) break;
-      if (b == words) b = -1;
-      bi[a] = b;
-      printf("\nWord: %s  Position in vocabulary: %lld\n", st[a], bi[a]);
-      if (b == -1) {
-        printf("Out of dictionary word!\n");
+      if (interactive) {
+        nq++;
         break;
       }
     }
-    if (b == -1) continue;
-    printf("\n                                              Word       Cosine distance\n------------------------------------------------------------------------\n");
-    for (a = 0; a < size; a++) vec[a] = 0;
-    for (b = 0; b < cn; b++) {
-      if (bi[b] == -1) continue;
-      for (a = 0; a < size; a++) vec[a] += M[a + bi[b] * size];
+    //Query vectors: normalized sum of the word vectors
+    nb_scored = 0;
+    for (i = 0; i < nq; i++) {
+      cn = SplitWords(lines + i * max_size, st);
+      found[i] = 1;
+      for (a = 0; a < cn; a++) {
+        bi[i * 100 + a] = VecSearch(&model, st[a]);
+        if (bi[i * 100 + a] == -1) {
+          found[i] = 0;
+          break;
+        }
+      }
+      if (!found[i]) continue;
+      for (a = 0; a < size; a++) vec[i * size + a] = 0;
+      for (b = 0; b < cn; b++) {
+        wv = VecRow(rows, bi[i * 100 + b], row);
+        for (a = 0; a < size; a++) vec[i * size + a] += wv[a];
+      }
+      len = 0;
+      for (a = 0; a < size; a++) len += vec[i * size + a] * vec[i * size + a];
+      len = sqrt(len);
+      for (a = 0; a < size; a++) vec[i * size + a] /= len;
+      if (dirs != 0) VecDirectional(&model, vec + i * size, dvec + 2 * i * size, dvec + (2 * i + 1) * size);
+      for (d = 0; d < 2; d++) {
+        if (dirs == 0 ? d > 0 : !(dirs & (d == 0 ? VEC_RIGHT : VEC_LEFT))) continue;
+        q[nb_scored].vec = dirs == 0 ? vec + i * size : dvec + 2 * i * size;
+        q[nb_scored].twin = dirs == 0 ? NULL : dvec + (2 * i + 1) * size;
+        q[nb_scored].sign = d == 0 ? 1 : -1;
+        q[nb_scored].exclude = bi + i * 100;
+        q[nb_scored].nb_exclude = cn;
+        q[nb_scored].threshold = dirs == 0 ? -1 : -10;
+        q[nb_scored].best = best + (2 * i + d) * K;
+        q[nb_scored].score = bestd + (2 * i + d) * K;
+        nb_scored++;
+      }
     }
-    len = 0;
-    for (a = 0; a < size; a++) len += vec[a] * vec[a];
-    len = sqrt(len);
-    for (a = 0; a < size; a++) vec[a] /= len;
-    for (a = 0; a < N; a++) bestd[a] = -1;
-    for (a = 0; a < N; a++) bestw[a][0] = 0;
-    for (c = 0; c < words; c++) {
-      a = 0;
-      for (b = 0; b < cn; b++) if (bi[b] == c) a = 1;
-      if (a == 1) continue;
-      dist = 0;
-      for (a = 0; a < size; a++) dist += vec[a] * M[a + c * size];
-      for (a = 0; a < N; a++) {
-        if (dist > bestd[a]) {
-          for (d = N - 1; d > a; d--) {
-            bestd[d] = bestd[d - 1];
-            strcpy(bestw[d], bestw[d - 1]);
-          }
-          bestd[a] = dist;
-          strcpy(bestw[a], &vocab[c * max_w]);
+    if (nb_scored > 0 && ef > 0) HnswTopN(&index, &model, q, nb_scored, N, ef, 0);
+    else if (nb_scored > 0) VecTopN(&model, q, nb_scored, K, 0);
+    if (nb_scored > 0 && rerank) VecRerank(&exact, q, nb_scored, K, N);
+    for (i = 0; i < nq; i++) {
+      if (!interactive) printf("Enter word or sentence (EXIT to break): ");
+      cn = SplitWords(lines + i * max_size, st);
+      for (a = 0; a < cn; a++) {
+        printf("\nWord: %s  Position in vocabulary: %lld\n", st[a], bi[i * 100 + a]);
+        if (bi[i * 100 + a] == -1) {
+          printf("Out of dictionary word!\n");
           break;
         }
       }
+      if (!found[i]) continue;
+      for (d = 0; d < 2; d++) {
+        if (dirs == 0 ? d > 0 : !(dirs & (d == 0 ? VEC_RIGHT : VEC_LEFT))) continue;
+        if (dirs == 0) printf("\n                                              Word       Cosine distance\n------------------------------------------------------------------------\n");
+        else printf("\n                                              Word       %s score\n------------------------------------------------------------------------\n", d == 0 ? "Right" : " Left");
+        b = (2 * i + d) * K;
+        for (a = 0; a < N; a++) printf("%50s\t\t%f\n", best[b + a] >= 0 ? VecWord(&model, best[b + a]) : "", bestd[b + a]);
+      }
     }
-    for (a = 0; a < N; a++) printf("%50s\t\t%f\n", bestw[a], bestd[a]);
+    if (done && !interactive) printf("Enter word or sentence (EXIT to break): ");
   }
+  if (ef > 0) HnswFree(&index);
+  if (rerank) VecClose(&exact);
+  VecClose(&model);
   return 0;
 }
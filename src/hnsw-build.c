@@ -0,0 +1,70 @@
+// Builds the approximate nearest neighbor index FILE.hnsw of a model (see hnsw.h) and reports its recall and query
+// time against the exact search of distance and word-analogy
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vecfile.h"
+#include "vecsearch.h"
+#include "hnsw.h"
+
+const long long max_size = 2000;         // max length of strings
+const long long N = 40;                  // number of closest words that will be shown
+const long long nb_test = 200;           // sampled queries of each kind for the recall report
+
+int main(int argc, char **argv) {
+  char file_name[max_size];
+  int M = 16, ef_construction = 200, efs[] = {40, 80, 160, 320}, e;
+  long long size, nq, i, *words, *exact, *approx;
+  float *vec, *score;
+  double start;
+  struct vec_model model;
+  struct vec_query *q;
+  struct hnsw_index index;
+  if (argc < 2) {
+    printf("Usage: ./hnsw-build <FILE> [M] [EF]\nwhere FILE contains word projections in the BINARY or native FORMAT,\n");
+    printf("M is the number of neighbors of a word in the index (default 16) and EF the number of candidates\n");
+    printf("searched while inserting a word (default 200). The index is written to FILE.hnsw\n");
+    return 0;
+  }
+  if (argc > 2) M = atoi(argv[2]);
+  if (argc > 3) ef_construction = atoi(argv[3]);
+  if (M < 2 || ef_construction < 1) {
+    printf("M must be at least 2 and EF at least 1\n");
+    return -1;
+  }
+  if (VecOpen(argv[1], &model, 0, 1)) return -1;
+  size = model.size;
+  start = VecNow();
+  if (HnswBuild(&index, &model, M, ef_construction, 0)) return -1;
+  printf("Built the index of %lld words in %.1f s\n", model.words, VecNow() - start);
+  sprintf(file_name, "%s.hnsw", argv[1]);
+  if (HnswSave(&index, file_name)) return -1;
+  nq = 2 * nb_test;
+  words = (long long *)malloc(nq * 3 * sizeof(long long));
+  vec = (float *)malloc(nq * size * sizeof(float));
+  exact = (long long *)malloc(nq * N * sizeof(long long));
+  approx = (long long *)malloc(nq * N * sizeof(long long));
+  score = (float *)malloc(nq * N * sizeof(float));
+  q = (struct vec_query *)calloc(nq, sizeof(struct vec_query));
+  VecSampleQueries(&model, nb_test, words, vec, q);
+  for (i = 0; i < nq; i++) {
+    q[i].best = exact + i * N;
+    q[i].score = score + i * N;
+  }
+  start = VecNow();
+  VecTopN(&model, q, nq, N, 0);
+  printf("Exact search: %.3f ms per query\n", (VecNow() - start) * 1000 / nq);
+  printf("%8s %16s %16s %16s\n", "ef", "recall@40 word", "recall@40 b-a+c", "ms per query");
+  for (e = 0; e < (int)(sizeof(efs) / sizeof(efs[0])); e++) {
+    for (i = 0; i < nq; i++) q[i].best = approx + i * N;
+    start = VecNow();
+    //One query at a time on one thread, as an interactive lookup
+    for (i = 0; i < nq; i++) HnswTopN(&index, &model, q + i, 1, N, efs[e], 1);
+    printf("%8d %16.4f %16.4f %16.3f\n", efs[e], VecRecall(exact, approx, nb_test, N, N),
+           VecRecall(exact + nb_test * N, approx + nb_test * N, nb_test, N, N), (VecNow() - start) * 1000 / nq);
+  }
+  HnswFree(&index);
+  VecClose(&model);
+  return 0;
+}
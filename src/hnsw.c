@@ -0,0 +1,543 @@
+// HNSW approximate nearest neighbor index, see hnsw.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "hnsw.h"
+
+#define HNSW_LOCKS 65536   // node locks while building, node i uses lock i % HNSW_LOCKS
+
+struct hnsw_item {
+  float sim;
+  int id;
+};
+
+// Binary heap of items, the best (max heap) or the worst (min heap) one at the top
+struct hnsw_heap {
+  struct hnsw_item *a;
+  long long len, size;
+  int max;
+};
+
+// Per-thread search state
+struct hnsw_search {
+  unsigned int *visited, tag;
+  struct hnsw_heap cand, res;
+  struct hnsw_item *tmp;
+};
+
+struct hnsw_build_job {
+  struct hnsw_index *h;
+  const struct vec_model *m;
+  int ef;
+  long long *next;
+};
+
+static pthread_mutex_t *node_locks = NULL;
+static pthread_mutex_t entry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int Above(const struct hnsw_heap *hp, const struct hnsw_item *a, const struct hnsw_item *b) {
+  return hp->max ? a->sim > b->sim : a->sim < b->sim;
+}
+
+static void HeapInit(struct hnsw_heap *hp, int max) {
+  hp->size = 64;
+  hp->len = 0;
+  hp->max = max;
+  hp->a = (struct hnsw_item *)malloc(hp->size * sizeof(struct hnsw_item));
+}
+
+static void HeapPush(struct hnsw_heap *hp, float sim, int id) {
+  long long i = hp->len++;
+  struct hnsw_item tmp;
+  if (hp->len > hp->size) {
+    hp->size *= 2;
+    hp->a = (struct hnsw_item *)realloc(hp->a, hp->size * sizeof(struct hnsw_item));
+  }
+  hp->a[i].sim = sim;
+  hp->a[i].id = id;
+  while (i > 0 && Above(hp, &hp->a[i], &hp->a[(i - 1) / 2])) {
+    tmp = hp->a[i];
+    hp->a[i] = hp->a[(i - 1) / 2];
+    hp->a[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static struct hnsw_item HeapPop(struct hnsw_heap *hp) {
+  struct hnsw_item top = hp->a[0], tmp;
+  long long i = 0, c;
+  hp->a[0] = hp->a[--hp->len];
+  while (1) {
+    c = 2 * i + 1;
+    if (c >= hp->len) break;
+    if (c + 1 < hp->len && Above(hp, &hp->a[c + 1], &hp->a[c])) c++;
+    if (!Above(hp, &hp->a[c], &hp->a[i])) break;
+    tmp = hp->a[i];
+    hp->a[i] = hp->a[c];
+    hp->a[c] = tmp;
+    i = c;
+  }
+  return top;
+}
+
+static void SearchInit(struct hnsw_search *s, long long words) {
+  s->visited = (unsigned int *)calloc(words, sizeof(unsigned int));
+  s->tag = 0;
+  HeapInit(&s->cand, 1);
+  HeapInit(&s->res, 0);
+  s->tmp = NULL;
+}
+
+static void SearchFree(struct hnsw_search *s) {
+  free(s->visited);
+  free(s->cand.a);
+  free(s->res.a);
+  free(s->tmp);
+}
+
+static inline int *Links(const struct hnsw_index *h, long long i, int level) {
+  if (level == 0) return h->links0 + i * (h->M0 + 1);
+  return h->links[i] + (level - 1) * (h->M + 1);
+}
+
+// Copies the neighbors of node i in 'level' (under its lock while building), returns their number
+static int GetLinks(const struct hnsw_index *h, long long i, int level, int *out) {
+  int *l, n;
+  if (node_locks != NULL) pthread_mutex_lock(&node_locks[i % HNSW_LOCKS]);
+  l = Links(h, i, level);
+  n = l[0];
+  memcpy(out, l + 1, n * sizeof(int));
+  if (node_locks != NULL) pthread_mutex_unlock(&node_locks[i % HNSW_LOCKS]);
+  return n;
+}
+
+static inline float Sim(const struct vec_model *m, const float *v, long long i) {
+  return VecDot(v, m->M + i * m->size, m->size);
+}
+
+// Greedy walk of one layer towards v, from *cur with similarity *cur_sim
+static void Greedy(const struct hnsw_index *h, const struct vec_model *m, const float *v, int level, long long *cur,
+                   float *cur_sim, int *nb) {
+  int changed = 1, n, j;
+  float s;
+  while (changed) {
+    changed = 0;
+    n = GetLinks(h, *cur, level, nb);
+    for (j = 0; j < n; j++) {
+      s = Sim(m, v, nb[j]);
+      if (s > *cur_sim) {
+        *cur_sim = s;
+        *cur = nb[j];
+        changed = 1;
+      }
+    }
+  }
+}
+
+// Best-first search of one layer from 'ep', leaves the ef best nodes found in s->res (min heap)
+static void SearchLayer(const struct hnsw_index *h, const struct vec_model *m, struct hnsw_search *s, const float *v,
+                        long long ep, float ep_sim, int ef, int level, int *nb) {
+  struct hnsw_item c;
+  int n, j;
+  float sim;
+  s->tag++;
+  if (s->tag == 0) {
+    memset(s->visited, 0, h->words * sizeof(unsigned int));
+    s->tag = 1;
+  }
+  s->cand.len = 0;
+  s->res.len = 0;
+  s->visited[ep] = s->tag;
+  HeapPush(&s->cand, ep_sim, ep);
+  HeapPush(&s->res, ep_sim, ep);
+  while (s->cand.len > 0) {
+    c = HeapPop(&s->cand);
+    if (s->res.len >= ef && c.sim < s->res.a[0].sim) break;
+    n = GetLinks(h, c.id, level, nb);
+    for (j = 0; j < n; j++) {
+      if (s->visited[nb[j]] == s->tag) continue;
+      s->visited[nb[j]] = s->tag;
+      sim = Sim(m, v, nb[j]);
+      if (s->res.len < ef || sim > s->res.a[0].sim) {
+        HeapPush(&s->cand, sim, nb[j]);
+        HeapPush(&s->res, sim, nb[j]);
+        if (s->res.len > ef) HeapPop(&s->res);
+      }
+    }
+  }
+}
+
+static int ItemCompare(const void *a, const void *b) {
+  float x = ((const struct hnsw_item *)a)->sim, y = ((const struct hnsw_item *)b)->sim;
+  return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// Keeps at most max_n of the n candidates (sorted by decreasing similarity to the base node) in c: first the ones
+// that are closer to the base node than to any candidate kept before them, then the closest of the others, so that
+// words in dense clusters still get links from outside. Returns the number kept.
+static int SelectNeighbors(const struct vec_model *m, struct hnsw_item *c, int n, int max_n) {
+  int i, j, kept = 0, good;
+  struct hnsw_item it;
+  for (i = 0; i < n && kept < max_n; i++) {
+    good = 1;
+    for (j = 0; j < kept && good; j++) {
+      if (VecDot(m->M + (long long)c[i].id * m->size, m->M + (long long)c[j].id * m->size, m->size) > c[i].sim) good = 0;
+    }
+    if (!good) continue;
+    it = c[i];
+    memmove(c + kept + 1, c + kept, (i - kept) * sizeof(struct hnsw_item));
+    c[kept++] = it;
+  }
+  return n < max_n ? n : max_n;
+}
+
+// Adds node q to the neighbors of node i in 'level', pruning them if the list is full
+static void AddLink(struct hnsw_index *h, const struct vec_model *m, long long i, long long q, float sim, int level,
+                    struct hnsw_item *tmp) {
+  int *l, n, j, max_n = level == 0 ? h->M0 : h->M;
+  const float *v = m->M + i * m->size;
+  pthread_mutex_lock(&node_locks[i % HNSW_LOCKS]);
+  l = Links(h, i, level);
+  n = l[0];
+  for (j = 0; j < n; j++) if (l[1 + j] == q) break;
+  if (j < n) {
+    pthread_mutex_unlock(&node_locks[i % HNSW_LOCKS]);
+    return;
+  }
+  if (n < max_n) {
+    l[1 + n] = q;
+    l[0] = n + 1;
+  } else {
+    for (j = 0; j < n; j++) {
+      tmp[j].id = l[1 + j];
+      tmp[j].sim = Sim(m, v, l[1 + j]);
+    }
+    tmp[n].id = q;
+    tmp[n].sim = sim;
+    qsort(tmp, n + 1, sizeof(struct hnsw_item), ItemCompare);
+    n = SelectNeighbors(m, tmp, n + 1, max_n);
+    for (j = 0; j < n; j++) l[1 + j] = tmp[j].id;
+    l[0] = n;
+  }
+  pthread_mutex_unlock(&node_locks[i % HNSW_LOCKS]);
+}
+
+static void Insert(struct hnsw_index *h, const struct vec_model *m, struct hnsw_search *s, long long q, int ef,
+                   int *nb) {
+  const float *v = m->M + q * m->size;
+  long long cur, ep;
+  int level = h->levels[q], max_level, l, n, j;
+  float cur_sim;
+  pthread_mutex_lock(&entry_lock);
+  ep = h->entry;
+  max_level = h->max_level;
+  pthread_mutex_unlock(&entry_lock);
+  cur = ep;
+  cur_sim = Sim(m, v, cur);
+  for (l = max_level; l > level; l--) Greedy(h, m, v, l, &cur, &cur_sim, nb);
+  for (l = level < max_level ? level : max_level; l >= 0; l--) {
+    SearchLayer(h, m, s, v, cur, cur_sim, ef, l, nb);
+    n = s->res.len;
+    for (j = n - 1; j >= 0; j--) s->tmp[j] = HeapPop(&s->res);
+    n = SelectNeighbors(m, s->tmp, n, h->M);
+    pthread_mutex_lock(&node_locks[q % HNSW_LOCKS]);
+    Links(h, q, l)[0] = n;
+    for (j = 0; j < n; j++) Links(h, q, l)[1 + j] = s->tmp[j].id;
+    pthread_mutex_unlock(&node_locks[q % HNSW_LOCKS]);
+    //Next layer starts from the closest node found, before AddLink reuses tmp
+    cur = s->tmp[0].id;
+    cur_sim = s->tmp[0].sim;
+    memcpy(nb, s->tmp, n * sizeof(struct hnsw_item));
+    for (j = 0; j < n; j++) {
+      struct hnsw_item it = ((struct hnsw_item *)nb)[j];
+      AddLink(h, m, it.id, q, it.sim, l, s->tmp);
+    }
+  }
+  if (level > max_level) {
+    pthread_mutex_lock(&entry_lock);
+    if (level > h->max_level) {
+      h->max_level = level;
+      h->entry = q;
+    }
+    pthread_mutex_unlock(&entry_lock);
+  }
+}
+
+static void *BuildThread(void *arg) {
+  struct hnsw_build_job *job = (struct hnsw_build_job *)arg;
+  struct hnsw_index *h = job->h;
+  struct hnsw_search s;
+  long long q;
+  //Room for the neighbor lists, and for ef items when copied from the heap
+  int *nb = (int *)malloc((h->M0 + 2 * job->ef + 2) * sizeof(struct hnsw_item));
+  SearchInit(&s, h->words);
+  s.tmp = (struct hnsw_item *)malloc((h->M0 + job->ef + 2) * sizeof(struct hnsw_item));
+  while (1) {
+    pthread_mutex_lock(&entry_lock);
+    q = (*job->next)++;
+    pthread_mutex_unlock(&entry_lock);
+    if (q >= h->words) break;
+    Insert(h, job->m, &s, q, job->ef, nb);
+    if (q % 10000 == 0) {
+      printf("%cInserted: %lld/%lld", 13, q, h->words);
+      fflush(stdout);
+    }
+  }
+  SearchFree(&s);
+  free(nb);
+  return NULL;
+}
+
+// Pruning can leave a few nodes of layer 0 that no other node links to, which no search reaches: links each of
+// them from its closest neighbor that has room, or else in place of a link of that neighbor to a node with others
+static void LinkOrphans(struct hnsw_index *h) {
+  long long i, y;
+  int *in = (int *)calloc(h->words, sizeof(int)), *lx, *ly, j, k;
+  for (i = 0; i < h->words; i++) {
+    lx = Links(h, i, 0);
+    for (j = 1; j <= lx[0]; j++) in[lx[j]]++;
+  }
+  for (i = 0; i < h->words; i++) {
+    if (in[i] > 0 || i == h->entry) continue;
+    lx = Links(h, i, 0);
+    for (j = 1; j <= lx[0] && in[i] == 0; j++) {
+      y = lx[j];
+      ly = Links(h, y, 0);
+      if (ly[0] < h->M0) {
+        ly[++ly[0]] = i;
+        in[i]++;
+        break;
+      }
+    }
+    for (j = 1; j <= lx[0] && in[i] == 0; j++) {
+      ly = Links(h, lx[j], 0);
+      for (k = ly[0]; k >= 1; k--) if (in[ly[k]] > 1) {
+        in[ly[k]]--;
+        ly[k] = i;
+        in[i]++;
+        break;
+      }
+    }
+  }
+  free(in);
+}
+
+// Uniform (0, 1] from a node id
+static double NodeRandom(long long i) {
+  unsigned long long z = (unsigned long long)i * 0x9E3779B97F4A7C15ULL + 0x632BE59BD9B4E019ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return ((z >> 11) + 1.0) / 9007199254740992.0;
+}
+
+int HnswBuild(struct hnsw_index *h, const struct vec_model *m, int M, int ef_construction, int nb_threads) {
+  long long i, next = 1;
+  double ml = 1 / log(M);
+  pthread_t *pt;
+  struct hnsw_build_job job;
+  int t;
+  if (m->M == NULL) {
+    printf("The index needs the float rows, not a compressed model\n");
+    return -1;
+  }
+  if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_threads < 1) nb_threads = 1;
+  if (ef_construction < M) ef_construction = M;
+  h->words = m->words;
+  h->M = M;
+  h->M0 = 2 * M;
+  h->levels = (int *)malloc(h->words * sizeof(int));
+  h->links0 = (int *)calloc(h->words * (h->M0 + 1), sizeof(int));
+  h->links = (int **)calloc(h->words, sizeof(int *));
+  if (h->levels == NULL || h->links0 == NULL || h->links == NULL) {
+    printf("Cannot allocate memory for the index\n");
+    return -1;
+  }
+  for (i = 0; i < h->words; i++) {
+    h->levels[i] = (int)(-log(NodeRandom(i)) * ml);
+    if (h->levels[i] > 0) h->links[i] = (int *)calloc(h->levels[i] * (M + 1), sizeof(int));
+  }
+  h->entry = 0;
+  h->max_level = h->levels[0];
+  if (h->words <= 1) return 0;
+  node_locks = (pthread_mutex_t *)malloc(HNSW_LOCKS * sizeof(pthread_mutex_t));
+  for (i = 0; i < HNSW_LOCKS; i++) pthread_mutex_init(&node_locks[i], NULL);
+  job.h = h;
+  job.m = m;
+  job.ef = ef_construction;
+  job.next = &next;
+  pt = (pthread_t *)malloc(nb_threads * sizeof(pthread_t));
+  for (t = 0; t < nb_threads; t++) pthread_create(&pt[t], NULL, BuildThread, (void *)&job);
+  for (t = 0; t < nb_threads; t++) pthread_join(pt[t], NULL);
+  printf("%cInserted: %lld/%lld\n", 13, h->words, h->words);
+  LinkOrphans(h);
+  free(pt);
+  for (i = 0; i < HNSW_LOCKS; i++) pthread_mutex_destroy(&node_locks[i]);
+  free(node_locks);
+  node_locks = NULL;
+  return 0;
+}
+
+int HnswSave(const struct hnsw_index *h, const char *file_name) {
+  struct hnsw_header hd;
+  long long i;
+  FILE *f = fopen(file_name, "wb");
+  if (f == NULL) {
+    printf("Cannot open %s for writing\n", file_name);
+    return -1;
+  }
+  memset(&hd, 0, sizeof(hd));
+  memcpy(hd.magic, HNSW_MAGIC, sizeof(hd.magic));
+  hd.version = HNSW_VERSION;
+  hd.M = h->M;
+  hd.words = h->words;
+  hd.entry = h->entry;
+  hd.max_level = h->max_level;
+  fwrite(&hd, sizeof(hd), 1, f);
+  fwrite(h->levels, sizeof(int), h->words, f);
+  fwrite(h->links0, sizeof(int), h->words * (h->M0 + 1), f);
+  for (i = 0; i < h->words; i++) if (h->levels[i] > 0) fwrite(h->links[i], sizeof(int), h->levels[i] * (h->M + 1), f);
+  if (ferror(f)) {
+    printf("Error while writing %s\n", file_name);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+  return 0;
+}
+
+int HnswLoad(struct hnsw_index *h, const char *file_name, const struct vec_model *m) {
+  struct hnsw_header hd;
+  long long i, ok;
+  FILE *f;
+  memset(h, 0, sizeof(struct hnsw_index));
+  if (m->M == NULL) {
+    printf("The index needs the float rows, not a compressed model\n");
+    return -1;
+  }
+  f = fopen(file_name, "rb");
+  if (f == NULL) {
+    printf("Index file %s not found, build it with hnsw-build\n", file_name);
+    return -1;
+  }
+  if (fread(&hd, sizeof(hd), 1, f) != 1 || memcmp(hd.magic, HNSW_MAGIC, sizeof(hd.magic)) || hd.version != HNSW_VERSION) {
+    printf("%s is not an index file\n", file_name);
+    fclose(f);
+    return -1;
+  }
+  if ((long long)hd.words != m->words) {
+    printf("The index %s has %lld words, the model %lld\n", file_name, (long long)hd.words, m->words);
+    fclose(f);
+    return -1;
+  }
+  h->words = hd.words;
+  h->M = hd.M;
+  h->M0 = 2 * hd.M;
+  h->entry = hd.entry;
+  h->max_level = hd.max_level;
+  h->levels = (int *)malloc(h->words * sizeof(int));
+  h->links0 = (int *)malloc(h->words * (h->M0 + 1) * sizeof(int));
+  h->links = (int **)calloc(h->words, sizeof(int *));
+  ok = fread(h->levels, sizeof(int), h->words, f) == (size_t)h->words;
+  ok = ok && fread(h->links0, sizeof(int), h->words * (h->M0 + 1), f) == (size_t)(h->words * (h->M0 + 1));
+  for (i = 0; ok && i < h->words; i++) if (h->levels[i] > 0) {
+    h->links[i] = (int *)malloc(h->levels[i] * (h->M + 1) * sizeof(int));
+    ok = fread(h->links[i], sizeof(int), h->levels[i] * (h->M + 1), f) == (size_t)(h->levels[i] * (h->M + 1));
+  }
+  fclose(f);
+  if (!ok) {
+    printf("Truncated index file %s\n", file_name);
+    HnswFree(h);
+    return -1;
+  }
+  return 0;
+}
+
+void HnswFree(struct hnsw_index *h) {
+  long long i;
+  if (h->links != NULL) for (i = 0; i < h->words; i++) free(h->links[i]);
+  free(h->links);
+  free(h->links0);
+  free(h->levels);
+  memset(h, 0, sizeof(struct hnsw_index));
+}
+
+struct hnsw_query_job {
+  const struct hnsw_index *h;
+  const struct vec_model *m;
+  struct vec_query *q;
+  long long first, last, n;
+  int ef;
+};
+
+static int Excluded(const struct vec_query *q, long long row) {
+  int i;
+  for (i = 0; i < q->nb_exclude; i++) if (q->exclude[i] == row) return 1;
+  return 0;
+}
+
+static void *QueryThread(void *arg) {
+  struct hnsw_query_job *job = (struct hnsw_query_job *)arg;
+  const struct hnsw_index *h = job->h;
+  struct hnsw_search s;
+  struct vec_query *q;
+  long long i, k, cur;
+  int ef, j, n, l;
+  int *nb = (int *)malloc((h->M0 + 1) * sizeof(int));
+  float cur_sim;
+  SearchInit(&s, h->words);
+  for (i = job->first; i < job->last; i++) {
+    q = job->q + i;
+    ef = job->ef > job->n + q->nb_exclude ? job->ef : job->n + q->nb_exclude;
+    cur = h->entry;
+    cur_sim = Sim(job->m, q->vec, cur);
+    for (l = h->max_level; l > 0; l--) Greedy(h, job->m, q->vec, l, &cur, &cur_sim, nb);
+    SearchLayer(h, job->m, &s, q->vec, cur, cur_sim, ef, 0, nb);
+    n = s.res.len;
+    s.tmp = (struct hnsw_item *)realloc(s.tmp, n * sizeof(struct hnsw_item));
+    for (j = n - 1; j >= 0; j--) s.tmp[j] = HeapPop(&s.res);
+    for (j = 0, k = 0; j < n && k < job->n; j++) {
+      if (!(s.tmp[j].sim > q->threshold) || Excluded(q, s.tmp[j].id)) continue;
+      q->best[k] = s.tmp[j].id;
+      q->score[k] = s.tmp[j].sim;
+      k++;
+    }
+    for (; k < job->n; k++) {
+      q->best[k] = -1;
+      q->score[k] = q->threshold;
+    }
+  }
+  SearchFree(&s);
+  free(nb);
+  return NULL;
+}
+
+void HnswTopN(const struct hnsw_index *h, const struct vec_model *m, struct vec_query *q, long long nq, long long n,
+              int ef, int nb_threads) {
+  struct hnsw_query_job *jobs;
+  pthread_t *pt;
+  int t;
+  if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_threads < 1) nb_threads = 1;
+  if (nq < nb_threads) nb_threads = nq > 0 ? nq : 1;
+  jobs = (struct hnsw_query_job *)calloc(nb_threads, sizeof(struct hnsw_query_job));
+  pt = (pthread_t *)malloc(nb_threads * sizeof(pthread_t));
+  for (t = 0; t < nb_threads; t++) {
+    jobs[t].h = h;
+    jobs[t].m = m;
+    jobs[t].q = q;
+    jobs[t].n = n;
+    jobs[t].ef = ef;
+    jobs[t].first = nq * t / nb_threads;
+    jobs[t].last = nq * (t + 1) / nb_threads;
+    pthread_create(&pt[t], NULL, QueryThread, (void *)&jobs[t]);
+  }
+  for (t = 0; t < nb_threads; t++) pthread_join(pt[t], NULL);
+  free(jobs);
+  free(pt);
+}
@@ -0,0 +1,51 @@
+// Approximate nearest neighbor index (HNSW: hierarchical navigable small world graph) over the normalized rows of
+// a model (see vecfile.h), for dot product / cosine queries.
+//
+// Every row is a node of layer 0, and of the layers above up to a random level (geometric, with 1 / ln(M) as
+// scale). A node has at most 2 * M neighbors in layer 0 and M in the others, chosen among the ef_construction
+// closest nodes found while inserting it with the usual diversity heuristic. A query descends greedily from the
+// entry point to layer 0, then keeps the ef best nodes of a best-first search there.
+//
+// Index file (<model file>.hnsw by default), in the byte order of the machine which wrote it:
+//   header   struct hnsw_header
+//   levels   words int32
+//   layer 0  words x (2 * M + 1) int32: number of neighbors, then the neighbors
+//   above    for each node of level l > 0, l x (M + 1) int32 for the layers 1 to l
+
+#ifndef HNSW_H
+#define HNSW_H
+
+#include <stdint.h>
+#include "vecfile.h"
+#include "vecsearch.h"
+
+#define HNSW_MAGIC "W2CHNSW\n"
+#define HNSW_VERSION 1
+
+struct hnsw_header {
+  char magic[8];
+  uint32_t version, M;
+  uint64_t words, entry;
+  int32_t max_level, reserved;
+};
+
+struct hnsw_index {
+  long long words, entry;
+  int M, M0, max_level;
+  int *levels;
+  int *links0;    // layer 0, words x (M0 + 1)
+  int **links;    // layers 1 to levels[i] of node i, levels[i] x (M + 1), NULL for level 0 nodes
+};
+
+// Builds the index of the rows of m with nb_threads threads (0: one per core)
+int HnswBuild(struct hnsw_index *h, const struct vec_model *m, int M, int ef_construction, int nb_threads);
+int HnswSave(const struct hnsw_index *h, const char *file_name);
+// Loads the index of m, returns 0, or -1 with a message on stdout
+int HnswLoad(struct hnsw_index *h, const char *file_name, const struct vec_model *m);
+void HnswFree(struct hnsw_index *h);
+
+// Approximate VecTopN for plain dot product queries (twin is ignored), searching with max(ef, n + excluded rows)
+void HnswTopN(const struct hnsw_index *h, const struct vec_model *m, struct vec_query *q, long long nq, long long n,
+              int ef, int nb_threads);
+
+#endif
@@ -0,0 +1,102 @@
+// Compresses a model into a product quantized file (see pq.h and vecfile.h) and reports the recall and query time
+// of its approximate search against the exact search of the float rows, with and without re-ranking
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "vecfile.h"
+#include "vecsearch.h"
+#include "pq.h"
+
+const long long N = 40;                  // number of closest words that will be shown
+const long long nb_test = 200;           // sampled queries of each kind for the recall report
+const long long sample = 65536;          // rows used to learn the codebooks
+
+int main(int argc, char **argv) {
+  int subspaces, iter = 25, r;
+  long long size, nq, i, a, *words, *exact, *approx, depths[] = {0, 100, 200, 400}, depth, max_depth = 400;
+  float *vec, len, *score, *codebooks;
+  uint8_t *codes;
+  double start, float_bytes, pq_bytes;
+  struct vec_model model, pq;
+  struct vec_query *q;
+  if (argc < 3) {
+    printf("Usage: ./pq-compress <FILE> <OUTPUT> [SUBSPACES] [ITER]\nwhere FILE contains word projections in the BINARY or native FORMAT,\n");
+    printf("SUBSPACES is the number of bytes of a compressed row (it must divide the vector size, default size / 4) and\n");
+    printf("ITER the number of k-means iterations (default 25). OUTPUT is a native file that the query tools search\n");
+    printf("directly; they re-score the best candidates with the float rows of FILE given as a rerank=FILE mode\n");
+    return 0;
+  }
+  if (VecOpen(argv[1], &model, 0, 0)) return -1;
+  if (model.M == NULL) {
+    printf("%s is already compressed\n", argv[1]);
+    return -1;
+  }
+  size = model.size;
+  //word2vec rows are normalized here so that their norms are kept
+  if (model.map == NULL) {
+    model.norms = (float *)malloc(model.words * sizeof(float));
+    for (i = 0; i < model.words; i++) {
+      len = 0;
+      for (a = 0; a < size; a++) len += model.M[i * size + a] * model.M[i * size + a];
+      model.norms[i] = len = sqrt(len);
+      if (len > 0) for (a = 0; a < size; a++) model.M[i * size + a] /= len;
+    }
+    model.flags |= VEC_NORMALIZED | VEC_HAS_NORMS;
+  }
+  subspaces = argc > 3 ? atoi(argv[3]) : size / 4;
+  if (argc > 4) iter = atoi(argv[4]);
+  codebooks = (float *)malloc(size * VEC_PQ_CENTROIDS * sizeof(float));
+  codes = (uint8_t *)malloc((model.words + VEC_PQ_BLOCK - 1) / VEC_PQ_BLOCK * VEC_PQ_BLOCK * subspaces);
+  start = VecNow();
+  if (PqTrain(&model, subspaces, iter, sample, 0, codebooks)) return -1;
+  printf("Learned %d codebooks in %.1f s\n", subspaces, VecNow() - start);
+  start = VecNow();
+  PqEncode(&model, subspaces, codebooks, codes, 0);
+  printf("Encoded %lld words in %.1f s\n", model.words, VecNow() - start);
+  if (VecWritePq(argv[2], &model, subspaces, codebooks, codes)) return -1;
+  free(codebooks);
+  free(codes);
+  if (VecOpen(argv[2], &pq, 0, 1)) return -1;
+  float_bytes = (double)model.words * size * sizeof(float);
+  pq_bytes = (double)model.words * subspaces + size * VEC_PQ_CENTROIDS * sizeof(float);
+  printf("Vectors: %.1f MB instead of %.1f MB (%.1fx smaller)\n", pq_bytes / 1048576, float_bytes / 1048576,
+         float_bytes / pq_bytes);
+  //Test queries from the float rows
+  nq = 2 * nb_test;
+  words = (long long *)malloc(nq * 3 * sizeof(long long));
+  vec = (float *)malloc(nq * size * sizeof(float));
+  exact = (long long *)malloc(nq * N * sizeof(long long));
+  approx = (long long *)malloc(nq * max_depth * sizeof(long long));
+  score = (float *)malloc(nq * max_depth * sizeof(float));
+  q = (struct vec_query *)calloc(nq, sizeof(struct vec_query));
+  VecSampleQueries(&model, nb_test, words, vec, q);
+  for (i = 0; i < nq; i++) {
+    q[i].best = exact + i * N;
+    q[i].score = score + i * N;
+  }
+  //One query at a time on one thread, as an interactive lookup
+  start = VecNow();
+  for (i = 0; i < nq; i++) VecTopN(&model, q + i, 1, N, 1);
+  printf("Exact search: %.3f ms per query\n", (VecNow() - start) * 1000 / nq);
+  printf("%8s %16s %16s %16s\n", "rerank", "recall@40 word", "recall@40 b-a+c", "ms per query");
+  for (r = 0; r < (int)(sizeof(depths) / sizeof(depths[0])); r++) {
+    depth = depths[r] > N ? depths[r] : N;
+    for (i = 0; i < nq; i++) {
+      q[i].best = approx + i * max_depth;
+      q[i].score = score + i * max_depth;
+    }
+    start = VecNow();
+    for (i = 0; i < nq; i++) {
+      VecTopN(&pq, q + i, 1, depth, 1);
+      if (depths[r] > 0) VecRerank(&model, q + i, 1, depth, N);
+    }
+    printf("%8lld %16.4f %16.4f %16.3f\n", depths[r], VecRecall(exact, approx, nb_test, N, max_depth),
+           VecRecall(exact + nb_test * N, approx + nb_test * max_depth, nb_test, N, max_depth), (VecNow() - start) * 1000 / nq);
+  }
+  VecClose(&pq);
+  if (model.map == NULL) free(model.norms);
+  VecClose(&model);
+  return 0;
+}
@@ -0,0 +1,191 @@
+// Product quantization, see pq.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "pq.h"
+
+struct pq_job {
+  const struct vec_model *m;
+  int subspaces, iter;
+  long long sample, first, last;   // subspaces [first, last), or rows [first, last) when encoding
+  const long long *rows;           // sampled rows
+  float *codebooks;
+  uint8_t *codes;
+};
+
+static unsigned long long NextRandom(unsigned long long *state) {
+  *state = *state * (unsigned long long)25214903917 + 11;
+  return *state >> 16;
+}
+
+// Closest of the VEC_PQ_CENTROIDS centroids (c, with their squared norms) to x
+static int Closest(const float *x, const float *c, const float *norms, long long dsub) {
+  long long k, a;
+  float dist, best_dist = FLT_MAX, dot;
+  int best = 0;
+  for (k = 0; k < VEC_PQ_CENTROIDS; k++) {
+    dot = 0;
+    for (a = 0; a < dsub; a++) dot += x[a] * c[k * dsub + a];
+    //|x - c|^2 without |x|^2, the same for all the centroids
+    dist = norms[k] - 2 * dot;
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = k;
+    }
+  }
+  return best;
+}
+
+static void CentroidNorms(const float *c, long long dsub, float *norms) {
+  long long k, a;
+  for (k = 0; k < VEC_PQ_CENTROIDS; k++) {
+    norms[k] = 0;
+    for (a = 0; a < dsub; a++) norms[k] += c[k * dsub + a] * c[k * dsub + a];
+  }
+}
+
+// k-means of the subspaces [first, last) over the sampled rows
+static void *TrainThread(void *arg) {
+  struct pq_job *job = (struct pq_job *)arg;
+  const struct vec_model *m = job->m;
+  long long dsub = m->size / job->subspaces, ns = job->sample, i, k, a, j, big;
+  unsigned long long seed;
+  float *x = (float *)malloc(ns * dsub * sizeof(float)), *c, *sum, norms[VEC_PQ_CENTROIDS];
+  float *row = (float *)malloc(m->size * sizeof(float));
+  long long *count = (long long *)malloc(VEC_PQ_CENTROIDS * sizeof(long long));
+  int *assign = (int *)malloc(ns * sizeof(int)), it;
+  sum = (float *)malloc(VEC_PQ_CENTROIDS * dsub * sizeof(float));
+  for (j = job->first; j < job->last; j++) {
+    c = job->codebooks + j * VEC_PQ_CENTROIDS * dsub;
+    for (i = 0; i < ns; i++) memcpy(x + i * dsub, VecRow(m, job->rows[i], row) + j * dsub, dsub * sizeof(float));
+    //Start from distinct sampled rows (they are shuffled), repeated if there are fewer rows than centroids
+    for (k = 0; k < VEC_PQ_CENTROIDS; k++) memcpy(c + k * dsub, x + (k % ns) * dsub, dsub * sizeof(float));
+    seed = j + 1;
+    for (it = 0; it < job->iter; it++) {
+      CentroidNorms(c, dsub, norms);
+      memset(sum, 0, VEC_PQ_CENTROIDS * dsub * sizeof(float));
+      memset(count, 0, VEC_PQ_CENTROIDS * sizeof(long long));
+      for (i = 0; i < ns; i++) {
+        assign[i] = Closest(x + i * dsub, c, norms, dsub);
+        count[assign[i]]++;
+        for (a = 0; a < dsub; a++) sum[assign[i] * dsub + a] += x[i * dsub + a];
+      }
+      big = 0;
+      for (k = 0; k < VEC_PQ_CENTROIDS; k++) if (count[k] > count[big]) big = k;
+      for (k = 0; k < VEC_PQ_CENTROIDS; k++) {
+        if (count[k] > 0) {
+          for (a = 0; a < dsub; a++) c[k * dsub + a] = sum[k * dsub + a] / count[k];
+          continue;
+        }
+        //An empty cluster takes a random row of the largest one
+        if (count[big] < 2) continue;
+        do i = NextRandom(&seed) % ns; while (assign[i] != big);
+        memcpy(c + k * dsub, x + i * dsub, dsub * sizeof(float));
+        assign[i] = k;
+        count[big]--;
+      }
+    }
+  }
+  free(x);
+  free(row);
+  free(count);
+  free(assign);
+  free(sum);
+  return NULL;
+}
+
+static void *EncodeThread(void *arg) {
+  struct pq_job *job = (struct pq_job *)arg;
+  const struct vec_model *m = job->m;
+  long long dsub = m->size / job->subspaces, i, j;
+  float *norms = (float *)malloc(job->subspaces * VEC_PQ_CENTROIDS * sizeof(float));
+  float *row = (float *)malloc(m->size * sizeof(float));
+  const float *v;
+  for (j = 0; j < job->subspaces; j++) {
+    CentroidNorms(job->codebooks + j * VEC_PQ_CENTROIDS * dsub, dsub, norms + j * VEC_PQ_CENTROIDS);
+  }
+  for (i = job->first; i < job->last; i++) {
+    v = VecRow(m, i, row);
+    for (j = 0; j < job->subspaces; j++) {
+      job->codes[(i / VEC_PQ_BLOCK * job->subspaces + j) * VEC_PQ_BLOCK + i % VEC_PQ_BLOCK] =
+          Closest(v + j * dsub, job->codebooks + j * VEC_PQ_CENTROIDS * dsub, norms + j * VEC_PQ_CENTROIDS, dsub);
+    }
+  }
+  free(norms);
+  free(row);
+  return NULL;
+}
+
+static int Threads(int nb_threads, long long work) {
+  if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_threads < 1) nb_threads = 1;
+  if (nb_threads > work) nb_threads = work > 0 ? work : 1;
+  return nb_threads;
+}
+
+int PqTrain(const struct vec_model *m, int subspaces, int iter, long long sample, int nb_threads, float *codebooks) {
+  struct pq_job *jobs;
+  pthread_t *pt;
+  long long *rows, i, k, tmp;
+  unsigned long long seed = 1;
+  int t;
+  if (subspaces <= 0 || m->size % subspaces != 0) {
+    printf("The number of subspaces must divide the vector size %lld\n", m->size);
+    return -1;
+  }
+  //Sample: the first rows of a random permutation
+  rows = (long long *)malloc(m->words * sizeof(long long));
+  for (i = 0; i < m->words; i++) rows[i] = i;
+  if (sample <= 0 || sample > m->words) sample = m->words;
+  for (i = 0; i < sample; i++) {
+    k = i + NextRandom(&seed) % (m->words - i);
+    tmp = rows[i];
+    rows[i] = rows[k];
+    rows[k] = tmp;
+  }
+  nb_threads = Threads(nb_threads, subspaces);
+  jobs = (struct pq_job *)calloc(nb_threads, sizeof(struct pq_job));
+  pt = (pthread_t *)malloc(nb_threads * sizeof(pthread_t));
+  for (t = 0; t < nb_threads; t++) {
+    jobs[t].m = m;
+    jobs[t].subspaces = subspaces;
+    jobs[t].iter = iter;
+    jobs[t].sample = sample;
+    jobs[t].rows = rows;
+    jobs[t].codebooks = codebooks;
+    jobs[t].first = (long long)subspaces * t / nb_threads;
+    jobs[t].last = (long long)subspaces * (t + 1) / nb_threads;
+    pthread_create(&pt[t], NULL, TrainThread, (void *)&jobs[t]);
+  }
+  for (t = 0; t < nb_threads; t++) pthread_join(pt[t], NULL);
+  free(jobs);
+  free(pt);
+  free(rows);
+  return 0;
+}
+
+void PqEncode(const struct vec_model *m, int subspaces, const float *codebooks, uint8_t *codes, int nb_threads) {
+  struct pq_job *jobs;
+  pthread_t *pt;
+  int t;
+  nb_threads = Threads(nb_threads, m->words);
+  memset(codes, 0, (m->words + VEC_PQ_BLOCK - 1) / VEC_PQ_BLOCK * VEC_PQ_BLOCK * subspaces);
+  jobs = (struct pq_job *)calloc(nb_threads, sizeof(struct pq_job));
+  pt = (pthread_t *)malloc(nb_threads * sizeof(pthread_t));
+  for (t = 0; t < nb_threads; t++) {
+    jobs[t].m = m;
+    jobs[t].subspaces = subspaces;
+    jobs[t].codebooks = (float *)codebooks;
+    jobs[t].codes = codes;
+    jobs[t].first = m->words * t / nb_threads;
+    jobs[t].last = m->words * (t + 1) / nb_threads;
+    pthread_create(&pt[t], NULL, EncodeThread, (void *)&jobs[t]);
+  }
+  for (t = 0; t < nb_threads; t++) pthread_join(pt[t], NULL);
+  free(jobs);
+  free(pt);
+}
@@ -0,0 +1,20 @@
+// Product quantization of the normalized rows of a model (see vecfile.h)
+//
+// The dims of a row are cut into subspaces of dims / subspaces floats. The VEC_PQ_CENTROIDS centroids of each
+// subspace are learned by k-means on a sample of the rows, then every row is replaced by the index of the closest
+// centroid in each subspace: subspaces bytes per row instead of 4 * dims.
+
+#ifndef PQ_H
+#define PQ_H
+
+#include <stdint.h>
+#include "vecfile.h"
+
+// Learns the codebooks (subspaces x VEC_PQ_CENTROIDS x dims / subspaces floats) with 'iter' k-means iterations on
+// at most 'sample' rows, one subspace per thread (nb_threads 0: one per core). Returns 0, or -1 with a message.
+int PqTrain(const struct vec_model *m, int subspaces, int iter, long long sample, int nb_threads, float *codebooks);
+
+// Codes of all the rows of m in the layout of vecfile.h ((words + VEC_PQ_BLOCK - 1) / VEC_PQ_BLOCK blocks)
+void PqEncode(const struct vec_model *m, int subspaces, const float *codebooks, uint8_t *codes, int nb_threads);
+
+#endif
@@ -0,0 +1,401 @@
+// Query server: loads a model once and answers requests over a Unix domain socket. Each line of a connection is a
+// request, answered by one line, in order:
+//   distance <word>...      closest words to the sum of the words, as distance
+//   analogy <a> <b> <c>     closest words to b - a + c, as word-analogy
+//   score <a> <b>           cosine of a and b, then for complex and 2real models the scores of b seen on the right
+//                           and on the left of a
+// Answers are "OK" followed by "word score" pairs or by the scores, or "ERR" followed by a message.
+//
+// The requests of all the connections go to one queue. Workers take them by batches of up to -batch requests,
+// waiting up to -wait microseconds for a batch to fill, and score a whole batch in one pass over the rows
+// (VecTopN). SIGHUP reloads the model file: batches in progress finish with the old model, the next ones use the
+// new one. Native files are mapped, so a new model must replace the file by a rename, never be written over it.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "vecfile.h"
+#include "vecsearch.h"
+
+#define MAX_LINE 65536     // longest request
+#define MAX_WORDS 100      // most words in a request
+
+struct connection {
+  int fd;
+  long long pending;       // requests queued and not answered yet
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+struct request {
+  char *line, *answer;
+  struct connection *conn;
+  struct request *next;
+};
+
+char file_name[MAX_LINE];
+int nb_workers = 0, max_batch = 256, wait_us = 200, top_n = 40, scan_threads = 1;
+struct vec_model *model;
+pthread_rwlock_t model_lock;
+struct request *queue_head = NULL, *queue_tail = NULL;
+long long queue_len = 0;
+pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+volatile sig_atomic_t reload_requested = 0, stop_requested = 0;
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+// Appends to a growing answer
+static void Append(char **s, long long *len, long long *cap, const char *text) {
+  long long n = strlen(text);
+  if (*len + n + 1 > *cap) {
+    *cap = 2 * (*len + n + 1);
+    *s = (char *)realloc(*s, *cap);
+  }
+  memcpy(*s + *len, text, n + 1);
+  *len += n;
+}
+
+static char *Error(const char *message, const char *word) {
+  char *s = (char *)malloc(strlen(message) + strlen(word) + 8);
+  sprintf(s, "ERR %s%s", message, word);
+  return s;
+}
+
+// Answers a batch of requests with the current model: the score requests directly, the others with one VecTopN
+static void AnswerBatch(struct request **batch, long long nb) {
+  struct vec_model *m = model;
+  long long size = m->size, i, j, k, a, cn, nq = 0, len, cap;
+  long long *rows = (long long *)malloc(nb * MAX_WORDS * sizeof(long long));
+  long long *best = (long long *)malloc(nb * top_n * sizeof(long long));
+  float *vec = (float *)calloc(nb * size, sizeof(float)), *bestd = (float *)malloc(nb * top_n * sizeof(float));
+  float *buf = (float *)malloc(size * sizeof(float)), *dvec = (float *)malloc(2 * size * sizeof(float)), norm;
+  const float *wv, *x;
+  struct vec_query *q = (struct vec_query *)malloc(nb * sizeof(struct vec_query));
+  long long *qi = (long long *)malloc(nb * sizeof(long long));
+  char *word[MAX_WORDS + 2], *line, *save, text[64];
+  for (i = 0; i < nb; i++) {
+    line = strdup(batch[i]->line);
+    cn = 0;
+    for (word[cn] = strtok_r(line, " \t\r", &save); word[cn] != NULL && cn <= MAX_WORDS; word[cn] = strtok_r(NULL, " \t\r", &save)) cn++;
+    if (cn == 0 || cn > MAX_WORDS) {
+      batch[i]->answer = Error(cn == 0 ? "empty request" : "too many words", "");
+      free(line);
+      continue;
+    }
+    for (a = 1; a < cn; a++) {
+      rows[i * MAX_WORDS + a - 1] = VecSearch(m, word[a]);
+      if (rows[i * MAX_WORDS + a - 1] == -1) break;
+    }
+    if (a < cn) batch[i]->answer = Error("out of dictionary word: ", word[a]);
+    else if (!strcmp(word[0], "score") && cn == 3) {
+      //Cosine, then the directional scores of b next to a
+      wv = VecRow(m, rows[i * MAX_WORDS], buf);
+      x = VecRow(m, rows[i * MAX_WORDS + 1], vec + i * size);
+      sprintf(text, "OK %f", VecDot(wv, x, size));
+      len = cap = 0;
+      batch[i]->answer = NULL;
+      Append(&batch[i]->answer, &len, &cap, text);
+      if (m->model == VEC_MODEL_COMPLEX || m->model == VEC_MODEL_2REAL) {
+        VecDirectional(m, wv, dvec, dvec + size);
+        sprintf(text, " %f %f", VecDot(dvec, x, size) + VecDot(dvec + size, x, size),
+                VecDot(dvec, x, size) - VecDot(dvec + size, x, size));
+        Append(&batch[i]->answer, &len, &cap, text);
+      }
+    } else if ((!strcmp(word[0], "distance") && cn >= 2) || (!strcmp(word[0], "analogy") && cn == 4)) {
+      //Same query vectors and thresholds as distance and word-analogy
+      if (word[0][0] == 'd') {
+        for (a = 0; a < cn - 1; a++) {
+          wv = VecRow(m, rows[i * MAX_WORDS + a], buf);
+          for (j = 0; j < size; j++) vec[i * size + j] += wv[j];
+        }
+      } else {
+        wv = VecRow(m, rows[i * MAX_WORDS + 1], buf);
+        for (j = 0; j < size; j++) vec[i * size + j] = wv[j];
+        wv = VecRow(m, rows[i * MAX_WORDS], buf);
+        for (j = 0; j < size; j++) vec[i * size + j] -= wv[j];
+        wv = VecRow(m, rows[i * MAX_WORDS + 2], buf);
+        for (j = 0; j < size; j++) vec[i * size + j] += wv[j];
+      }
+      norm = 0;
+      for (j = 0; j < size; j++) norm += vec[i * size + j] * vec[i * size + j];
+      norm = sqrt(norm);
+      for (j = 0; j < size; j++) vec[i * size + j] /= norm;
+      q[nq].vec = vec + i * size;
+      q[nq].twin = NULL;
+      q[nq].sign = 1;
+      q[nq].exclude = rows + i * MAX_WORDS;
+      q[nq].nb_exclude = cn - 1;
+      q[nq].threshold = word[0][0] == 'd' ? -1 : 0;
+      q[nq].best = best + nq * top_n;
+      q[nq].score = bestd + nq * top_n;
+      qi[nq++] = i;
+      batch[i]->answer = NULL;
+    } else batch[i]->answer = Error("unknown request: ", word[0]);
+    free(line);
+  }
+  if (nq > 0) VecTopN(m, q, nq, top_n, scan_threads);
+  for (k = 0; k < nq; k++) {
+    len = cap = 0;
+    Append(&batch[qi[k]]->answer, &len, &cap, "OK");
+    for (a = 0; a < top_n && q[k].best[a] >= 0; a++) {
+      Append(&batch[qi[k]]->answer, &len, &cap, " ");
+      Append(&batch[qi[k]]->answer, &len, &cap, VecWord(m, q[k].best[a]));
+      sprintf(text, " %f", q[k].score[a]);
+      Append(&batch[qi[k]]->answer, &len, &cap, text);
+    }
+  }
+  free(rows);
+  free(best);
+  free(vec);
+  free(bestd);
+  free(buf);
+  free(dvec);
+  free(q);
+  free(qi);
+}
+
+static void *WorkerThread(void *arg) {
+  struct request **batch = (struct request **)malloc(max_batch * sizeof(struct request *));
+  struct timespec deadline;
+  long long nb, i;
+  struct connection *c;
+  while (1) {
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_len == 0) pthread_cond_wait(&queue_cond, &queue_mutex);
+    //Micro-batching: give the batch a little time to fill
+    if (queue_len < max_batch && wait_us > 0) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += wait_us * 1000LL;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while (queue_len > 0 && queue_len < max_batch) {
+        if (pthread_cond_timedwait(&queue_cond, &queue_mutex, &deadline) == ETIMEDOUT) break;
+      }
+      if (queue_len == 0) {
+        pthread_mutex_unlock(&queue_mutex);
+        continue;
+      }
+    }
+    for (nb = 0; nb < max_batch && queue_head != NULL; nb++) {
+      batch[nb] = queue_head;
+      queue_head = queue_head->next;
+    }
+    if (queue_head == NULL) queue_tail = NULL;
+    queue_len -= nb;
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_rwlock_rdlock(&model_lock);
+    AnswerBatch(batch, nb);
+    pthread_rwlock_unlock(&model_lock);
+    for (i = 0; i < nb; i++) {
+      c = batch[i]->conn;
+      pthread_mutex_lock(&c->mutex);
+      if (--c->pending == 0) pthread_cond_signal(&c->cond);
+      pthread_mutex_unlock(&c->mutex);
+    }
+  }
+  return NULL;
+}
+
+static int WriteAll(int fd, const char *s, long long n) {
+  long long w;
+  while (n > 0) {
+    w = write(fd, s, n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    s += w;
+    n -= w;
+  }
+  return 0;
+}
+
+// Reads the requests of a connection: all the complete lines of each read are queued together, then answered
+static void *ConnectionThread(void *arg) {
+  struct connection *c = (struct connection *)arg;
+  char *buf = (char *)malloc(MAX_LINE), *p, *nl;
+  long long len = 0, n, i, nb, cap = 64;
+  struct request **reqs = (struct request **)malloc(cap * sizeof(struct request *)), *first, *last;
+  int ok = 1;
+  while (ok) {
+    n = read(c->fd, buf + len, MAX_LINE - len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    len += n;
+    nb = 0;
+    for (p = buf; (nl = memchr(p, '\n', buf + len - p)) != NULL; p = nl + 1) {
+      if (nb == cap) {
+        cap *= 2;
+        reqs = (struct request **)realloc(reqs, cap * sizeof(struct request *));
+      }
+      reqs[nb] = (struct request *)calloc(1, sizeof(struct request));
+      reqs[nb]->line = strndup(p, nl - p);
+      reqs[nb]->conn = c;
+      if (nb > 0) reqs[nb - 1]->next = reqs[nb];
+      nb++;
+    }
+    len -= p - buf;
+    memmove(buf, p, len);
+    if (len == MAX_LINE) {
+      WriteAll(c->fd, "ERR request too long\n", 21);
+      break;
+    }
+    if (nb == 0) continue;
+    first = reqs[0];
+    last = reqs[nb - 1];
+    c->pending = nb;
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail != NULL) queue_tail->next = first;
+    else queue_head = first;
+    queue_tail = last;
+    queue_len += nb;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_mutex_lock(&c->mutex);
+    while (c->pending > 0) pthread_cond_wait(&c->cond, &c->mutex);
+    pthread_mutex_unlock(&c->mutex);
+    for (i = 0; i < nb; i++) {
+      if (ok && (WriteAll(c->fd, reqs[i]->answer, strlen(reqs[i]->answer)) || WriteAll(c->fd, "\n", 1))) ok = 0;
+      free(reqs[i]->line);
+      free(reqs[i]->answer);
+      free(reqs[i]);
+    }
+  }
+  close(c->fd);
+  pthread_mutex_destroy(&c->mutex);
+  pthread_cond_destroy(&c->cond);
+  free(c);
+  free(buf);
+  free(reqs);
+  return NULL;
+}
+
+static void OnSignal(int sig) {
+  if (sig == SIGHUP) reload_requested = 1;
+  else stop_requested = 1;
+}
+
+static void Reload() {
+  struct vec_model *fresh = (struct vec_model *)malloc(sizeof(struct vec_model)), *old;
+  printf("Reloading %s\n", file_name);
+  if (VecOpen(file_name, fresh, 0, 1)) {
+    printf("Reload failed, still serving the previous model\n");
+    free(fresh);
+    return;
+  }
+  pthread_rwlock_wrlock(&model_lock);
+  old = model;
+  model = fresh;
+  pthread_rwlock_unlock(&model_lock);
+  VecClose(old);
+  free(old);
+  printf("Serving %lld words of %lld dimensions\n", model->words, model->size);
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  struct pollfd pfd;
+  pthread_rwlockattr_t attr;
+  pthread_t pt;
+  struct connection *c;
+  int i, fd, s;
+  if (argc < 3) {
+    printf("Usage: ./vec-server <FILE> <SOCKET> [options]\nwhere FILE contains word projections in the BINARY or native FORMAT, served on the Unix\n");
+    printf("domain socket SOCKET. Requests are lines: distance <word>..., analogy <a> <b> <c> or score <a> <b>\n");
+    printf("\nOptions:\n");
+    printf("\t-workers <int>\n");
+    printf("\t\tNumber of threads answering batches of requests; default is one per core\n");
+    printf("\t-batch <int>\n");
+    printf("\t\tMost requests scored in one pass over the model; default is 256\n");
+    printf("\t-wait <int>\n");
+    printf("\t\tMicroseconds a worker waits for a batch to fill; default is 200\n");
+    printf("\t-scan-threads <int>\n");
+    printf("\t\tThreads scoring one batch; default is 1\n");
+    printf("\t-top <int>\n");
+    printf("\t\tNumber of closest words answered; default is 40\n");
+    printf("\nSIGHUP reloads FILE, to be replaced by a rename (mv), not written over\n");
+    return 0;
+  }
+  strcpy(file_name, argv[1]);
+  if ((i = ArgPos((char *)"-workers", argc, argv)) > 0) nb_workers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-batch", argc, argv)) > 0) max_batch = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-wait", argc, argv)) > 0) wait_us = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-scan-threads", argc, argv)) > 0) scan_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-top", argc, argv)) > 0) top_n = atoi(argv[i + 1]);
+  if (nb_workers <= 0) nb_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_workers < 1) nb_workers = 1;
+  if (max_batch < 1) max_batch = 1;
+  if (top_n < 1) top_n = 1;
+  model = (struct vec_model *)malloc(sizeof(struct vec_model));
+  if (VecOpen(file_name, model, 0, 1)) return -1;
+  //A pending reload must not wait for the readers to run out
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&model_lock, &attr);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = OnSignal;
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(argv[2]) >= sizeof(addr.sun_path)) {
+    printf("Socket path too long\n");
+    return -1;
+  }
+  strcpy(addr.sun_path, argv[2]);
+  unlink(argv[2]);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 128)) {
+    printf("Cannot listen on %s: %s\n", argv[2], strerror(errno));
+    return -1;
+  }
+  for (i = 0; i < nb_workers; i++) {
+    pthread_create(&pt, NULL, WorkerThread, NULL);
+    pthread_detach(pt);
+  }
+  printf("Serving %lld words of %lld dimensions on %s\n", model->words, model->size, argv[2]);
+  fflush(stdout);
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (!stop_requested) {
+    if (reload_requested) {
+      reload_requested = 0;
+      Reload();
+      fflush(stdout);
+    }
+    if (poll(&pfd, 1, 200) <= 0) continue;
+    s = accept(fd, NULL, NULL);
+    if (s < 0) continue;
+    c = (struct connection *)calloc(1, sizeof(struct connection));
+    c->fd = s;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    pthread_create(&pt, NULL, ConnectionThread, (void *)c);
+    pthread_detach(pt);
+  }
+  close(fd);
+  unlink(argv[2]);
+  return 0;
+}
@@ -0,0 +1,456 @@
+// Reading and writing of the word vector files, see vecfile.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <strings.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vecfile.h"
+
+static uint64_t AlignUp(uint64_t pos) {
+  return (pos + VEC_ALIGN - 1) / VEC_ALIGN * VEC_ALIGN;
+}
+
+// Size of the matrix section (int8 files: their scales follow at the next multiple of VEC_ALIGN)
+static uint64_t MatrixSize(const struct vec_header *h) {
+  if (h->precision == VEC_PRECISION_INT8) return h->words * VecInt8Stride(h->dims);
+  return h->words * h->dims * sizeof(float);
+}
+
+// Maps a native file. Returns 0, 1 if the file is not in the native format, or -1 on error.
+static int VecMapNative(const char *file_name, struct vec_model *m, long long max_words) {
+  struct vec_header *h;
+  struct stat sb;
+  char magic[8];
+  void *map;
+  int fd = open(file_name, O_RDONLY);
+  if (fd == -1) {
+    printf("Input file not found\n");
+    return -1;
+  }
+  if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, VEC_MAGIC, sizeof(magic))) {
+    close(fd);
+    return 1;
+  }
+  fstat(fd, &sb);
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("Cannot map %s\n", file_name);
+    return -1;
+  }
+  h = (struct vec_header *)map;
+  if (h->version != VEC_VERSION || !(h->flags & VEC_NORMALIZED) || h->file_size != (uint64_t)sb.st_size ||
+      (h->precision != VEC_PRECISION_FLOAT32 && h->precision != VEC_PRECISION_PQ8 &&
+       h->precision != VEC_PRECISION_INT8) ||
+      (h->precision == VEC_PRECISION_PQ8 && (h->subspaces == 0 || h->dims % h->subspaces != 0))) {
+    printf("Unsupported or truncated model file %s\n", file_name);
+    munmap(map, sb.st_size);
+    return -1;
+  }
+  m->map = map;
+  m->map_size = sb.st_size;
+  m->words = h->words;
+  if (max_words > 0 && m->words > max_words) m->words = max_words;
+  m->size = h->dims;
+  m->model = h->model;
+  m->layout = h->layout;
+  m->precision = h->precision;
+  m->flags = h->flags;
+  m->offsets = (const uint64_t *)((char *)map + h->offsets_pos);
+  m->strings = (const char *)map + h->strings_pos;
+  if (h->precision == VEC_PRECISION_PQ8) {
+    m->subspaces = h->subspaces;
+    m->codebooks = (const float *)((char *)map + h->matrix_pos);
+    m->codes = (const uint8_t *)map + AlignUp(h->matrix_pos + h->dims * VEC_PQ_CENTROIDS * sizeof(float));
+  } else if (h->precision == VEC_PRECISION_INT8) {
+    m->rows8 = (const int8_t *)map + h->matrix_pos;
+    m->scales = (const float *)((char *)map + AlignUp(h->matrix_pos + MatrixSize(h)));
+  } else m->M = (float *)((char *)map + h->matrix_pos);
+  m->norms = (h->flags & VEC_HAS_NORMS) ? (float *)((char *)map + h->norms_pos) : NULL;
+  return 0;
+}
+
+// Hash of a word for the index, without case so that VecSearchNoCase can walk the same chains
+static uint64_t VecHash(const char *word) {
+  uint64_t hash = 0;
+  for (; *word; word++) hash = hash * 257 + toupper((unsigned char)*word);
+  return hash;
+}
+
+// Index of the words: open addressing with linear probing, rows inserted in order so that the first match along
+// a chain is the first occurrence in the file
+static void VecBuildIndex(struct vec_model *m) {
+  long long b;
+  uint64_t h;
+  m->hash_size = 1;
+  while (m->hash_size < 2 * (uint64_t)m->words + 1) m->hash_size *= 2;
+  m->hash = (int64_t *)malloc(m->hash_size * sizeof(int64_t));
+  memset(m->hash, -1, m->hash_size * sizeof(int64_t));
+  for (b = 0; b < m->words; b++) {
+    h = VecHash(VecWord(m, b)) & (m->hash_size - 1);
+    while (m->hash[h] != -1) h = (h + 1) & (m->hash_size - 1);
+    m->hash[h] = b;
+  }
+}
+
+// Rows decoded by one thread of VecReadWord2vec
+struct vec_read_job {
+  struct vec_model *m;
+  const char *data, *end;
+  const uint64_t *pos;
+  long long first, last;
+  int binary, normalize, error;
+};
+
+// Decodes the floats of the rows [first, last), from raw bytes or from text, and normalizes them
+static void *VecReadRows(void *arg) {
+  struct vec_read_job *job = (struct vec_read_job *)arg;
+  long long size = job->m->size, a, b, n;
+  const char *p;
+  char number[64];
+  float len, *row;
+  for (b = job->first; b < job->last; b++) {
+    row = job->m->M + b * size;
+    p = job->data + job->pos[b];
+    if (job->binary) memcpy(row, p, size * sizeof(float));
+    else for (a = 0; a < size; a++) {
+      while (p < job->end && (*p == ' ' || *p == '\t')) p++;
+      for (n = 0; p < job->end && n < 63 && *p != ' ' && *p != '\t' && *p != '\n'; n++) number[n] = *p++;
+      number[n] = 0;
+      if (n == 0) job->error = 1;
+      row[a] = strtof(number, NULL);
+    }
+    if (!job->normalize) continue;
+    len = 0;
+    for (a = 0; a < size; a++) len += row[a] * row[a];
+    len = sqrt(len);
+    for (a = 0; a < size; a++) row[a] /= len;
+  }
+  return NULL;
+}
+
+// Tells a text file from a binary one: the first row of a text file reads as 'size' numbers up to the newline
+static int VecLooksText(const char *p, const char *end, long long size) {
+  long long a;
+  char *next;
+  char number[64];
+  int n;
+  for (a = 0; a < size; a++) {
+    while (p < end && *p == ' ') p++;
+    for (n = 0; p < end && n < 63 && *p != ' ' && *p != '\n'; n++) number[n] = *p++;
+    number[n] = 0;
+    if (n == 0) return 0;
+    strtof(number, &next);
+    if (*next != 0) return 0;
+  }
+  while (p < end && *p == ' ') p++;
+  return p == end || *p == '\n';
+}
+
+// Reads a word2vec file, binary or text. The file is mapped, the words are copied to one arena while locating
+// the rows, then the rows are decoded and normalized by all the cores.
+static int VecReadWord2vec(const char *file_name, struct vec_model *m, long long max_words, int normalize) {
+  struct stat sb;
+  const char *data, *p, *end;
+  long long words, size, b, a, arena_size, arena_len = 0;
+  uint64_t *pos;
+  int fd, binary, t, nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_t *pt;
+  struct vec_read_job *jobs;
+  char *q;
+  fd = open(file_name, O_RDONLY);
+  if (fd == -1) {
+    printf("Input file not found\n");
+    return -1;
+  }
+  fstat(fd, &sb);
+  data = (const char *)mmap(NULL, sb.st_size > 0 ? sb.st_size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    printf("Cannot map %s\n", file_name);
+    return -1;
+  }
+  madvise((void *)data, sb.st_size, MADV_SEQUENTIAL);
+  end = data + sb.st_size;
+  // Header "words size\n"
+  words = size = 0;
+  for (p = data; p < end && *p == ' '; p++);
+  for (; p < end && *p >= '0' && *p <= '9'; p++) words = words * 10 + *p - '0';
+  for (; p < end && *p == ' '; p++);
+  for (; p < end && *p >= '0' && *p <= '9'; p++) size = size * 10 + *p - '0';
+  for (; p < end && *p != '\n'; p++);
+  if (p < end) p++;
+  if (size <= 0) {
+    printf("Invalid header in %s\n", file_name);
+    munmap((void *)data, sb.st_size);
+    return -1;
+  }
+  if (max_words > 0 && words > max_words) words = max_words;
+  arena_size = words * 16 + 1;
+  m->own_strings = (char *)malloc(arena_size);
+  m->own_offsets = (uint64_t *)malloc((words + 1) * sizeof(uint64_t));
+  pos = (uint64_t *)malloc((words + 1) * sizeof(uint64_t));
+  m->M = (float *)malloc(words * size * sizeof(float));
+  if (m->own_strings == NULL || m->own_offsets == NULL || pos == NULL || m->M == NULL) {
+    printf("Cannot allocate memory: %lld MB    %lld  %lld\n", words * size * (long long)sizeof(float) / 1048576, words, size);
+    return -1;
+  }
+  binary = -1;
+  for (b = 0; b < words; b++) {
+    // Word up to the space, newlines are skipped
+    m->own_offsets[b] = arena_len;
+    for (a = 0; p < end && *p != ' '; p++) {
+      if (*p == '\n' || a >= VEC_MAX_WORD) continue;
+      if (arena_len + 2 > arena_size) {
+        arena_size *= 2;
+        m->own_strings = (char *)realloc(m->own_strings, arena_size);
+      }
+      m->own_strings[arena_len++] = *p;
+      a++;
+    }
+    if (arena_len + 1 > arena_size) m->own_strings = (char *)realloc(m->own_strings, ++arena_size);
+    m->own_strings[arena_len++] = 0;
+    if (p < end) p++;
+    if (binary == -1) binary = !VecLooksText(p, end, size);
+    pos[b] = p - data;
+    if (binary) {
+      if (end - p < size * (long long)sizeof(float)) break;
+      p += size * sizeof(float);
+    } else {
+      q = memchr(p, '\n', end - p);
+      p = q != NULL ? q + 1 : end;
+    }
+  }
+  if (b < words) {
+    printf("Truncated model file %s: %lld rows out of %lld\n", file_name, b, words);
+    words = b;
+  }
+  m->own_offsets[words] = arena_len;
+  m->strings = m->own_strings;
+  m->offsets = m->own_offsets;
+  m->words = words;
+  m->size = size;
+  m->model = VEC_MODEL_REAL;
+  m->layout = VEC_LAYOUT_PLAIN;
+  m->precision = VEC_PRECISION_FLOAT32;
+  m->flags = normalize ? VEC_NORMALIZED : 0;
+  // Rows in parallel
+  if (nb_threads < 1) nb_threads = 1;
+  pt = (pthread_t *)malloc(nb_threads * sizeof(pthread_t));
+  jobs = (struct vec_read_job *)calloc(nb_threads, sizeof(struct vec_read_job));
+  for (t = 0; t < nb_threads; t++) {
+    jobs[t].m = m;
+    jobs[t].data = data;
+    jobs[t].end = end;
+    jobs[t].pos = pos;
+    jobs[t].first = words * t / nb_threads;
+    jobs[t].last = words * (t + 1) / nb_threads;
+    jobs[t].binary = binary;
+    jobs[t].normalize = normalize;
+    pthread_create(&pt[t], NULL, VecReadRows, (void *)&jobs[t]);
+  }
+  for (t = 0; t < nb_threads; t++) {
+    pthread_join(pt[t], NULL);
+    if (jobs[t].error) printf("Missing values in the rows of %s\n", file_name);
+  }
+  free(pt);
+  free(jobs);
+  free(pos);
+  munmap((void *)data, sb.st_size);
+  return 0;
+}
+
+int VecOpen(const char *file_name, struct vec_model *m, long long max_words, int normalize) {
+  int ret;
+  memset(m, 0, sizeof(struct vec_model));
+  ret = VecMapNative(file_name, m, max_words);
+  if (ret == 1) ret = VecReadWord2vec(file_name, m, max_words, normalize);
+  if (ret == 0) VecBuildIndex(m);
+  return ret;
+}
+
+void VecClose(struct vec_model *m) {
+  if (m->map != NULL) munmap(m->map, m->map_size);
+  else free(m->M);
+  free(m->own_strings);
+  free(m->own_offsets);
+  free(m->hash);
+  memset(m, 0, sizeof(struct vec_model));
+}
+
+const float *VecRow(const struct vec_model *m, long long i, float *buf) {
+  long long dsub, j;
+  if (m->M != NULL) return m->M + i * m->size;
+  if (m->rows8 != NULL) {
+    for (j = 0; j < m->size; j++) buf[j] = m->rows8[i * VecInt8Stride(m->size) + j] * m->scales[i];
+    return buf;
+  }
+  dsub = m->size / m->subspaces;
+  for (j = 0; j < m->subspaces; j++) {
+    memcpy(buf + j * dsub, m->codebooks + (j * VEC_PQ_CENTROIDS + VecCode(m, i, j)) * dsub, dsub * sizeof(float));
+  }
+  return buf;
+}
+
+long long VecSearch(const struct vec_model *m, const char *word) {
+  uint64_t h = VecHash(word) & (m->hash_size - 1);
+  while (m->hash[h] != -1) {
+    if (!strcmp(VecWord(m, m->hash[h]), word)) return m->hash[h];
+    h = (h + 1) & (m->hash_size - 1);
+  }
+  return -1;
+}
+
+long long VecSearchNoCase(const struct vec_model *m, const char *word) {
+  uint64_t h = VecHash(word) & (m->hash_size - 1);
+  while (m->hash[h] != -1) {
+    if (!strcasecmp(VecWord(m, m->hash[h]), word)) return m->hash[h];
+    h = (h + 1) & (m->hash_size - 1);
+  }
+  return -1;
+}
+
+static void WritePadding(FILE *f, uint64_t pos) {
+  char zero[VEC_ALIGN];
+  memset(zero, 0, VEC_ALIGN);
+  fwrite(zero, 1, AlignUp(pos) - pos, f);
+}
+
+// Fills the common fields of a native header for these words, up to matrix_pos
+static void InitHeader(struct vec_header *h, long long words, long long dims, const char *const *word) {
+  long long a;
+  memset(h, 0, sizeof(struct vec_header));
+  memcpy(h->magic, VEC_MAGIC, sizeof(h->magic));
+  h->version = VEC_VERSION;
+  h->flags = VEC_NORMALIZED | VEC_HAS_NORMS;
+  h->words = words;
+  h->dims = dims;
+  h->offsets_pos = VEC_HEADER_SIZE;
+  h->strings_pos = h->offsets_pos + (words + 1) * sizeof(uint64_t);
+  for (a = 0; a < words; a++) h->strings_size += strlen(word[a]) + 1;
+  h->matrix_pos = AlignUp(h->strings_pos + h->strings_size);
+}
+
+// Writes the header, offsets then strings
+static void WriteHead(FILE *f, const struct vec_header *h, const char *const *word) {
+  uint64_t pos = 0;
+  long long a;
+  fwrite(h, sizeof(struct vec_header), 1, f);
+  WritePadding(f, sizeof(struct vec_header));
+  for (a = 0; a <= (long long)h->words; a++) {
+    fwrite(&pos, sizeof(uint64_t), 1, f);
+    if (a < (long long)h->words) pos += strlen(word[a]) + 1;
+  }
+  for (a = 0; a < (long long)h->words; a++) fwrite(word[a], 1, strlen(word[a]) + 1, f);
+  WritePadding(f, h->strings_pos + h->strings_size);
+}
+
+int VecWriterOpen(struct vec_writer *w, const char *file_name, long long words, long long dims, int model,
+                  int layout, int precision, char **word) {
+  uint64_t pos;
+  memset(w, 0, sizeof(struct vec_writer));
+  w->f = fopen(file_name, "wb");
+  if (w->f == NULL) {
+    printf("Cannot open %s for writing\n", file_name);
+    return -1;
+  }
+  InitHeader(&w->h, words, dims, (const char *const *)word);
+  w->h.model = model;
+  w->h.layout = layout;
+  w->h.precision = precision;
+  pos = AlignUp(w->h.matrix_pos + MatrixSize(&w->h));
+  if (precision == VEC_PRECISION_INT8) pos = AlignUp(pos + words * sizeof(float));
+  w->h.norms_pos = pos;
+  w->h.file_size = w->h.norms_pos + words * sizeof(float);
+  WriteHead(w->f, &w->h, (const char *const *)word);
+  w->norms = (float *)malloc(words * sizeof(float));
+  w->tmp = (float *)malloc(dims * sizeof(float));
+  if (precision == VEC_PRECISION_INT8) {
+    w->scales = (float *)malloc(words * sizeof(float));
+    w->tmp8 = (int8_t *)calloc(VecInt8Stride(dims), 1);
+  }
+  return 0;
+}
+
+void VecWriterRow(struct vec_writer *w, const float *row) {
+  long long a, dims = w->h.dims;
+  float len = 0, max = 0;
+  for (a = 0; a < dims; a++) len += row[a] * row[a];
+  len = sqrt(len);
+  for (a = 0; a < dims; a++) w->tmp[a] = len > 0 ? row[a] / len : 0;
+  if (w->h.precision == VEC_PRECISION_INT8) {
+    //Symmetric quantization: the largest value of the row maps to +-127
+    for (a = 0; a < dims; a++) if (fabs(w->tmp[a]) > max) max = fabs(w->tmp[a]);
+    w->scales[w->row] = max / 127;
+    for (a = 0; a < dims; a++) w->tmp8[a] = max > 0 ? (int8_t)rint(w->tmp[a] / w->scales[w->row]) : 0;
+    fwrite(w->tmp8, 1, VecInt8Stride(dims), w->f);
+  } else fwrite(w->tmp, sizeof(float), dims, w->f);
+  w->norms[w->row++] = len;
+}
+
+int VecWriterClose(struct vec_writer *w) {
+  int ret = 0;
+  uint64_t pos = w->h.matrix_pos + MatrixSize(&w->h);
+  WritePadding(w->f, pos);
+  if (w->h.precision == VEC_PRECISION_INT8) {
+    fwrite(w->scales, sizeof(float), w->h.words, w->f);
+    WritePadding(w->f, AlignUp(pos) + w->h.words * sizeof(float));
+  }
+  fwrite(w->norms, sizeof(float), w->h.words, w->f);
+  if (w->row != (long long)w->h.words || ferror(w->f)) {
+    printf("Error while writing the model file\n");
+    ret = -1;
+  }
+  fclose(w->f);
+  free(w->norms);
+  free(w->scales);
+  free(w->tmp);
+  free(w->tmp8);
+  return ret;
+}
+
+int VecWritePq(const char *file_name, const struct vec_model *m, int subspaces, const float *codebooks,
+               const uint8_t *codes) {
+  struct vec_header h;
+  const char **word;
+  uint64_t codes_pos, codes_size = (m->words + VEC_PQ_BLOCK - 1) / VEC_PQ_BLOCK * VEC_PQ_BLOCK * subspaces;
+  long long a;
+  float one = 1;
+  int ret = 0;
+  FILE *f = fopen(file_name, "wb");
+  if (f == NULL) {
+    printf("Cannot open %s for writing\n", file_name);
+    return -1;
+  }
+  word = (const char **)malloc(m->words * sizeof(char *));
+  for (a = 0; a < m->words; a++) word[a] = VecWord(m, a);
+  InitHeader(&h, m->words, m->size, word);
+  h.model = m->model;
+  h.layout = m->layout;
+  h.precision = VEC_PRECISION_PQ8;
+  h.subspaces = subspaces;
+  codes_pos = AlignUp(h.matrix_pos + m->size * VEC_PQ_CENTROIDS * sizeof(float));
+  h.norms_pos = AlignUp(codes_pos + codes_size);
+  h.file_size = h.norms_pos + m->words * sizeof(float);
+  WriteHead(f, &h, word);
+  fwrite(codebooks, sizeof(float), m->size * VEC_PQ_CENTROIDS, f);
+  WritePadding(f, h.matrix_pos + m->size * VEC_PQ_CENTROIDS * sizeof(float));
+  fwrite(codes, 1, codes_size, f);
+  WritePadding(f, codes_pos + codes_size);
+  if (m->norms != NULL) fwrite(m->norms, sizeof(float), m->words, f);
+  else for (a = 0; a < m->words; a++) fwrite(&one, sizeof(float), 1, f);
+  if (ferror(f)) {
+    printf("Error while writing the model file\n");
+    ret = -1;
+  }
+  fclose(f);
+  free(word);
+  return ret;
+}
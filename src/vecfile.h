@@ -0,0 +1,133 @@
+// Word vector files shared by the trainer and the query tools.
+//
+// Besides the word2vec format ("words size\n" then "word " + floats per row), models can be saved in a native
+// format that the tools map in memory without any parsing, so that processes share one page-cached copy:
+//
+//   header     struct vec_header, VEC_HEADER_SIZE bytes
+//   offsets    words + 1 uint64, offset of each word in the strings (the last one is the strings size)
+//   strings    the words, each terminated by '\0'
+//   matrix     at a multiple of VEC_ALIGN, words rows of dims floats, each normalized to unit length
+//   norms      at a multiple of VEC_ALIGN, words floats, the original row norms
+//
+// Product quantized files (precision VEC_PRECISION_PQ8) replace the matrix by codes: the dims of a row are cut into
+// 'subspaces' runs of dims / subspaces floats, and each run is replaced by the byte index of its closest centroid
+// in the codebook of the subspace:
+//   codebooks  at matrix_pos, subspaces x VEC_PQ_CENTROIDS centroids of dims / subspaces floats
+//   codes      at the next multiple of VEC_ALIGN, by blocks of VEC_PQ_BLOCK rows (the last one padded): the codes of
+//              subspace 0 of the rows of the block, then of subspace 1, ... so that a scan reads them in sequence
+//
+// Int8 files (precision VEC_PRECISION_INT8) store each normalized row as int8 values times a per-row scale:
+//   matrix     words rows of VecInt8Stride(dims) int8 (zero padded), row i is scales[i] * matrix[i]
+//   scales     at the next multiple of VEC_ALIGN, words floats
+//
+// All the numbers are in the byte order of the machine which wrote the file.
+
+#ifndef VECFILE_H
+#define VECFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define VEC_MAGIC "W2CVEC\n"
+#define VEC_VERSION 1
+#define VEC_HEADER_SIZE 128
+#define VEC_ALIGN 64
+#define VEC_MAX_WORD 1000  // longer words of word2vec files are truncated
+
+// Model which produced the vectors
+#define VEC_MODEL_REAL 0
+#define VEC_MODEL_2REAL 1
+#define VEC_MODEL_COMPLEX 2
+
+// Layout of a row: one part, or the two parts (real and imaginary, right and left) interleaved per dimension
+#define VEC_LAYOUT_PLAIN 0
+#define VEC_LAYOUT_INTERLEAVED 1
+
+// Precision of the matrix
+#define VEC_PRECISION_FLOAT32 0
+#define VEC_PRECISION_PQ8 1
+#define VEC_PRECISION_INT8 2
+
+#define VEC_PQ_CENTROIDS 256
+#define VEC_PQ_BLOCK 32
+#define VEC_INT8_ALIGN 32   // int8 rows are padded to a multiple of 32 values, one AVX2 register
+
+// Flags
+#define VEC_NORMALIZED 1  // the matrix rows have unit length
+#define VEC_HAS_NORMS 2   // the norms section is present
+
+struct vec_header {
+  char magic[8];
+  uint32_t version, model, layout, precision, flags, subspaces;
+  uint64_t words, dims;
+  uint64_t offsets_pos, strings_pos, strings_size, matrix_pos, norms_pos, file_size;
+};
+
+// A loaded model: rows of M are normalized, word i is strings + offsets[i]. Product quantized models have no M but
+// codebooks and codes, int8 models rows8 and scales, see VecRow.
+struct vec_model {
+  long long words, size;
+  int model, layout, precision, flags, subspaces;
+  float *M, *norms;
+  const float *codebooks;
+  const uint8_t *codes;
+  const int8_t *rows8;
+  const float *scales;
+  const char *strings;
+  const uint64_t *offsets;
+  // Native files are mapped, word2vec files are read into owned buffers
+  void *map;
+  size_t map_size;
+  char *own_strings;
+  uint64_t *own_offsets;
+  // Word index
+  int64_t *hash;
+  uint64_t hash_size;
+};
+
+static inline const char *VecWord(const struct vec_model *m, long long i) {
+  return m->strings + m->offsets[i];
+}
+
+static inline long long VecInt8Stride(long long dims) {
+  return (dims + VEC_INT8_ALIGN - 1) / VEC_INT8_ALIGN * VEC_INT8_ALIGN;
+}
+
+// Code of subspace j of row i in a product quantized model
+static inline int VecCode(const struct vec_model *m, long long i, int j) {
+  return m->codes[(i / VEC_PQ_BLOCK * m->subspaces + j) * VEC_PQ_BLOCK + i % VEC_PQ_BLOCK];
+}
+
+// Opens a native file, or a binary or text word2vec file, keeping at most max_words rows if max_words > 0. The
+// rows of word2vec files are normalized if 'normalize' is set (native files are always normalized).
+// Returns 0, or -1 with a message on stdout.
+int VecOpen(const char *file_name, struct vec_model *m, long long max_words, int normalize);
+void VecClose(struct vec_model *m);
+
+// Row i (size floats): in M, or decoded into buf for compressed models
+const float *VecRow(const struct vec_model *m, long long i, float *buf);
+
+// Position of the first occurrence of a word, -1 if it is not in the model
+long long VecSearch(const struct vec_model *m, const char *word);
+long long VecSearchNoCase(const struct vec_model *m, const char *word);
+
+// Writes a native file row by row: VecWriterOpen with all the words, then VecWriterRow for each row in order
+// (rows are normalized, and quantized for VEC_PRECISION_INT8, on the way), then VecWriterClose.
+struct vec_writer {
+  FILE *f;
+  struct vec_header h;
+  long long row;
+  float *norms, *scales, *tmp;
+  int8_t *tmp8;
+};
+int VecWriterOpen(struct vec_writer *w, const char *file_name, long long words, long long dims, int model,
+                  int layout, int precision, char **word);
+void VecWriterRow(struct vec_writer *w, const float *row);
+int VecWriterClose(struct vec_writer *w);
+
+// Writes the product quantized file of the words and norms of m, with the codebooks and codes of its rows in the
+// layout above (codes: (words + VEC_PQ_BLOCK - 1) / VEC_PQ_BLOCK blocks)
+int VecWritePq(const char *file_name, const struct vec_model *m, int subspaces, const float *codebooks,
+               const uint8_t *codes);
+
+#endif
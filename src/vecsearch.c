@@ -0,0 +1,506 @@
+// Nearest neighbor search, see vecsearch.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+#include "vecsearch.h"
+
+#define VEC_QUERY_GROUP 4   // queries scored per pass over a row (ScoreRow)
+#define VEC_ROW_BLOCK 64    // rows scored by all the queries before moving on
+
+struct vec_hit {
+  float score;
+  long long row;
+};
+
+struct vec_scan_job {
+  const struct vec_model *m;
+  struct vec_query *q;
+  long long nq, n, first, last;
+  const float **vecs;       // distinct vectors of the queries
+  long long nv, *iv, *it;   // query i scores with vecs[iv[i]] and vecs[it[i]] (it[i] = -1: no twin)
+  float *dots;              // VEC_ROW_BLOCK x nv dot products
+  const float *luts;        // product quantized models: nv x subspaces x VEC_PQ_CENTROIDS subspace dot products
+  const int8_t *q8;         // int8 models: the nv vectors quantized like the rows, VecInt8Stride(size) each
+  const uint8_t *qa;        // their absolute values
+  const float *qscale;      // their scales
+  struct vec_hit *heaps;    // nq heaps of n hits
+  long long *heap_len;
+};
+
+// a is worse than b: lower score, or same score and later row
+static inline int Worse(const struct vec_hit *a, const struct vec_hit *b) {
+  return a->score < b->score || (a->score == b->score && a->row > b->row);
+}
+
+// Offers a hit to a min-heap of at most n hits (the worst one at the top)
+static void HeapPush(struct vec_hit *heap, long long *len, long long n, struct vec_hit hit) {
+  long long i, c;
+  struct vec_hit tmp;
+  if (*len < n) {
+    i = (*len)++;
+    heap[i] = hit;
+    while (i > 0 && Worse(&heap[i], &heap[(i - 1) / 2])) {
+      tmp = heap[i];
+      heap[i] = heap[(i - 1) / 2];
+      heap[(i - 1) / 2] = tmp;
+      i = (i - 1) / 2;
+    }
+    return;
+  }
+  if (!Worse(&heap[0], &hit)) return;
+  heap[0] = hit;
+  i = 0;
+  while (1) {
+    c = 2 * i + 1;
+    if (c >= n) break;
+    if (c + 1 < n && Worse(&heap[c + 1], &heap[c])) c++;
+    if (!Worse(&heap[c], &heap[i])) break;
+    tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+}
+
+static int HitCompare(const void *a, const void *b) {
+  if (Worse((const struct vec_hit *)a, (const struct vec_hit *)b)) return 1;
+  if (Worse((const struct vec_hit *)b, (const struct vec_hit *)a)) return -1;
+  return 0;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+static inline float HorizontalSum(__m256 v) {
+  __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+  x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+  return _mm_cvtss_f32(x);
+}
+#endif
+
+// Dot products of one row with 4 queries, each element of the row is loaded once
+static inline void ScoreRow(const float *row, const float *q0, const float *q1, const float *q2, const float *q3,
+                            long long size, float *out) {
+  long long c = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 r, a0 = _mm256_setzero_ps(), a1 = a0, a2 = a0, a3 = a0;
+  for (; c + 8 <= size; c += 8) {
+    r = _mm256_loadu_ps(row + c);
+    a0 = _mm256_fmadd_ps(r, _mm256_loadu_ps(q0 + c), a0);
+    a1 = _mm256_fmadd_ps(r, _mm256_loadu_ps(q1 + c), a1);
+    a2 = _mm256_fmadd_ps(r, _mm256_loadu_ps(q2 + c), a2);
+    a3 = _mm256_fmadd_ps(r, _mm256_loadu_ps(q3 + c), a3);
+  }
+  out[0] = HorizontalSum(a0);
+  out[1] = HorizontalSum(a1);
+  out[2] = HorizontalSum(a2);
+  out[3] = HorizontalSum(a3);
+#else
+  out[0] = out[1] = out[2] = out[3] = 0;
+#endif
+  for (; c < size; c++) {
+    out[0] += row[c] * q0[c];
+    out[1] += row[c] * q1[c];
+    out[2] += row[c] * q2[c];
+    out[3] += row[c] * q3[c];
+  }
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+// acc + the dot products of 4 unsigned bytes of u with 4 signed bytes of s, per int32
+static inline __m256i DotBytes(__m256i acc, __m256i u, __m256i s) {
+#if defined(__AVXVNNI__)
+  return _mm256_dpbusd_avx_epi32(acc, u, s);
+#elif defined(__AVX512VNNI__) && defined(__AVX512VL__)
+  return _mm256_dpbusd_epi32(acc, u, s);
+#else
+  //Pairs of products fit in int16: 2 x 127 x 127 < 32767
+  return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(u, s), _mm256_set1_epi16(1)));
+#endif
+}
+
+static inline int HorizontalSumInt(__m256i v) {
+  __m128i x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, 0x4e));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, 0xb1));
+  return _mm_cvtsi128_si32(x);
+}
+#endif
+
+// Integer dot products of one int8 row with 4 int8 queries (q, and their absolute values qa), stride values each.
+// The instructions multiply unsigned by signed bytes: q.r is computed as |q|.(r * sign(q)).
+static inline void ScoreRow8(const int8_t *row, const int8_t *const *q, const uint8_t *const *qa, long long stride,
+                             int *out) {
+  long long c;
+  int j;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256i r, acc[VEC_QUERY_GROUP];
+  for (j = 0; j < VEC_QUERY_GROUP; j++) acc[j] = _mm256_setzero_si256();
+  for (c = 0; c < stride; c += VEC_INT8_ALIGN) {
+    r = _mm256_loadu_si256((const __m256i *)(row + c));
+    for (j = 0; j < VEC_QUERY_GROUP; j++) {
+      acc[j] = DotBytes(acc[j], _mm256_loadu_si256((const __m256i *)(qa[j] + c)),
+                        _mm256_sign_epi8(r, _mm256_loadu_si256((const __m256i *)(q[j] + c))));
+    }
+  }
+  for (j = 0; j < VEC_QUERY_GROUP; j++) out[j] = HorizontalSumInt(acc[j]);
+#else
+  for (j = 0; j < VEC_QUERY_GROUP; j++) {
+    out[j] = 0;
+    for (c = 0; c < stride; c++) out[j] += q[j][c] * row[c];
+  }
+#endif
+}
+
+// Quantizes a query vector like the rows of int8 models
+static void QuantizeQuery(const float *v, long long size, int8_t *q, uint8_t *qa, float *scale) {
+  long long c;
+  float max = 0;
+  for (c = 0; c < size; c++) if (fabs(v[c]) > max) max = fabs(v[c]);
+  *scale = max / 127;
+  for (c = 0; c < size; c++) {
+    q[c] = max > 0 ? (int8_t)rint(v[c] / *scale) : 0;
+    qa[c] = abs(q[c]);
+  }
+}
+
+float VecDot(const float *a, const float *b, long long size) {
+  long long c = 0;
+  float dot;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 acc = _mm256_setzero_ps();
+  for (; c + 8 <= size; c += 8) acc = _mm256_fmadd_ps(_mm256_loadu_ps(a + c), _mm256_loadu_ps(b + c), acc);
+  dot = HorizontalSum(acc);
+#else
+  dot = 0;
+#endif
+  for (; c < size; c++) dot += a[c] * b[c];
+  return dot;
+}
+
+// Approximate dot products of the rows [r0, r1) of a product quantized model with a vector, summing the dot
+// products of its subspaces with the centroids of the rows (lut). Rows are taken 8 at a time in a block of codes,
+// where the codes of one subspace are contiguous, with one gather per subspace. Scores go to out[(r - r0) * stride].
+static void AdcRows(const struct vec_model *m, const float *lut, long long r0, long long r1, float *out,
+                    long long stride) {
+  const uint8_t *block;
+  long long r = r0, o;
+  int j, k, nb_sub = m->subspaces;
+  float sum;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 acc;
+  __m256i idx;
+  float tmp[8];
+#endif
+  while (r < r1) {
+    block = m->codes + r / VEC_PQ_BLOCK * nb_sub * VEC_PQ_BLOCK;
+    o = r % VEC_PQ_BLOCK;
+#if defined(__AVX2__) && defined(__FMA__)
+    if (o % 8 == 0 && r + 8 <= r1) {
+      acc = _mm256_setzero_ps();
+      for (j = 0; j < nb_sub; j++) {
+        idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(block + j * VEC_PQ_BLOCK + o)));
+        acc = _mm256_add_ps(acc, _mm256_i32gather_ps(lut + j * VEC_PQ_CENTROIDS, idx, 4));
+      }
+      _mm256_storeu_ps(tmp, acc);
+      for (k = 0; k < 8; k++) out[(r - r0 + k) * stride] = tmp[k];
+      r += 8;
+      continue;
+    }
+#endif
+    sum = 0;
+    for (j = 0; j < nb_sub; j++) sum += lut[j * VEC_PQ_CENTROIDS + block[j * VEC_PQ_BLOCK + o]];
+    out[(r - r0) * stride] = sum;
+    r++;
+  }
+}
+
+// Dot products of the subspaces of v with all the centroids of a product quantized model
+static void AdcTable(const struct vec_model *m, const float *v, float *lut) {
+  long long dsub = m->size / m->subspaces, j, c, a;
+  const float *centroid;
+  for (j = 0; j < m->subspaces; j++) for (c = 0; c < VEC_PQ_CENTROIDS; c++) {
+    centroid = m->codebooks + (j * VEC_PQ_CENTROIDS + c) * dsub;
+    lut[j * VEC_PQ_CENTROIDS + c] = 0;
+    for (a = 0; a < dsub; a++) lut[j * VEC_PQ_CENTROIDS + c] += v[j * dsub + a] * centroid[a];
+  }
+}
+
+static int Excluded(const struct vec_query *q, long long row) {
+  int i;
+  for (i = 0; i < q->nb_exclude; i++) if (q->exclude[i] == row) return 1;
+  return 0;
+}
+
+static void *ScanRows(void *arg) {
+  struct vec_scan_job *job = (struct vec_scan_job *)arg;
+  long long size = job->m->size, nv = job->nv, r, r0, r1, g, i;
+  const float **v = job->vecs;
+  float score[VEC_QUERY_GROUP], *dots;
+  struct vec_hit hit;
+  int j, nb, dot8[VEC_QUERY_GROUP];
+  const int8_t *q8[VEC_QUERY_GROUP];
+  const uint8_t *qa[VEC_QUERY_GROUP];
+  long long stride8 = VecInt8Stride(size);
+  //Blocks of rows which stay in cache while all the vectors go over them
+  for (r0 = job->first; r0 < job->last; r0 = r1) {
+    r1 = r0 + VEC_ROW_BLOCK < job->last ? r0 + VEC_ROW_BLOCK : job->last;
+    if (job->luts != NULL) {
+      for (g = 0; g < nv; g++) {
+        AdcRows(job->m, job->luts + g * job->m->subspaces * VEC_PQ_CENTROIDS, r0, r1, job->dots + g, nv);
+      }
+    } else if (job->q8 != NULL) {
+      for (g = 0; g < nv; g += VEC_QUERY_GROUP) {
+        nb = nv - g < VEC_QUERY_GROUP ? nv - g : VEC_QUERY_GROUP;
+        for (j = 0; j < VEC_QUERY_GROUP; j++) {
+          q8[j] = job->q8 + (g + (j < nb ? j : 0)) * stride8;
+          qa[j] = job->qa + (g + (j < nb ? j : 0)) * stride8;
+        }
+        for (r = r0; r < r1; r++) {
+          ScoreRow8(job->m->rows8 + r * stride8, q8, qa, stride8, dot8);
+          for (j = 0; j < nb; j++) job->dots[(r - r0) * nv + g + j] = dot8[j] * job->qscale[g + j] * job->m->scales[r];
+        }
+      }
+    } else for (g = 0; g < nv; g += VEC_QUERY_GROUP) {
+      //An incomplete group repeats its first vector
+      nb = nv - g < VEC_QUERY_GROUP ? nv - g : VEC_QUERY_GROUP;
+      for (r = r0; r < r1; r++) {
+        ScoreRow(job->m->M + r * size, v[g], v[g + (nb > 1)], v[g + (nb > 2 ? 2 : 0)], v[g + (nb > 3 ? 3 : 0)], size, score);
+        for (j = 0; j < nb; j++) job->dots[(r - r0) * nv + g + j] = score[j];
+      }
+    }
+    for (i = 0; i < job->nq; i++) {
+      for (r = r0; r < r1; r++) {
+        dots = job->dots + (r - r0) * nv;
+        hit.score = dots[job->iv[i]];
+        if (job->it[i] >= 0) hit.score += job->q[i].sign * dots[job->it[i]];
+        if (!(hit.score > job->q[i].threshold)) continue;
+        //Cheap test first: most rows do not make it into a full heap
+        hit.row = r;
+        if (job->heap_len[i] == job->n && !Worse(&job->heaps[i * job->n], &hit)) continue;
+        if (Excluded(&job->q[i], r)) continue;
+        HeapPush(job->heaps + i * job->n, &job->heap_len[i], job->n, hit);
+      }
+    }
+  }
+  return NULL;
+}
+
+void VecDirectional(const struct vec_model *m, const float *w, float *vec, float *twin) {
+  long long c, k = m->size / 2;
+  if (m->model == VEC_MODEL_COMPLEX) {
+    //Re<w, x> = w.x and Im<w, x> = sum wr xi - wi xr
+    for (c = 0; c < k; c++) {
+      vec[2 * c] = w[2 * c];
+      vec[2 * c + 1] = w[2 * c + 1];
+      twin[2 * c] = -w[2 * c + 1];
+      twin[2 * c + 1] = w[2 * c];
+    }
+  } else {
+    //Right parts: (w.x + (wr - wl).x) / 2, left parts: (w.x - (wr - wl).x) / 2
+    for (c = 0; c < k; c++) {
+      vec[2 * c] = w[2 * c] / 2;
+      vec[2 * c + 1] = w[2 * c + 1] / 2;
+      twin[2 * c] = w[2 * c] / 2;
+      twin[2 * c + 1] = -w[2 * c + 1] / 2;
+    }
+  }
+}
+
+int VecDirections(struct vec_model *m, const char *mode) {
+  int dirs = 0;
+  if (!strncmp(mode, "complex-", 8)) {
+    m->model = VEC_MODEL_COMPLEX;
+    mode += 8;
+  } else if (!strncmp(mode, "2real-", 6)) {
+    m->model = VEC_MODEL_2REAL;
+    mode += 6;
+  }
+  if (!strcmp(mode, "right")) dirs = VEC_RIGHT;
+  else if (!strcmp(mode, "left")) dirs = VEC_LEFT;
+  else if (!strcmp(mode, "both")) dirs = VEC_RIGHT | VEC_LEFT;
+  else {
+    printf("Unknown mode '%s', choices are [complex-|2real-]right, left or both\n", mode);
+    return -1;
+  }
+  if ((m->model != VEC_MODEL_COMPLEX && m->model != VEC_MODEL_2REAL) || m->size % 2 != 0) {
+    printf("Directional modes need a complex or 2real model, name it (e.g. complex-%s) for word2vec files\n", mode);
+    return -1;
+  }
+  return dirs;
+}
+
+// Index of a query vector, shared with the previous query when it is the same one
+static long long VectorIndex(const float **vecs, long long *nv, const float *v) {
+  if (*nv > 0 && vecs[*nv - 1] == v) return *nv - 1;
+  if (*nv > 1 && vecs[*nv - 2] == v) return *nv - 2;
+  vecs[*nv] = v;
+  return (*nv)++;
+}
+
+void VecTopN(const struct vec_model *m, struct vec_query *q, long long nq, long long n, int nb_threads) {
+  struct vec_scan_job *jobs;
+  pthread_t *pt;
+  struct vec_hit *merged;
+  const float **vecs;
+  float *luts = NULL, *qscale = NULL;
+  int8_t *q8 = NULL;
+  uint8_t *qa = NULL;
+  long long i, k, len, nv = 0, stride8, *iv, *it;
+  int t;
+  if (nb_threads <= 0) nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nb_threads < 1) nb_threads = 1;
+  //Not worth a thread per core on small models
+  if (m->words < (long long)nb_threads * 1024) nb_threads = m->words / 1024 + 1;
+  //Distinct vectors: the right and left queries of a word share theirs
+  vecs = (const float **)malloc(2 * nq * sizeof(float *));
+  iv = (long long *)malloc(nq * sizeof(long long));
+  it = (long long *)malloc(nq * sizeof(long long));
+  for (i = 0; i < nq; i++) {
+    iv[i] = VectorIndex(vecs, &nv, q[i].vec);
+    it[i] = q[i].twin != NULL ? VectorIndex(vecs, &nv, q[i].twin) : -1;
+  }
+  //Product quantized models are scored from tables of subspace dot products
+  if (m->precision == VEC_PRECISION_PQ8) {
+    luts = (float *)malloc(nv * m->subspaces * VEC_PQ_CENTROIDS * sizeof(float));
+    for (i = 0; i < nv; i++) AdcTable(m, vecs[i], luts + i * m->subspaces * VEC_PQ_CENTROIDS);
+  }
+  //Int8 models are scored with integer dot products, the query vectors are quantized the same way
+  if (m->precision == VEC_PRECISION_INT8) {
+    stride8 = VecInt8Stride(m->size);
+    q8 = (int8_t *)calloc(nv * stride8, 1);
+    qa = (uint8_t *)calloc(nv * stride8, 1);
+    qscale = (float *)malloc(nv * sizeof(float));
+    for (i = 0; i < nv; i++) QuantizeQuery(vecs[i], m->size, q8 + i * stride8, qa + i * stride8, qscale + i);
+  }
+  jobs = (struct vec_scan_job *)calloc(nb_threads, sizeof(struct vec_scan_job));
+  pt = (pthread_t *)malloc(nb_threads * sizeof(pthread_t));
+  for (t = 0; t < nb_threads; t++) {
+    jobs[t].m = m;
+    jobs[t].q = q;
+    jobs[t].nq = nq;
+    jobs[t].n = n;
+    //Threads start on a block of rows (and of product quantization codes)
+    jobs[t].first = m->words * t / nb_threads / VEC_ROW_BLOCK * VEC_ROW_BLOCK;
+    jobs[t].last = t + 1 < nb_threads ? m->words * (t + 1) / nb_threads / VEC_ROW_BLOCK * VEC_ROW_BLOCK : m->words;
+    jobs[t].vecs = vecs;
+    jobs[t].nv = nv;
+    jobs[t].iv = iv;
+    jobs[t].it = it;
+    jobs[t].luts = luts;
+    jobs[t].q8 = q8;
+    jobs[t].qa = qa;
+    jobs[t].qscale = qscale;
+    jobs[t].dots = (float *)malloc(VEC_ROW_BLOCK * nv * sizeof(float));
+    jobs[t].heaps = (struct vec_hit *)malloc(nq * n * sizeof(struct vec_hit));
+    jobs[t].heap_len = (long long *)calloc(nq, sizeof(long long));
+    pthread_create(&pt[t], NULL, ScanRows, (void *)&jobs[t]);
+  }
+  for (t = 0; t < nb_threads; t++) pthread_join(pt[t], NULL);
+  //Merge the heaps of the threads
+  merged = (struct vec_hit *)malloc(nb_threads * n * sizeof(struct vec_hit));
+  for (i = 0; i < nq; i++) {
+    len = 0;
+    for (t = 0; t < nb_threads; t++) {
+      memcpy(merged + len, jobs[t].heaps + i * n, jobs[t].heap_len[i] * sizeof(struct vec_hit));
+      len += jobs[t].heap_len[i];
+    }
+    qsort(merged, len, sizeof(struct vec_hit), HitCompare);
+    for (k = 0; k < n; k++) {
+      q[i].best[k] = k < len ? merged[k].row : -1;
+      q[i].score[k] = k < len ? merged[k].score : q[i].threshold;
+    }
+  }
+  free(merged);
+  for (t = 0; t < nb_threads; t++) {
+    free(jobs[t].dots);
+    free(jobs[t].heaps);
+    free(jobs[t].heap_len);
+  }
+  free(luts);
+  free(q8);
+  free(qa);
+  free(qscale);
+  free(vecs);
+  free(iv);
+  free(it);
+  free(jobs);
+  free(pt);
+}
+
+void VecRerank(const struct vec_model *m, struct vec_query *q, long long nq, long long k, long long n) {
+  struct vec_hit *hits = (struct vec_hit *)malloc(k * sizeof(struct vec_hit));
+  const float *row;
+  long long i, c, len;
+  for (i = 0; i < nq; i++) {
+    len = 0;
+    for (c = 0; c < k && q[i].best[c] >= 0; c++) {
+      row = m->M + q[i].best[c] * m->size;
+      hits[len].row = q[i].best[c];
+      hits[len].score = VecDot(q[i].vec, row, m->size);
+      if (q[i].twin != NULL) hits[len].score += q[i].sign * VecDot(q[i].twin, row, m->size);
+      if (hits[len].score > q[i].threshold) len++;
+    }
+    qsort(hits, len, sizeof(struct vec_hit), HitCompare);
+    for (c = 0; c < n; c++) {
+      q[i].best[c] = c < len ? hits[c].row : -1;
+      q[i].score[c] = c < len ? hits[c].score : q[i].threshold;
+    }
+  }
+  free(hits);
+}
+
+void VecSampleQueries(const struct vec_model *m, long long nb_test, long long *words, float *vecs,
+                      struct vec_query *q) {
+  long long size = m->size, i, a, k;
+  float *buf = (float *)malloc(3 * size * sizeof(float)), *vec, len;
+  const float *r0, *r1, *r2;
+  srand(1);
+  for (i = 0; i < 2 * nb_test; i++) {
+    for (k = 0; k < 3; k++) words[i * 3 + k] = ((long long)rand() * RAND_MAX + rand()) % m->words;
+    vec = vecs + i * size;
+    r0 = VecRow(m, words[i * 3], buf);
+    r1 = VecRow(m, words[i * 3 + 1], buf + size);
+    r2 = VecRow(m, words[i * 3 + 2], buf + 2 * size);
+    for (a = 0; a < size; a++) {
+      vec[a] = r0[a];
+      if (i >= nb_test) vec[a] += r2[a] - r1[a];
+    }
+    len = 0;
+    for (a = 0; a < size; a++) len += vec[a] * vec[a];
+    len = sqrt(len);
+    if (len > 0) for (a = 0; a < size; a++) vec[a] /= len;
+    q[i].vec = vec;
+    q[i].twin = NULL;
+    q[i].exclude = words + i * 3;
+    q[i].nb_exclude = i < nb_test ? 1 : 3;
+    q[i].threshold = -1;
+  }
+  free(buf);
+}
+
+double VecRecall(const long long *exact, const long long *approx, long long nq, long long n, long long stride) {
+  long long i, a, b, hits = 0, total = 0;
+  for (i = 0; i < nq; i++) for (a = 0; a < n; a++) {
+    if (exact[i * n + a] < 0) continue;
+    total++;
+    for (b = 0; b < n; b++) if (approx[i * stride + b] == exact[i * n + a]) {
+      hits++;
+      break;
+    }
+  }
+  return total > 0 ? (double)hits / total : 1;
+}
+
+double VecNow() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
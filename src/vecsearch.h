@@ -0,0 +1,65 @@
+// Nearest neighbor search over the rows of a loaded model (see vecfile.h)
+//
+// The rows are split between threads, each thread scores its rows against all the query vectors of the batch, 4
+// vectors per pass over a row, and keeps the best rows of each query in a bounded heap of indices. The scores of
+// product quantized models are approximate (asymmetric distance computation): each query vector is only scored
+// against the centroids once, into a table, and the score of a row is the sum of the table entries of its codes.
+// Int8 models are scored with integer dot products (AVX2, or VNNI when the CPU has it) against the query vectors
+// quantized the same way, then scaled back.
+//
+// Complex and 2real models are trained with order-sensitive scores: for a word w and a word x on its right,
+// Re<w, x> + Im<w, x> (complex) or w_right.x_right (2real), and Re<w, x> - Im<w, x> or w_left.x_left for a word
+// on its left. Both are vec.x + sign * twin.x with the vectors of VecDirectional, sign 1 for the right neighbors
+// and -1 for the left ones, so that one pass over the rows gives the two directions.
+
+#ifndef VECSEARCH_H
+#define VECSEARCH_H
+
+#include "vecfile.h"
+
+struct vec_query {
+  const float *vec;           // size floats
+  const float *twin;          // NULL for plain dot products
+  float sign;
+  const long long *exclude;   // rows never returned, e.g. the query words
+  int nb_exclude;
+  float threshold;            // only rows scoring above it are returned
+  long long *best;            // out: n rows by decreasing score (ties: lowest row first), -1 past the last one
+  float *score;               // out: their scores
+};
+
+#define VEC_RIGHT 1
+#define VEC_LEFT 2
+
+// Dot product of two vectors of size floats
+float VecDot(const float *a, const float *b, long long size);
+
+// Directions asked by a mode argument of the tools: "right", "left" or "both", prefixed by "complex-" or "2real-"
+// to give the model of a word2vec file. Returns VEC_RIGHT and/or VEC_LEFT, or -1 with a message on stdout.
+int VecDirections(struct vec_model *m, const char *mode);
+
+// vec and twin (size floats each) of the directional scores of w in a complex or 2real model
+void VecDirectional(const struct vec_model *m, const float *w, float *vec, float *twin);
+
+// Top n rows by score for each of the nq queries, using nb_threads threads (0: one per core)
+void VecTopN(const struct vec_model *m, struct vec_query *q, long long nq, long long n, int nb_threads);
+
+// Re-scores the k candidates of each query (best, from VecTopN on a product quantized model) with the float rows of
+// m, and keeps the n best of them
+void VecRerank(const struct vec_model *m, struct vec_query *q, long long nq, long long k, long long n);
+
+// Test queries of the recall reports of the index tools: nb_test single words, then nb_test analogy vectors
+// b - a + c of random words, as distance and word-analogy build them, normalized. words (3 per query) and vecs
+// (size floats per query) hold the 2 * nb_test queries of q, whose best and score are left to the caller. The
+// words are drawn after srand(1), so that every call gives the same queries
+void VecSampleQueries(const struct vec_model *m, long long nb_test, long long *words, float *vecs,
+                      struct vec_query *q);
+
+// Fraction of the exact top n (n rows per query) found by an approximate search (the first n of stride rows per
+// query), over nq queries
+double VecRecall(const long long *exact, const long long *approx, long long nq, long long n, long long stride);
+
+// Monotonic clock in seconds, for the query times of the reports
+double VecNow();
+
+#endif
@@ -18,6 +18,15 @@
 #include <math.h>
 #include <pthread.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "vecfile.h"
 
 #define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
@@ -41,7 +50,7 @@ struct vocab_word {
 	char *word, *code, codelen;
 };
 
-char train_file[MAX_STRING], output_file[MAX_STRING], eval_file[MAX_STRING] = "";
+char train_file[MAX_STRING], output_file[MAX_STRING], eval_file[MAX_STRING] = "", native_file[MAX_STRING] = "";
 char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
 char model_type[MAX_STRING];
 struct vocab_word *vocab;
@@ -56,6 +65,13 @@ real *expTable, *final_embeddings;
 //For evaluation
 long long * analogy_eval_arr;
 int nb_analogy_questions = 0;
+long long eval_top_words = 0, eval_epoch = 0;
+int eval_requested = 0, eval_stop = 0;
+pthread_t eval_thread;
+pthread_mutex_t eval_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t eval_cond = PTHREAD_COND_INITIALIZER;
+#define EVAL_QUERY_BLOCK 256
+#define EVAL_WORD_BLOCK 4096
 
 //TOMOD: Declare model parameters here
 //Complex word2vec model
@@ -66,10 +82,40 @@ real *word_emb, *ctxt_emb, *grad_word_emb, *word_grad_acc, *ctxt_grad_acc;
 real *word_right, *word_left, *ctxt_right, *ctxt_left, *grad_word_right, *grad_word_left;
 //ENDMOD
 
-int  negative = 5, sign_strat = 0, adagrad = 0;
-const int table_size = 1e8, sample_size=5;
+int  negative = 5, sign_strat = 0, adagrad = 0, exec_mode = 0, reorder = 0, prefetch_distance = 0, neg_buffer_size = 0;
+const int table_size = 1e8;
 const real adagrad_reg = 1e-8;
 int *table;
+//Out-of-core matrices: memory-mapped files in 'mmap_dir'
+char mmap_dir[MAX_STRING] = "";
+long long mlock_words = 0;
+struct mapped_matrix {
+	real *ptr;
+	size_t size;
+	char path[2 * MAX_STRING];
+} mapped_mats[8];
+int nb_mapped_mats = 0;
+
+//Multi-process training: each worker trains on its shard of the corpus and the parameters are averaged
+//'syncs_per_epoch' times per epoch through POSIX shared memory (one host) or TCP (several hosts)
+int num_workers = 1, worker_id = 0, syncs_per_epoch = 1;
+char sync_shm[MAX_STRING] = "", sync_tcp[MAX_STRING] = "";
+long long sync_run = 0;
+long long worker_words = 0, sync_rounds = 0;
+
+//Vocabulary partitioned negative sampling: the per partition tables follow the global one in 'table'
+int neg_partition = 0, neg_partitions = 0, part_table_size = 0;
+real neg_global = 0.2;
+
+//One training pair of a batch: 32 bit word and target ids, label, sign and word gradient flush packed in 'flags'
+struct train_sample {
+	unsigned int word, target;
+	unsigned char flags;
+};
+#define SAMPLE_LABEL 1      //Positive pair
+#define SAMPLE_NEG_SIGN 2   //Sign of the imaginary part (left matrices for the 2real model) is -1
+#define SAMPLE_FLUSH 4      //Last pair of the word: apply its accumulated gradient
+#define SAMPLE_SIGN(s) (((s).flags & SAMPLE_NEG_SIGN) ? -1 : 1)
 
 
 int StartsWith(const char *pre, const char *str) {
@@ -89,11 +135,264 @@ int EndsWith(const char *suffix, const char *str)
 
 
 
+//////////////////////////////////////////////////////////////////////////////////
+// MULTI-PROCESS TRAINING: parameter averaging between workers
+//////////////////////////////////////////////////////////////////////////////////
+
+//Shared memory segment: barrier, then one slot of all the parameters per worker and the average slot. 'run' is the
+//-sync-run id of the workers it was made for, so that a segment left by a crashed run is not joined
+struct sync_shm_header {
+	pthread_barrier_t barrier;
+	volatile int ready;
+	long long run;
+};
+#define SYNC_SHM_HEADER_SIZE 4096
+#define SYNC_CHUNK (1 << 20)
+
+real *sync_mats[4];
+int nb_sync_mats = 0, *sync_socks = NULL;
+long long sync_mat_size;
+struct sync_shm_header *sync_header = NULL;
+real *sync_slots = NULL, *sync_buf = NULL, *sync_chunk = NULL;
+size_t sync_map_size;
+
+//Distinct parameter matrices of the model (context matrices shared with the word ones are listed once)
+int ModelMatrices(real **mats) {
+	int n = 0, i, j;
+	real *all[4] = {NULL, NULL, NULL, NULL};
+	if ( StartsWith("complex", model_type)) {
+		all[0] = word_real; all[1] = word_imag; all[2] = ctxt_real; all[3] = ctxt_imag;
+	} else if ( StartsWith("2real", model_type)) {
+		all[0] = word_right; all[1] = word_left; all[2] = ctxt_right; all[3] = ctxt_left;
+	} else if ( StartsWith("real", model_type)) {
+		all[0] = word_emb; all[1] = ctxt_emb;
+	}
+	for (i = 0; i < 4; i++) {
+		if (all[i] == NULL) continue;
+		for (j = 0; j < n; j++) if (mats[j] == all[i]) break;
+		if (j == n) mats[n++] = all[i];
+	}
+	return n;
+}
+
+//Parameter j of the concatenation of the model matrices
+static inline real *SyncParam(long long j) {
+	return sync_mats[j / sync_mat_size] + j % sync_mat_size;
+}
+
+void SendAll(int sock, void *buf, size_t len) {
+	ssize_t n;
+	while (len > 0) {
+		n = send(sock, buf, len, 0);
+		if (n <= 0) {printf("ERROR: parameter averaging connection lost\n"); exit(1);}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+}
+
+void RecvAll(int sock, void *buf, size_t len) {
+	ssize_t n;
+	while (len > 0) {
+		n = recv(sock, buf, len, 0);
+		if (n <= 0) {printf("ERROR: parameter averaging connection lost\n"); exit(1);}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+}
+
+void InitSyncShm(long long nb_params) {
+	int fd = -1, i;
+	struct stat sb;
+	pthread_barrierattr_t attr;
+	sync_map_size = SYNC_SHM_HEADER_SIZE + (size_t)(num_workers + 1) * nb_params * sizeof(real);
+	if (worker_id == 0) {
+		shm_unlink(sync_shm);
+		fd = shm_open(sync_shm, O_CREAT | O_RDWR, 0600);
+		if (fd == -1 || ftruncate(fd, sync_map_size) != 0) {printf("ERROR: cannot create shared memory '%s'\n", sync_shm); exit(1);}
+		sync_header = (struct sync_shm_header *)mmap(NULL, sync_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (sync_header == MAP_FAILED) {printf("ERROR: cannot map shared memory '%s'\n", sync_shm); exit(1);}
+		pthread_barrierattr_init(&attr);
+		pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_barrier_init(&sync_header->barrier, &attr, num_workers);
+		pthread_barrierattr_destroy(&attr);
+		sync_header->run = sync_run;
+		__sync_synchronize();
+		sync_header->ready = 1;
+	} else {
+		//Wait for worker 0 to create the segment of this run, until it is ready
+		for (i = 0; i < 600; i++) {
+			fd = shm_open(sync_shm, O_RDWR, 0600);
+			if (fd != -1 && fstat(fd, &sb) == 0 && sb.st_size == (off_t)sync_map_size) {
+				sync_header = (struct sync_shm_header *)mmap(NULL, sync_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				close(fd);
+				if (sync_header == MAP_FAILED) {printf("ERROR: cannot map shared memory '%s'\n", sync_shm); exit(1);}
+				if (sync_header->ready) {
+					__sync_synchronize();
+					if (sync_header->run == sync_run) break;
+				}
+				munmap(sync_header, sync_map_size);
+			} else if (fd != -1) close(fd);
+			sync_header = NULL;
+			usleep(100000);
+		}
+		if (sync_header == NULL) {printf("ERROR: shared memory '%s' of run %lld not found\n", sync_shm, sync_run); exit(1);}
+	}
+	sync_slots = (real *)((char *)sync_header + SYNC_SHM_HEADER_SIZE);
+}
+
+void InitSyncTcp(long long nb_params) {
+	char host[MAX_STRING], *port;
+	int sock, one = 1, i, id;
+	struct addrinfo hints, *res;
+	strcpy(host, sync_tcp);
+	port = strrchr(host, ':');
+	if (port == NULL) {printf("ERROR: -sync-tcp expects <host>:<port>\n"); exit(1);}
+	*port++ = 0;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sync_buf = (real *)malloc(nb_params * sizeof(real));
+	sync_chunk = (real *)malloc(2 * SYNC_CHUNK * sizeof(real));
+	if (sync_buf == NULL || sync_chunk == NULL) {printf("Memory allocation failed\n"); exit(1);}
+	if (worker_id == 0) {
+		//Worker 0 is the hub: it accepts one connection per other worker
+		hints.ai_flags = AI_PASSIVE;
+		if (getaddrinfo(NULL, port, &hints, &res) != 0) {printf("ERROR: invalid port '%s'\n", port); exit(1);}
+		sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (sock == -1 || bind(sock, res->ai_addr, res->ai_addrlen) != 0 || listen(sock, num_workers) != 0) {
+			printf("ERROR: cannot listen on port %s\n", port);
+			exit(1);
+		}
+		freeaddrinfo(res);
+		sync_socks = (int *)calloc(num_workers, sizeof(int));
+		for (i = 1; i < num_workers; i++) {
+			int client = accept(sock, NULL, NULL);
+			RecvAll(client, &id, sizeof(int));
+			if (id <= 0 || id >= num_workers || sync_socks[id] != 0) {printf("ERROR: unexpected worker id %d\n", id); exit(1);}
+			setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			sync_socks[id] = client;
+		}
+		close(sock);
+	} else {
+		if (getaddrinfo(host, port, &hints, &res) != 0) {printf("ERROR: cannot resolve '%s'\n", host); exit(1);}
+		for (i = 0; i < 600; i++) {
+			sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+			if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) break;
+			close(sock);
+			sock = -1;
+			usleep(100000);
+		}
+		freeaddrinfo(res);
+		if (sock == -1) {printf("ERROR: cannot connect to worker 0 at %s\n", sync_tcp); exit(1);}
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		SendAll(sock, &worker_id, sizeof(int));
+		sync_socks = (int *)calloc(1, sizeof(int));
+		sync_socks[0] = sock;
+	}
+}
+
+void InitSync() {
+	nb_sync_mats = ModelMatrices(sync_mats);
+	sync_mat_size = (long long)vocab_size * layer1_size;
+	if (strlen(sync_shm) > 0) InitSyncShm(nb_sync_mats * sync_mat_size);
+	else if (strlen(sync_tcp) > 0) InitSyncTcp(nb_sync_mats * sync_mat_size);
+	else {printf("ERROR: -workers requires -sync-shm <name> or -sync-tcp <host:port>\n"); exit(1);}
+	printf("Worker %d/%d: parameters averaged %d times per epoch\n", worker_id, num_workers, syncs_per_epoch);
+}
+
+//One averaging round. The local parameters are snapshotted and moved by (average - snapshot),
+//so that the updates made by the other local threads during the round are kept.
+void SyncParameters() {
+	long long nb_params = nb_sync_mats * sync_mat_size, j, k, from, to, w, n;
+	real *avg;
+	int m;
+	if (sync_header != NULL) {
+		real *own = sync_slots + worker_id * nb_params;
+		avg = sync_slots + num_workers * nb_params;
+		for (m = 0; m < nb_sync_mats; m++) memcpy(own + m * sync_mat_size, sync_mats[m], sync_mat_size * sizeof(real));
+		pthread_barrier_wait(&sync_header->barrier);
+		//Each worker averages its own range of parameters
+		from = nb_params / num_workers * worker_id;
+		to = worker_id == num_workers - 1 ? nb_params : from + nb_params / num_workers;
+		for (j = from; j < to; j++) avg[j] = 0;
+		for (w = 0; w < num_workers; w++) for (j = from; j < to; j++) avg[j] += sync_slots[w * nb_params + j];
+		for (j = from; j < to; j++) avg[j] /= num_workers;
+		pthread_barrier_wait(&sync_header->barrier);
+		for (j = 0; j < nb_params; j++) *SyncParam(j) += avg[j] - own[j];
+	} else if (worker_id == 0) {
+		//Hub: sums the snapshots of all workers chunk by chunk, then sends back the average
+		for (j = 0; j < nb_params; j++) sync_buf[j] = *SyncParam(j);
+		avg = sync_chunk;
+		for (j = 0; j < nb_params; j += SYNC_CHUNK) {
+			n = nb_params - j < SYNC_CHUNK ? nb_params - j : SYNC_CHUNK;
+			for (k = 0; k < n; k++) avg[k] = sync_buf[j + k];
+			for (w = 1; w < num_workers; w++) {
+				RecvAll(sync_socks[w], sync_chunk + SYNC_CHUNK, n * sizeof(real));
+				for (k = 0; k < n; k++) avg[k] += sync_chunk[SYNC_CHUNK + k];
+			}
+			for (k = 0; k < n; k++) avg[k] /= num_workers;
+			for (w = 1; w < num_workers; w++) SendAll(sync_socks[w], avg, n * sizeof(real));
+			for (k = 0; k < n; k++) *SyncParam(j + k) += avg[k] - sync_buf[j + k];
+		}
+	} else {
+		for (j = 0; j < nb_params; j++) sync_buf[j] = *SyncParam(j);
+		for (j = 0; j < nb_params; j += SYNC_CHUNK) {
+			n = nb_params - j < SYNC_CHUNK ? nb_params - j : SYNC_CHUNK;
+			SendAll(sync_socks[0], sync_buf + j, n * sizeof(real));
+			RecvAll(sync_socks[0], sync_chunk, n * sizeof(real));
+			for (k = 0; k < n; k++) *SyncParam(j + k) += sync_chunk[k] - sync_buf[j + k];
+		}
+	}
+	sync_rounds++;
+}
+
+void CloseSync() {
+	int w;
+	if (sync_header != NULL) {
+		munmap(sync_header, sync_map_size);
+		if (worker_id == 0) shm_unlink(sync_shm);
+	}
+	if (sync_socks != NULL) {
+		for (w = 0; w < (worker_id == 0 ? num_workers : 1); w++) if (sync_socks[w] > 0) close(sync_socks[w]);
+		free(sync_socks);
+	}
+	free(sync_buf);
+	free(sync_chunk);
+}
+
+
+//Builds one unigram table per vocabulary partition (one per thread), after the global table. Words are dealt to the partitions
+//by frequency rank (rank r goes to partition (r - 1) % neg_partitions), so that every partition keeps the
+//frequency profile of the whole vocabulary. </s> is left out, as it is replaced anyway when drawn.
+void InitPartitionTables() {
+	long long a, p, j;
+	double part_pow, d1, power = 0.75;
+	int *part_table;
+	part_table_size = table_size / neg_partitions;
+	for (p = 0; p < neg_partitions; p++) {
+		part_table = table + table_size + p * part_table_size;
+		part_pow = 0;
+		for (a = p + 1; a < vocab_size; a += neg_partitions) part_pow += pow(vocab[a].cn, power);
+		a = p + 1;
+		d1 = pow(vocab[a].cn, power) / part_pow;
+		for (j = 0; j < part_table_size; j++) {
+			part_table[j] = a;
+			if (j / (double)part_table_size > d1 && a + neg_partitions < vocab_size) {
+				a += neg_partitions;
+				d1 += pow(vocab[a].cn, power) / part_pow;
+			}
+		}
+	}
+}
+
 void InitUnigramTable() {
 	int a, i;
 	double train_words_pow = 0;
 	double d1, power = 0.75;
-	table = (int *)malloc(table_size * sizeof(int));
+	table = (int *)malloc(((long long)table_size + (neg_partitions > 0 ? table_size : 0)) * sizeof(int));
+	if (table == NULL) {printf("Memory allocation failed\n"); exit(1);}
 	for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
 	i = 0;
 	d1 = pow(vocab[i].cn, power) / train_words_pow;
@@ -105,6 +404,7 @@ void InitUnigramTable() {
 		}
 		if (i >= vocab_size) i = vocab_size - 1;
 	}
+	if (neg_partitions > 0) InitPartitionTables();
 }
 
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
@@ -351,8 +651,8 @@ void BuildAnalogyEvaluation() {
 
 		if ( nb_analogy_questions >= arr_size) { //Reallocate a twice bigger array
 			arr_size *= 2;
-			tmp  = (long long *)malloc(arr_size * sizeof(long long));
-			memcpy(tmp, analogy_eval_arr, (arr_size / 2) * sizeof(long long));
+			tmp  = (long long *)malloc(4 * arr_size * sizeof(long long));
+			memcpy(tmp, analogy_eval_arr, 4 * (arr_size / 2) * sizeof(long long));
 			free(analogy_eval_arr);
 			analogy_eval_arr = tmp;
 		}
@@ -362,64 +662,210 @@ void BuildAnalogyEvaluation() {
 }
 
 
-void EvalSingleEmbModel( real *embeddings) {
-
-	long long i, j, c, argmax;
-	int nb_correct = 0;
-	real *emb_copy = (real*) malloc((long long)vocab_size * layer1_size * sizeof(real));
-	real *pred_emb = (real*) malloc(layer1_size * sizeof(long long));
-	real norm, dot, max;
-
+//Width of the word vectors as saved in the output file
+long long OutputWidth() {
+	if (StartsWith("complex", model_type) || StartsWith("2real", model_type)) return 2 * layer1_size;
+	return layer1_size;
+}
 
-	//Copying current embeddings (with all concurrent read/write risk implied)
-	memcpy(emb_copy, embeddings, (long long)vocab_size * layer1_size * sizeof(real));
+//Word vector 'a' as saved in the output file: the real and imaginary (or right and left) parts are interleaved
+void OutputRow(real *r, long long a) {
+	long long b;
+	if (StartsWith("complex", model_type)) {
+		for (b = 0; b < layer1_size; b++) {
+			r[2 * b] = word_real[a * layer1_size + b];
+			r[2 * b + 1] = word_imag[a * layer1_size + b];
+		}
+	} else if (StartsWith("2real", model_type)) {
+		for (b = 0; b < layer1_size; b++) {
+			r[2 * b] = word_right[a * layer1_size + b];
+			r[2 * b + 1] = word_left[a * layer1_size + b];
+		}
+	} else memcpy(r, word_emb + a * layer1_size, layer1_size * sizeof(real));
+}
 
-	//Normalize embeddings
-	for (i = 0; i < vocab_size; i ++) {
+//Copies the first n word vectors as saved in the output file and normalizes them. The training threads keep
+//writing meanwhile, as before the copy is not atomic.
+void SnapshotEmbeddings(real *snap, long long n) {
+	long long a, b, width = OutputWidth();
+	real norm, *r;
+	for (a = 0; a < n; a++) {
+		r = snap + a * width;
+		OutputRow(r, a);
 		norm = 0;
-		for (c = 0; c < layer1_size; c++) {
-			norm += emb_copy[i * layer1_size + c] * emb_copy[i * layer1_size + c];
-		}
+		for (b = 0; b < width; b++) norm += r[b] * r[b];
 		norm = sqrt(norm);
-		for (c = 0; c < layer1_size; c++) {
-			emb_copy[i * layer1_size + c] /= norm;
-		}
+		if (norm > 0) for (b = 0; b < width; b++) r[b] /= norm;
 	}
+}
 
-	//Iterate over analogy questions
-	for (i = 0; i < nb_analogy_questions; i++ ) {
-		//Compute the predicted vector
-		for (c = 0; c < layer1_size; c++) {
-			pred_emb[c] = - emb_copy[ analogy_eval_arr[i * 4] * layer1_size + c ] 
-						+ emb_copy[ analogy_eval_arr[i * 4 + 1] * layer1_size + c ]
-						+ emb_copy[ analogy_eval_arr[i * 4 + 2] * layer1_size + c ] ;
+//Scores the analogy questions against the n normalized vectors of 'snap', EVAL_QUERY_BLOCK questions at a time
+//against EVAL_WORD_BLOCK words at a time. Like compute-accuracy, questions with a word outside the first n are
+//skipped and the three question words are not candidate answers.
+void EvalSnapshot(real *snap, long long n, real *queries, real *scores, long long epoch) {
+	long long i, j, c, q, nb_q, j_end, width = OutputWidth(), *ind, *argmax;
+	long long *question = (long long *)malloc(EVAL_QUERY_BLOCK * sizeof(long long));
+	real *best = (real *)malloc(EVAL_QUERY_BLOCK * sizeof(real)), *p, *w1, *w2, *w3;
+	int nb_correct = 0, nb_asked = 0;
+	argmax = (long long *)malloc(EVAL_QUERY_BLOCK * sizeof(long long));
+	i = 0;
+	while (i < nb_analogy_questions) {
+		//Predicted vectors of the next block of questions
+		for (nb_q = 0; i < nb_analogy_questions && nb_q < EVAL_QUERY_BLOCK; i++) {
+			ind = analogy_eval_arr + i * 4;
+			if (ind[0] >= n || ind[1] >= n || ind[2] >= n || ind[3] >= n) continue;
+			p = queries + nb_q * width;
+			w1 = snap + ind[0] * width;
+			w2 = snap + ind[1] * width;
+			w3 = snap + ind[2] * width;
+			for (c = 0; c < width; c++) p[c] = - w1[c] + w2[c] + w3[c];
+			question[nb_q] = i;
+			best[nb_q] = -1e30;
+			argmax[nb_q] = -1;
+			nb_q++;
 		}
-
-		//Find the closest in the vocabulary, TODO: BLAS matrix-vector product should help here
-		max = 1.175494e-38;
-		argmax = 0;
-		for (j = 0; j < vocab_size; j++) {
-			dot = 0;
-			for (c = 0; c < layer1_size; c++) {
-				dot += pred_emb[c] * emb_copy[j * layer1_size + c];
+		for (j = 0; j < n; j += EVAL_WORD_BLOCK) {
+			j_end = j + EVAL_WORD_BLOCK < n ? j + EVAL_WORD_BLOCK : n;
+#if USE_BLAS
+			cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, nb_q, j_end - j, width,
+					1.0, queries, width, snap + j * width, width, 0.0, scores, EVAL_WORD_BLOCK);
+#else
+			for (q = 0; q < nb_q; q++) for (c = j; c < j_end; c++) {
+				real dot = 0;
+				long long d;
+				for (d = 0; d < width; d++) dot += queries[q * width + d] * snap[c * width + d];
+				scores[q * EVAL_WORD_BLOCK + c - j] = dot;
 			}
-			if (dot > max){
-				max = dot;
-				argmax = j;
+#endif
+			for (q = 0; q < nb_q; q++) {
+				ind = analogy_eval_arr + question[q] * 4;
+				for (c = j; c < j_end; c++) {
+					if (scores[q * EVAL_WORD_BLOCK + c - j] <= best[q]) continue;
+					if (c == ind[0] || c == ind[1] || c == ind[2]) continue;
+					best[q] = scores[q * EVAL_WORD_BLOCK + c - j];
+					argmax[q] = c;
+				}
 			}
 		}
-		//If the closest word is the right one
-		if (argmax == analogy_eval_arr[i * 4 + 3]){
-			nb_correct++;
+		for (q = 0; q < nb_q; q++) if (argmax[q] == analogy_eval_arr[question[q] * 4 + 3]) nb_correct++;
+		nb_asked += nb_q;
+	}
+	printf("\nEpoch %lld: accuracy over %i/%i analogy questions: %f%%\n", epoch, nb_asked, nb_analogy_questions,
+			nb_asked > 0 ? (float)nb_correct / (float)nb_asked * 100.0 : 0.0);
+	fflush(stdout);
+	free(question);
+	free(best);
+	free(argmax);
+}
+
+//Evaluation thread: waits for the requests posted by RequestEvaluation, evaluates the latest one on a snapshot
+void *EvalThread(void *unused) {
+	long long n = vocab_size, width = OutputWidth(), epoch;
+	real *snap, *queries, *scores;
+	if (eval_top_words > 0 && eval_top_words < n) n = eval_top_words;
+	snap = (real *)malloc(n * width * sizeof(real));
+	queries = (real *)malloc(EVAL_QUERY_BLOCK * width * sizeof(real));
+	scores = (real *)malloc((long long)EVAL_QUERY_BLOCK * EVAL_WORD_BLOCK * sizeof(real));
+	if (snap == NULL || queries == NULL || scores == NULL) {printf("Memory allocation failed\n"); exit(1);}
+	while (1) {
+		pthread_mutex_lock(&eval_mutex);
+		while (!eval_requested && !eval_stop) pthread_cond_wait(&eval_cond, &eval_mutex);
+		if (!eval_requested) {
+			pthread_mutex_unlock(&eval_mutex);
+			break;
 		}
+		eval_requested = 0;
+		epoch = eval_epoch;
+		pthread_mutex_unlock(&eval_mutex);
+		SnapshotEmbeddings(snap, n);
+		EvalSnapshot(snap, n, queries, scores, epoch);
 	}
-	printf("Accuracy over the %i analogy questions: %f%%\n",nb_analogy_questions, (float)(nb_correct)/ (float)(nb_analogy_questions) * 100.0);
+	free(snap);
+	free(queries);
+	free(scores);
+	pthread_exit(NULL);
+}
+
+//Posts an evaluation of the current model, never waits: if the previous evaluation is still running, the
+//request replaces any pending one
+void RequestEvaluation(long long epoch) {
+	pthread_mutex_lock(&eval_mutex);
+	eval_requested = 1;
+	eval_epoch = epoch;
+	pthread_cond_signal(&eval_cond);
+	pthread_mutex_unlock(&eval_mutex);
+}
+
+//Waits for the pending evaluation and stops the evaluation thread
+void StopEvaluation() {
+	pthread_mutex_lock(&eval_mutex);
+	eval_stop = 1;
+	pthread_cond_signal(&eval_cond);
+	pthread_mutex_unlock(&eval_mutex);
+	pthread_join(eval_thread, NULL);
+}
+
 
-	free(emb_copy);
-	free(pred_emb);
+//Allocates a vocab_size x layer1_size matrix. With -mmap-dir it is backed by the file <dir>/<name>.mat (raw
+//row major floats, rows in vocabulary order): the pages are read on demand, except the rows of the -mlock-words
+//most frequent words which are locked in RAM, and the file holds the trained matrix at the end. With several
+//workers, which share the directory on one host, each one has its own files <dir>/<name>.w<id>.mat.
+real *AllocMatrix(const char *name) {
+	real *m = NULL;
+	char path[2 * MAX_STRING];
+	int fd;
+	size_t size = (size_t)vocab_size * layer1_size * sizeof(real), hot;
+	if (mmap_dir[0] == 0) {
+		if (posix_memalign((void **)&m, 128, size) != 0) m = NULL;
+		if (m == NULL) {printf("Memory allocation failed\n"); exit(1);}
+		return m;
+	}
+	if (num_workers > 1) sprintf(path, "%s/%s.w%d.mat", mmap_dir, name, worker_id);
+	else sprintf(path, "%s/%s.mat", mmap_dir, name);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, size) != 0) {printf("ERROR: cannot create matrix file %s\n", path); exit(1);}
+	m = (real *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {printf("ERROR: cannot map matrix file %s\n", path); exit(1);}
+	//The tail of the vocabulary is accessed at random, no read-ahead
+	madvise(m, size, MADV_RANDOM);
+	hot = (size_t)(mlock_words < vocab_size ? mlock_words : vocab_size) * layer1_size * sizeof(real);
+	if (hot > 0) {
+		madvise(m, hot, MADV_WILLNEED);
+		if (mlock(m, hot) != 0) printf("Warning: cannot lock the %lld MB hot rows of %s in RAM (see ulimit -l)\n", (long long)(hot >> 20), name);
+	}
+	mapped_mats[nb_mapped_mats].ptr = m;
+	mapped_mats[nb_mapped_mats].size = size;
+	strcpy(mapped_mats[nb_mapped_mats].path, path);
+	nb_mapped_mats++;
+	return m;
+}
 
+//Releases a matrix, removing its file if it was memory-mapped
+void FreeMatrix(real *m) {
+	int i;
+	for (i = 0; i < nb_mapped_mats; i++) if (mapped_mats[i].ptr == m) {
+		munmap(m, mapped_mats[i].size);
+		unlink(mapped_mats[i].path);
+		mapped_mats[i] = mapped_mats[--nb_mapped_mats];
+		return;
+	}
+	free(m);
 }
 
+//Flushes the memory-mapped matrices to their files
+void SyncMatrices() {
+	int i;
+	char path[2 * MAX_STRING];
+	FILE *fo;
+	for (i = 0; i < nb_mapped_mats; i++) msync(mapped_mats[i].ptr, mapped_mats[i].size, MS_SYNC);
+	if (nb_mapped_mats == 0 || worker_id != 0) return;
+	//Row order of the matrix files, the same for all the workers
+	sprintf(path, "%s/vocab.txt", mmap_dir);
+	fo = fopen(path, "wb");
+	for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", vocab[i].word, vocab[i].cn);
+	fclose(fo);
+}
 
 void InitNet() {
 	long long a, b;
@@ -430,15 +876,11 @@ void InitNet() {
 	//Complex word2vec model
 	if ( StartsWith("complex", model_type)){
 
-		a = posix_memalign((void **)&word_real, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (word_real== NULL) {printf("Memory allocation failed\n"); exit(1);}
-		a = posix_memalign((void **)&word_imag, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (word_imag == NULL) {printf("Memory allocation failed\n"); exit(1);}
+		word_real = AllocMatrix("word_real");
+		word_imag = AllocMatrix("word_imag");
 
-		a = posix_memalign((void **)&ctxt_real, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (ctxt_real== NULL) {printf("Memory allocation failed\n"); exit(1);}
-		a = posix_memalign((void **)&ctxt_imag, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (ctxt_imag== NULL) {printf("Memory allocation failed\n"); exit(1);}
+		ctxt_real = AllocMatrix("ctxt_real");
+		ctxt_imag = AllocMatrix("ctxt_imag");
 
 		for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++){
 			ctxt_real[a * layer1_size + b] = 0;
@@ -454,15 +896,11 @@ void InitNet() {
 	//Real valued baseline
 	if ( StartsWith("2real", model_type)){
 
-		a = posix_memalign((void **)&word_right, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (word_right== NULL) {printf("Memory allocation failed\n"); exit(1);}
-		a = posix_memalign((void **)&word_left, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (word_left == NULL) {printf("Memory allocation failed\n"); exit(1);}
+		word_right = AllocMatrix("word_right");
+		word_left = AllocMatrix("word_left");
 
-		a = posix_memalign((void **)&ctxt_right, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (ctxt_right== NULL) {printf("Memory allocation failed\n"); exit(1);}
-		a = posix_memalign((void **)&ctxt_left, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (ctxt_left== NULL) {printf("Memory allocation failed\n"); exit(1);}
+		ctxt_right = AllocMatrix("ctxt_right");
+		ctxt_left = AllocMatrix("ctxt_left");
 
 		for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++){
 			ctxt_right[a * layer1_size + b] = 0;
@@ -490,17 +928,13 @@ void InitNet() {
 	//Real original word2vec model
 	if ( StartsWith("real", model_type) ){
 
-		a = posix_memalign((void **)&word_emb, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (word_emb== NULL) {printf("Memory allocation failed\n"); exit(1);}
+		word_emb = AllocMatrix("word_emb");
 
-		a = posix_memalign((void **)&ctxt_emb, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (ctxt_emb== NULL) {printf("Memory allocation failed\n"); exit(1);}
+		ctxt_emb = AllocMatrix("ctxt_emb");
 
 		if (adagrad) {
-			a = posix_memalign((void **)&word_grad_acc, 128, (long long)vocab_size * layer1_size * sizeof(real));
-			if (word_grad_acc== NULL) {printf("Memory allocation failed\n"); exit(1);}
-			a = posix_memalign((void **)&ctxt_grad_acc, 128, (long long)vocab_size * layer1_size * sizeof(real));
-			if (ctxt_grad_acc== NULL) {printf("Memory allocation failed\n"); exit(1);}
+			word_grad_acc = AllocMatrix("word_grad_acc");
+			ctxt_grad_acc = AllocMatrix("ctxt_grad_acc");
 		}
 
 		for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++){
@@ -516,161 +950,569 @@ void InitNet() {
 }
 
 
+//Run of consecutive pairs of a batch sharing the same word and context position, ended by the flush
+struct sample_group {
+	unsigned long long key;
+	int start, len;
+};
+
+//Per thread state of the batch generation, kept between two calls to BuildNextBatch
+struct batch_state {
+	long long a, b, d, word_count, last_word_count, sentence_length, sentence_position, local_iter, sync_in_epoch;
+	int word, last_word, sen[MAX_SENTENCE_LENGTH + 1];
+	unsigned long long next_random;
+	clock_t now;
+	FILE *fi;
+	void *id;
+	//Reordering buffers
+	struct train_sample *reorder_tmp;
+	struct sample_group *groups;
+	//Pre-generated negatives (-neg-buffer), drawn from a counter-based generator seeded by the thread id
+	int *negatives;
+	long long neg_pos;
+	unsigned long long neg_seed, neg_counter;
+};
+
+//Start of the part of the corpus read by a thread: the file is split between the workers, then between their threads
+long long ThreadFileOffset(long long id) {
+	long long shard_size = file_size / num_workers;
+	return shard_size * worker_id + shard_size / num_threads * id;
+}
+
+void InitBatchState(struct batch_state *st, void *id) {
+	st->id = id;
+	st->word_count = 0;
+	st->last_word_count = 0;
+	st->sentence_length = 0;
+	st->sentence_position = 0;
+	st->local_iter = iter;
+	st->sync_in_epoch = 0;
+	st->next_random = (long long)id;
+	st->fi = fopen(train_file, "rb");
+	fseek(st->fi, ThreadFileOffset((long long)id), SEEK_SET);
+	st->next_random = st->next_random * (unsigned long long)25214903917 + 11;
+	st->b = st->next_random % window;
+	st->a = st->b;
+	st->d = 0;
+	st->reorder_tmp = NULL;
+	st->groups = NULL;
+	st->negatives = NULL;
+	st->neg_pos = neg_buffer_size;
+	st->neg_seed = ((unsigned long long)(long long)id + 1) * 0x9E3779B97F4A7C15ULL;
+	st->neg_counter = 0;
+	if (neg_buffer_size > 0) st->negatives = (int *)malloc(neg_buffer_size * sizeof(int));
+	if (reorder) {
+		st->reorder_tmp = (struct train_sample *)malloc(batch_size * sizeof(struct train_sample));
+		st->groups = (struct sample_group *)malloc(batch_size * sizeof(struct sample_group));
+	}
+}
+
+void FreeBatchState(struct batch_state *st) {
+	fclose(st->fi);
+	free(st->reorder_tmp);
+	free(st->groups);
+	free(st->negatives);
+}
+
+//Position in 'table' of the negative drawn with the random number r by a thread. With partitioned sampling,
+//a fraction neg_global of the draws still use the global table, the others the partition of the thread.
+static inline long long NegativeTableIndex(unsigned long long r, struct batch_state *st) {
+	if (neg_partitions > 0 && (r & 0xFFFF) >= neg_global * 65536)
+		return table_size + (long long)st->id * part_table_size + (r >> 16) % part_table_size;
+	return (r >> 16) % table_size;
+}
+
+//Counter-based generator (splitmix64 finalizer): every draw only depends on the seed and its counter,
+//so a whole buffer is produced without a serial dependency chain and the loop vectorizes
+static inline unsigned long long CounterRandom(unsigned long long seed, unsigned long long counter) {
+	unsigned long long z = seed + counter * 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+//Refills the negative buffer of a thread: random numbers are drawn for the whole buffer first,
+//then resolved through the unigram table in a loop with independent loads
+void RefillNegatives(struct batch_state *st) {
+	long long j;
+	unsigned long long r;
+	int *negs = st->negatives;
+	for (j = 0; j < neg_buffer_size; j++) {
+		r = CounterRandom(st->neg_seed, st->neg_counter + j);
+		negs[j] = (int)NegativeTableIndex(r, st);
+	}
+	st->neg_counter += neg_buffer_size;
+	for (j = 0; j < neg_buffer_size; j++) negs[j] = table[negs[j]];
+	for (j = 0; j < neg_buffer_size; j++) if (negs[j] == 0) {
+		r = CounterRandom(st->neg_seed ^ 0xD1B54A32D192ED03ULL, st->neg_counter + j);
+		negs[j] = r % (vocab_size - 1) + 1;
+	}
+	st->neg_pos = 0;
+}
+
+static inline long long NextNegative(struct batch_state *st) {
+	if (st->neg_pos == neg_buffer_size) RefillNegatives(st);
+	return st->negatives[st->neg_pos++];
+}
+
+int SampleGroupCompare(const void *a, const void *b) {
+	const struct sample_group *ga = (const struct sample_group *)a, *gb = (const struct sample_group *)b;
+	if (ga->key != gb->key) return ga->key < gb->key ? -1 : 1;
+	return ga->start - gb->start;
+}
+
+//Reorders a batch so that the kernels see runs of the same matrix and of the same rows:
+//1: whole word groups are sorted by sign stream then word row, each flush still comes after its negatives.
+//   The pairs before the first flush and after the last one belong to groups spanning two batches and stay in place.
+//2: pairs are sorted by sign stream then target row. Only valid with coalesced execution, as word gradients
+//   are then applied at the end of the batch whatever the position of the flush.
+void ReorderBatch(struct train_sample *batch, struct batch_state *st) {
+	int i, j, nb_groups = 0, head = 0, tail = batch_size;
+	struct sample_group *g = st->groups;
+
+	if (reorder == 1) {
+		while (head < batch_size && !(batch[head].flags & SAMPLE_FLUSH)) head++;
+		head++;
+		while (tail > head && !(batch[tail - 1].flags & SAMPLE_FLUSH)) tail--;
+		for (i = head; i < tail; i = j) {
+			for (j = i; !(batch[j].flags & SAMPLE_FLUSH); j++);
+			j++;
+			g[nb_groups].key = ((unsigned long long)(batch[i].flags & SAMPLE_NEG_SIGN) << 32) | batch[i].word;
+			g[nb_groups].start = i;
+			g[nb_groups].len = j - i;
+			nb_groups++;
+		}
+	} else {
+		head = 0;
+		tail = batch_size;
+		for (i = 0; i < batch_size; i++) {
+			g[i].key = ((unsigned long long)(batch[i].flags & SAMPLE_NEG_SIGN) << 32) | batch[i].target;
+			g[i].start = i;
+			g[i].len = 1;
+		}
+		nb_groups = batch_size;
+	}
+	if (nb_groups < 2) return;
+	qsort(g, nb_groups, sizeof(struct sample_group), SampleGroupCompare);
+	for (i = 0, j = head; i < nb_groups; i++) {
+		memcpy(st->reorder_tmp + j, batch + g[i].start, g[i].len * sizeof(struct train_sample));
+		j += g[i].len;
+	}
+	memcpy(batch + head, st->reorder_tmp + head, (tail - head) * sizeof(struct train_sample));
+}
+
 //Builds next batch of training pairs. Emulate a python-style yield.
-void* BuildNextBatch(long long *batch, long long *a,long long *b,long long *d, long long *word_count, long long *last_word_count, 
-		long long *word, long long *last_word, long long *sentence_length, long long *sentence_position, long long *sen, long long *local_iter,
-		unsigned long long *next_random, clock_t * now, FILE* fi, void* id) {
+void BuildNextBatch(struct train_sample *batch, struct batch_state *st) {
 
 	long long i = 0, c = 0, target, label;
 
 	while (1) {
-		if (*a == *b) { //Else jumps back to where we were
+		if (st->a == st->b) { //Else jumps back to where we were
 
-			if (*word_count - *last_word_count > 10000) {
-				word_count_actual += *word_count - *last_word_count;
-				*last_word_count = *word_count;
+			if (st->word_count - st->last_word_count > 10000) {
+				word_count_actual += st->word_count - st->last_word_count;
+				st->last_word_count = st->word_count;
 				if ((debug_mode > 1)) {
-					*now=clock();
+					st->now=clock();
 					printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
-							word_count_actual / (real)(iter * train_words + 1) * 100,
-							word_count_actual / ((real)(*now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
+							word_count_actual / (real)(iter * worker_words + 1) * 100,
+							word_count_actual / ((real)(st->now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
 					fflush(stdout);
 				}
-				if (!adagrad) alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
+				if (!adagrad) alpha = starting_alpha * (1 - word_count_actual / (real)(iter * worker_words + 1));
 				if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
 			}
 
-			if (*sentence_length == 0) {
+			if (st->sentence_length == 0) {
 				while (1) {
-					*word = ReadWordIndex(fi);
-					if (feof(fi)) break;
-					if (*word == -1) continue;
-					(*word_count)++;
-					if (*word == 0) break;
+					st->word = ReadWordIndex(st->fi);
+					if (feof(st->fi)) break;
+					if (st->word == -1) continue;
+					st->word_count++;
+					if (st->word == 0) break;
 					// The subsampling randomly discards frequent words while keeping the ranking same
 					if (sample > 0) {
-						real ran = (sqrt(vocab[*word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[*word].cn;
-						*next_random = *next_random * (unsigned long long)25214903917 + 11;
-						if (ran < (*next_random & 0xFFFF) / (real)65536) continue;
+						real ran = (sqrt(vocab[st->word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[st->word].cn;
+						st->next_random = st->next_random * (unsigned long long)25214903917 + 11;
+						if (ran < (st->next_random & 0xFFFF) / (real)65536) continue;
 					}
-					sen[*sentence_length] = *word;
-					(*sentence_length)++;
-					if (*sentence_length >= MAX_SENTENCE_LENGTH) break;
+					st->sen[st->sentence_length] = st->word;
+					st->sentence_length++;
+					if (st->sentence_length >= MAX_SENTENCE_LENGTH) break;
 				}
-				*sentence_position = 0;
+				st->sentence_position = 0;
+			}
+
+			//Intermediate parameter averaging rounds of the epoch, driven by thread 0
+			if (num_workers > 1 && st->id == 0 && st->sync_in_epoch < syncs_per_epoch - 1
+					&& st->word_count > (st->sync_in_epoch + 1) * (worker_words / num_threads / syncs_per_epoch)) {
+				SyncParameters();
+				st->sync_in_epoch++;
 			}
 
-			if (feof(fi) || (*word_count > train_words / num_threads)) {
-				word_count_actual += *word_count - *last_word_count;
-				(*local_iter)--;
-				*word_count = 0;
-				*last_word_count = 0;
-				*sentence_length = 0;
-				fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-				//Run evaluation at each epoch for one thread only
-				if (id == 0 && StartsWith("real_original", model_type) && strlen(eval_file) > 0) {
-					EvalSingleEmbModel(word_emb);
+			if (feof(st->fi) || (st->word_count > worker_words / num_threads)) {
+				word_count_actual += st->word_count - st->last_word_count;
+				st->local_iter--;
+				st->word_count = 0;
+				st->last_word_count = 0;
+				st->sentence_length = 0;
+				fseek(st->fi, ThreadFileOffset((long long)st->id), SEEK_SET);
+				if (num_workers > 1 && st->id == 0) {
+					//The rounds of the epoch not reached before the end of the shard, so that every worker enters
+					//each round of each epoch together
+					while (st->sync_in_epoch < syncs_per_epoch - 1) {
+						SyncParameters();
+						st->sync_in_epoch++;
+					}
+					SyncParameters();
+					st->sync_in_epoch = 0;
 				}
+				//Evaluation at each epoch, in the background
+				if (st->id == 0 && worker_id == 0 && strlen(eval_file) > 0) RequestEvaluation(iter - st->local_iter);
 				continue;
 			}
-			*word = sen[*sentence_position];
-			if (*word == -1) continue;
+			st->word = st->sen[st->sentence_position];
+			if (st->word == -1) continue;
 		}
 
 		//That random 'b' starting point makes the window size not constant, but uniformly distributed in [0,window]
 		//Makes sense, as closer context is probably more linked to target word.
 		//Maybe uniform is not even enough, maybe we should make it geometrically decreasing with the distance to the target word
-		while ( *a < window * 2 + 1 - *b) {
-			if (*a != window) {
-				if (*d == 0){ //Else jumps back where we were
-					c = *sentence_position - window + *a;
-					if (c < 0) { (*a)++; continue; }
-					if (c >= *sentence_length) { (*a)++; continue; }
-					*last_word = sen[c];
-					if (*last_word == -1) { (*a)++; continue; }
+		while ( st->a < window * 2 + 1 - st->b) {
+			if (st->a != window) {
+				if (st->d == 0){ //Else jumps back where we were
+					c = st->sentence_position - window + st->a;
+					if (c < 0) { st->a++; continue; }
+					if (c >= st->sentence_length) { st->a++; continue; }
+					st->last_word = st->sen[c];
+					if (st->last_word == -1) { st->a++; continue; }
 				}
 
 				// NEGATIVE SAMPLING
-				while ( *d < negative + 1) {
-					if (*d == 0) {
-						target = *word;
+				while ( st->d < negative + 1) {
+					if (st->d == 0) {
+						target = st->word;
 						label = 1;
 					} else {
-						*next_random = *next_random * (unsigned long long)25214903917 + 11;
-						target = table[(*next_random >> 16) % table_size];
-						if (target == 0) target = *next_random % (vocab_size - 1) + 1;
-						if (target == *word) { (*d)++; continue; }
+						if (neg_buffer_size > 0) {
+							target = NextNegative(st);
+						} else {
+							st->next_random = st->next_random * (unsigned long long)25214903917 + 11;
+							target = table[NegativeTableIndex(st->next_random, st)];
+							if (target == 0) target = st->next_random % (vocab_size - 1) + 1;
+						}
+						if (target == st->word) { st->d++; continue; }
 						label = 0;
 					}
 
 					//Storing the batch indexes and the order to consider
-					batch[i*sample_size] = *last_word;
-					batch[i*sample_size+1] = target;
-					batch[i*sample_size+2] = label;
+					batch[i].word = st->last_word;
+					batch[i].target = target;
+					batch[i].flags = label ? SAMPLE_LABEL : 0;
 
 					//TOMOD: Sign of the imaginary part: 
 					//1: differentiates right and left contexts
 					//2: one word every two
 					if (sign_strat == 0) {
-						batch[i*sample_size+3] = (*a > window) * 2 - 1; 
+						if (st->a < window) batch[i].flags |= SAMPLE_NEG_SIGN;
 					} else if ( sign_strat == 1 ) {
-						if (*a < window)	batch[i*sample_size+3] = ((*a - *b) % 2) * 2 - 1; 
-						if (*a > window)	batch[i*sample_size+3] = ((*a - *b + 1) % 2) * 2 - 1; 
-					} else {
-						batch[i*sample_size+3] = 1; 
+						if (st->a < window && (st->a - st->b) % 2 == 0) batch[i].flags |= SAMPLE_NEG_SIGN;
+						if (st->a > window && (st->a - st->b + 1) % 2 == 0) batch[i].flags |= SAMPLE_NEG_SIGN;
 					}
 					//ENDMOD
 
 					//Controlling word gradient updates:
-					if (*d == negative){
-						batch[i*sample_size+4] = (long long)1;
-					} else {
-						batch[i*sample_size+4] = (long long)0;
-					}
+					if (st->d == negative) batch[i].flags |= SAMPLE_FLUSH;
 					
-					(*d)++;
-					i++; if (i == batch_size) return 0;
+					st->d++;
+					i++;
+					if (i == batch_size) {
+						if (reorder) ReorderBatch(batch, st);
+						return;
+					}
 				}
-				*d = 0; //Reinit for next loop
+				st->d = 0; //Reinit for next loop
 			
 			}
-			(*a)++;
+			st->a++;
 		}
-		*next_random = *next_random * (unsigned long long)25214903917 + 11;
-		*b = *next_random % window;
-		*a = *b; //Reinit for next loop
+		st->next_random = st->next_random * (unsigned long long)25214903917 + 11;
+		st->b = st->next_random % window;
+		st->a = st->b; //Reinit for next loop
 
 
-		(*sentence_position)++;
-		if (*sentence_position >= *sentence_length) {
-			*sentence_length = 0;
+		st->sentence_position++;
+		if (st->sentence_position >= st->sentence_length) {
+			st->sentence_length = 0;
 			continue;
 		}
 	}
 }
 
 
+//Software prefetch of a whole row, for writing, as every row read by the kernels is updated
+static inline void PrefetchRow(real *row) {
+	long long c;
+	for (c = 0; c < layer1_size; c += 64 / sizeof(real)) __builtin_prefetch(row + c, 1, 1);
+}
+
+//Returns the pair to prefetch while processing batch[i], NULL if prefetching is off or beyond the batch.
+//Its word row is only prefetched when it differs from the previous pair, as a word group shares it.
+static inline struct train_sample *PrefetchTarget(struct train_sample *batch, long long i, int *new_word) {
+	long long j = i + prefetch_distance;
+	if (prefetch_distance == 0 || j >= batch_size) return NULL;
+	*new_word = (j == 0) || (batch[j].word != batch[j - 1].word);
+	return batch + j;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// COALESCED EXECUTION: per thread scratch summing gradients of each unique row
+//////////////////////////////////////////////////////////////////////////////////
+
+struct row_scratch {
+	int *slot;           //Open addressing table: hash of the row key -> slot, -1 if empty
+	long long *keys;     //Row key of each used slot, in insertion order
+	int *pos;            //Position of each used slot in the table
+	real *grad;          //Gradient sums, 'width' values per slot
+	int table_size, width, nb_rows;
+};
+
+void InitRowScratch(struct row_scratch *s, int width) {
+	int a;
+	//At most batch_size distinct rows per batch, keep the table at most half full
+	s->table_size = 1;
+	while (s->table_size < 2 * batch_size) s->table_size *= 2;
+	s->width = width;
+	s->nb_rows = 0;
+	s->slot = (int *)malloc(s->table_size * sizeof(int));
+	s->keys = (long long *)malloc(batch_size * sizeof(long long));
+	s->pos = (int *)malloc(batch_size * sizeof(int));
+	a = posix_memalign((void **)&s->grad, 128, (long long)batch_size * width * sizeof(real));
+	if (s->slot == NULL || s->keys == NULL || s->pos == NULL || s->grad == NULL) {printf("Memory allocation failed\n"); exit(1);}
+	for (a = 0; a < s->table_size; a++) s->slot[a] = -1;
+}
+
+void FreeRowScratch(struct row_scratch *s) {
+	free(s->slot);
+	free(s->keys);
+	free(s->pos);
+	free(s->grad);
+}
+
+static inline int RowScratchHash(struct row_scratch *s, long long key) {
+	return (int)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> 32) & (s->table_size - 1);
+}
+
+//Returns the gradient accumulator of the given row, zeroed the first time the row is seen in the batch
+real *RowScratchGet(struct row_scratch *s, long long key) {
+	int h = RowScratchHash(s, key), c;
+	while (s->slot[h] != -1) {
+		if (s->keys[s->slot[h]] == key) return s->grad + (long long)s->slot[h] * s->width;
+		h = (h + 1) & (s->table_size - 1);
+	}
+	s->slot[h] = s->nb_rows;
+	s->keys[s->nb_rows] = key;
+	s->pos[s->nb_rows] = h;
+	for (c = 0; c < s->width; c++) s->grad[(long long)s->nb_rows * s->width + c] = 0;
+	s->nb_rows++;
+	return s->grad + (long long)(s->nb_rows - 1) * s->width;
+}
+
+//Only clears the slots used by the last batch
+void ResetRowScratch(struct row_scratch *s) {
+	int i;
+	for (i = 0; i < s->nb_rows; i++) s->slot[s->pos[i]] = -1;
+	s->nb_rows = 0;
+}
+
+//Clamped logistic gradient of the label given the score, shared by all coalesced kernels
+static inline real SigmoidGrad(real f, long long label) {
+	if (f > MAX_EXP) return label - 1;
+	else if (f < -MAX_EXP) return label - 0;
+	else return label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+}
+
+
+//Gathered execution (-exec 2): tile holding the context rows of one word group ('width' floats per row),
+//followed by two work vectors of 'width' floats
+real *AllocGatherTile(int width) {
+	real *tile = NULL;
+	if (posix_memalign((void **)&tile, 128, (long long)(negative + 3) * width * sizeof(real)) != 0) tile = NULL;
+	if (tile == NULL) {printf("Memory allocation failed\n"); exit(1);}
+	return tile;
+}
+
+//Length of the run of pairs starting at batch[i] that share the word and sign, ended by the flush pair or the batch end
+static inline long long GatherRunLength(struct train_sample *batch, long long i) {
+	long long n = 1;
+	while (!(batch[i + n - 1].flags & SAMPLE_FLUSH) && i + n < batch_size && n < negative + 1
+			&& batch[i + n].word == batch[i].word && (batch[i + n].flags & SAMPLE_NEG_SIGN) == (batch[i].flags & SAMPLE_NEG_SIGN)) n++;
+	return n;
+}
+
+//Scores of the n rows of 'tile' against 'vect' (f[j] = tile_j . vect, accumulated if 'acc' is set)
+static inline void TileScores(real *tile, long long n, real *vect, real *f, int acc) {
+#if USE_BLAS
+	cblas_sgemv(CblasRowMajor, CblasNoTrans, n, layer1_size, 1, tile, layer1_size, vect, 1, acc ? 1 : 0, f, 1);
+#else
+	long long j, c;
+	real dot;
+	for (j = 0; j < n; j++) {
+		dot = 0;
+		for (c = 0; c < layer1_size; c++) dot += tile[j * layer1_size + c] * vect[c];
+		f[j] = acc ? f[j] + dot : dot;
+	}
+#endif
+}
+
+//Weighted sum of the n rows of 'tile': out += sum_j g[j] * tile_j
+static inline void TileWeightedSum(real *tile, long long n, real *g, real *out) {
+#if USE_BLAS
+	cblas_sgemv(CblasRowMajor, CblasTrans, n, layer1_size, 1, tile, layer1_size, g, 1, 1, out, 1);
+#else
+	long long j, c;
+	for (j = 0; j < n; j++) for (c = 0; c < layer1_size; c++) out[c] += g[j] * tile[j * layer1_size + c];
+#endif
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////
 // REAL MODEL
 //////////////////////////////////////////////////////////////////////////////////
 
 
+//Applies a summed row gradient, with the adagrad step if 'acc' is given
+static inline void ApplyRealRowGrad(real *emb, real *acc, real *grad) {
+	long long c;
+	if (acc != NULL) {
+		for (c = 0; c < layer1_size; c++){
+			acc[c] += grad[c] * grad[c];
+			emb[c] += (alpha / (sqrt(acc[c]) + adagrad_reg)) * grad[c];
+		}
+	} else {
+		for (c = 0; c < layer1_size; c++) emb[c] += grad[c];
+	}
+}
+
+//Prefetches the rows used by the pair -prefetch positions ahead of batch[i]
+static inline void PrefetchRealPair(struct train_sample *batch, long long i) {
+	int new_word;
+	struct train_sample *s = PrefetchTarget(batch, i, &new_word);
+	if (s == NULL) return;
+	PrefetchRow(ctxt_emb + (long long)s->target * layer1_size);
+	if (adagrad) PrefetchRow(ctxt_grad_acc + (long long)s->target * layer1_size);
+	if (new_word) PrefetchRow(word_emb + (long long)s->word * layer1_size);
+}
+
+//Coalesced version of the batch loop (-exec 1): scores are all computed against the rows as they were
+//before the batch, then gradients are summed per unique row and every row is written once.
+void TrainRealBatchCoalesced(struct train_sample *batch, real *g_batch, struct row_scratch *word_scratch, struct row_scratch *ctxt_scratch) {
+	long long i, c, l1, l2;
+	real f, g, *grad_word, *grad_ctxt;
+
+	for (i = 0; i < batch_size; i++) {
+		PrefetchRealPair(batch, i);
+		l1 = (long long)batch[i].word * layer1_size;
+		l2 = (long long)batch[i].target * layer1_size;
+		f = 0;
+		for (c = 0; c < layer1_size; c++) f += word_emb[c + l1] * ctxt_emb[c + l2];
+		g_batch[i] = SigmoidGrad(f, batch[i].flags & SAMPLE_LABEL);
+		if (!adagrad) g_batch[i] *= alpha;
+	}
+
+	for (i = 0; i < batch_size; i++) {
+		l1 = (long long)batch[i].word * layer1_size;
+		l2 = (long long)batch[i].target * layer1_size;
+		grad_word = RowScratchGet(word_scratch, batch[i].word);
+		grad_ctxt = RowScratchGet(ctxt_scratch, batch[i].target);
+		g = g_batch[i];
+		for (c = 0; c < layer1_size; c++){
+			grad_word[c] += g * ctxt_emb[c + l2];
+			grad_ctxt[c] += g * word_emb[c + l1];
+		}
+	}
+
+	for (i = 0; i < ctxt_scratch->nb_rows; i++) {
+		l2 = ctxt_scratch->keys[i] * layer1_size;
+		ApplyRealRowGrad(ctxt_emb + l2, adagrad ? ctxt_grad_acc + l2 : NULL, ctxt_scratch->grad + i * layer1_size);
+	}
+	for (i = 0; i < word_scratch->nb_rows; i++) {
+		l1 = word_scratch->keys[i] * layer1_size;
+		ApplyRealRowGrad(word_emb + l1, adagrad ? word_grad_acc + l1 : NULL, word_scratch->grad + i * layer1_size);
+	}
+	ResetRowScratch(word_scratch);
+	ResetRowScratch(ctxt_scratch);
+}
+
+//Gathered version of the batch loop (-exec 2): the context rows of a word group (positive and negatives) are
+//copied in a tile and scored with one matrix-vector product, then the context updates are scattered back and
+//the word gradient is accumulated with a second product. Flush semantics are the ones of the sequential loop.
+void TrainRealBatchGathered(struct train_sample *batch, real *tile, real *g_tile, real *grad_word_emb) {
+	long long i, j, n, c, l1, l2;
+	real tmp_grad, *w, *cur_tile;
+
+	for (i = 0; i < batch_size; i += n) {
+		n = GatherRunLength(batch, i);
+		l1 = (long long)batch[i].word * layer1_size;
+		w = word_emb + l1;
+		for (j = 0; j < n; j++) {
+			PrefetchRealPair(batch, i + j);
+			memcpy(tile + j * layer1_size, ctxt_emb + (long long)batch[i + j].target * layer1_size, layer1_size * sizeof(real));
+		}
+		TileScores(tile, n, w, g_tile, 0);
+		for (j = 0; j < n; j++) {
+			g_tile[j] = SigmoidGrad(g_tile[j], batch[i + j].flags & SAMPLE_LABEL);
+			if (!adagrad) g_tile[j] *= alpha;
+		}
+
+		if ( adagrad ) {
+			for (j = 0; j < n; j++) {
+				l2 = (long long)batch[i + j].target * layer1_size;
+				cur_tile = tile + j * layer1_size;
+				for (c = 0; c < layer1_size; c++){
+					tmp_grad = g_tile[j] * cur_tile[c];
+					word_grad_acc[c + l1] += tmp_grad * tmp_grad;
+					grad_word_emb[c] += (alpha / (sqrt( word_grad_acc[c + l1]) + adagrad_reg)) * tmp_grad;
+					tmp_grad = g_tile[j] * w[c];
+					ctxt_grad_acc[c + l2] += tmp_grad * tmp_grad;
+					ctxt_emb[c + l2] += (alpha / (sqrt( ctxt_grad_acc[c + l2]) + adagrad_reg)) * tmp_grad;
+				}
+			}
+		} else {
+			TileWeightedSum(tile, n, g_tile, grad_word_emb);
+			for (j = 0; j < n; j++) {
+				l2 = (long long)batch[i + j].target * layer1_size;
+				for (c = 0; c < layer1_size; c++) ctxt_emb[c + l2] += g_tile[j] * w[c];
+			}
+		}
+
+		if (batch[i + n - 1].flags & SAMPLE_FLUSH) {
+			for (c = 0; c < layer1_size; c++){
+				w[c] += grad_word_emb[c];
+				grad_word_emb[c] = 0;
+			}
+		}
+	}
+}
+
 void *TrainRealModelThread(void *id) {
 	//Data processing variables
-	long long a, b, d, word, last_word, sentence_length = 0, sentence_position = 0;
-	long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
-	long long l1, l2, i, c, target, label, local_iter = iter, update_word_embs;
-	unsigned long long next_random = (long long)id;
-	clock_t now;
-	long long *batch = (long long *)calloc(sample_size * batch_size, sizeof(long long));
-	FILE *fi = fopen(train_file, "rb");
-	fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+	long long l1, l2, i, c, label, update_word_embs;
+	unsigned int last_word, target;
+	struct train_sample *batch = (struct train_sample *)calloc(batch_size, sizeof(struct train_sample));
+	struct batch_state st;
 	//Init variables for batch generation
-	next_random = next_random * (unsigned long long)25214903917 + 11;
-	b = next_random % window;
-	a = b;
-	d = 0;
-
+	InitBatchState(&st, id);
+
+	//Coalesced execution scratch
+	struct row_scratch word_scratch, ctxt_scratch;
+	real *g_batch = NULL;
+	if (exec_mode == 1) {
+		InitRowScratch(&word_scratch, layer1_size);
+		InitRowScratch(&ctxt_scratch, layer1_size);
+		g_batch = (real *)calloc(batch_size, sizeof(real));
+	}
 
 	//TOMOD: Model variables
 	real f, g, tmp_grad;
@@ -679,21 +1521,38 @@ void *TrainRealModelThread(void *id) {
 	for (c = 0; c < layer1_size; c++) grad_word_emb[c] = 0;
 	//ENDMOD
 
+	//Gathered execution tile
+	real *tile = NULL, *g_tile = NULL;
+	if (exec_mode == 2) {
+		tile = AllocGatherTile(layer1_size);
+		g_tile = (real *)calloc(negative + 1, sizeof(real));
+	}
+
 	while (1) {
 		//Create the next batch
-		BuildNextBatch(batch, &a, &b, &d, &word_count, &last_word_count, &word, &last_word, &sentence_length, &sentence_position, sen, &local_iter, &next_random, &now, fi, id);
+		BuildNextBatch(batch, &st);
 
-		if (local_iter == 0) break;
+		if (st.local_iter == 0) break;
+
+		if (exec_mode == 1) {
+			TrainRealBatchCoalesced(batch, g_batch, &word_scratch, &ctxt_scratch);
+			continue;
+		}
+		if (exec_mode == 2) {
+			TrainRealBatchGathered(batch, tile, g_tile, grad_word_emb);
+			continue;
+		}
 
 		for (i = 0; i < batch_size; i++) {
+			PrefetchRealPair(batch, i);
 			//train skip-gram
-			last_word = batch[i*sample_size];
-			target = batch[i*sample_size + 1];
-			label = batch[i*sample_size + 2];
-			update_word_embs = batch[i*sample_size + 4];
+			last_word = batch[i].word;
+			target = batch[i].target;
+			label = batch[i].flags & SAMPLE_LABEL;
+			update_word_embs = (batch[i].flags & SAMPLE_FLUSH) != 0;
 
-			l1 = last_word * layer1_size;
-			l2 = target * layer1_size;
+			l1 = (long long)last_word * layer1_size;
+			l2 = (long long)target * layer1_size;
 
 			
 
@@ -757,7 +1616,15 @@ void *TrainRealModelThread(void *id) {
 			//ENDMOD
 		}
 	}
-	fclose(fi);
+	FreeBatchState(&st);
+	free(batch);
+	if (exec_mode == 1) {
+		FreeRowScratch(&word_scratch);
+		FreeRowScratch(&ctxt_scratch);
+		free(g_batch);
+	}
+	free(tile);
+	free(g_tile);
 	//TOMOD: Free local vectors
 	free(grad_word_emb);
 	//ENDMOD
@@ -771,22 +1638,137 @@ void *TrainRealModelThread(void *id) {
 //////////////////////////////////////////////////////////////////////////////////
 
 
+//Prefetches the rows used by the pair -prefetch positions ahead of batch[i]
+static inline void PrefetchRealBaselinePair(struct train_sample *batch, long long i) {
+	int new_word;
+	struct train_sample *s = PrefetchTarget(batch, i, &new_word);
+	if (s == NULL) return;
+	if (SAMPLE_SIGN(*s) == 1) {
+		PrefetchRow(ctxt_right + (long long)s->target * layer1_size);
+		if (new_word) PrefetchRow(word_right + (long long)s->word * layer1_size);
+	} else {
+		PrefetchRow(ctxt_left + (long long)s->target * layer1_size);
+		if (new_word) PrefetchRow(word_left + (long long)s->word * layer1_size);
+	}
+}
+
+//Coalesced version of the batch loop (-exec 1), see TrainRealBatchCoalesced.
+//Row keys are 2 * row + 0 for the right matrices and 2 * row + 1 for the left ones.
+void TrainRealBaselineBatchCoalesced(struct train_sample *batch, real *g_batch, struct row_scratch *word_scratch, struct row_scratch *ctxt_scratch) {
+	long long i, c, l1, l2, side;
+	real f, g, *grad_word, *grad_ctxt, *grad, *emb;
+	real *cur_word_emb, *cur_ctxt_emb;
+
+	for (i = 0; i < batch_size; i++) {
+		PrefetchRealBaselinePair(batch, i);
+		l1 = (long long)batch[i].word * layer1_size;
+		l2 = (long long)batch[i].target * layer1_size;
+		if (SAMPLE_SIGN(batch[i]) == 1){
+			cur_word_emb = word_right + l1;
+			cur_ctxt_emb = ctxt_right + l2;
+		} else {
+			cur_word_emb = word_left + l1;
+			cur_ctxt_emb = ctxt_left + l2;
+		}
+		f = 0;
+		for (c = 0; c < layer1_size; c++) f += cur_word_emb[c] * cur_ctxt_emb[c];
+		g_batch[i] = SigmoidGrad(f, batch[i].flags & SAMPLE_LABEL) * alpha;
+	}
+
+	for (i = 0; i < batch_size; i++) {
+		l1 = (long long)batch[i].word * layer1_size;
+		l2 = (long long)batch[i].target * layer1_size;
+		side = SAMPLE_SIGN(batch[i]) == 1 ? 0 : 1;
+		if (side == 0){
+			cur_word_emb = word_right + l1;
+			cur_ctxt_emb = ctxt_right + l2;
+		} else {
+			cur_word_emb = word_left + l1;
+			cur_ctxt_emb = ctxt_left + l2;
+		}
+		grad_word = RowScratchGet(word_scratch, (long long)batch[i].word * 2 + side);
+		grad_ctxt = RowScratchGet(ctxt_scratch, (long long)batch[i].target * 2 + side);
+		g = g_batch[i];
+		for (c = 0; c < layer1_size; c++){
+			grad_word[c] += g * cur_ctxt_emb[c];
+			grad_ctxt[c] += g * cur_word_emb[c];
+		}
+	}
+
+	for (i = 0; i < ctxt_scratch->nb_rows; i++) {
+		l2 = (ctxt_scratch->keys[i] / 2) * layer1_size;
+		emb = (ctxt_scratch->keys[i] % 2 == 0 ? ctxt_right : ctxt_left) + l2;
+		grad = ctxt_scratch->grad + i * layer1_size;
+		for (c = 0; c < layer1_size; c++) emb[c] += grad[c];
+	}
+	for (i = 0; i < word_scratch->nb_rows; i++) {
+		l1 = (word_scratch->keys[i] / 2) * layer1_size;
+		emb = (word_scratch->keys[i] % 2 == 0 ? word_right : word_left) + l1;
+		grad = word_scratch->grad + i * layer1_size;
+		for (c = 0; c < layer1_size; c++) emb[c] += grad[c];
+	}
+	ResetRowScratch(word_scratch);
+	ResetRowScratch(ctxt_scratch);
+}
+
+//Gathered version of the batch loop (-exec 2), see TrainRealBatchGathered
+void TrainRealBaselineBatchGathered(struct train_sample *batch, real *tile, real *g_tile, real *grad_word_right, real *grad_word_left) {
+	long long i, j, n, c, l1, l2;
+	real *w, *ctxt, *grad_word;
+
+	for (i = 0; i < batch_size; i += n) {
+		n = GatherRunLength(batch, i);
+		l1 = (long long)batch[i].word * layer1_size;
+		if (SAMPLE_SIGN(batch[i]) == 1) {
+			w = word_right + l1;
+			ctxt = ctxt_right;
+			grad_word = grad_word_right;
+		} else {
+			w = word_left + l1;
+			ctxt = ctxt_left;
+			grad_word = grad_word_left;
+		}
+		for (j = 0; j < n; j++) {
+			PrefetchRealBaselinePair(batch, i + j);
+			memcpy(tile + j * layer1_size, ctxt + (long long)batch[i + j].target * layer1_size, layer1_size * sizeof(real));
+		}
+		TileScores(tile, n, w, g_tile, 0);
+		for (j = 0; j < n; j++) g_tile[j] = SigmoidGrad(g_tile[j], batch[i + j].flags & SAMPLE_LABEL) * alpha;
+
+		TileWeightedSum(tile, n, g_tile, grad_word);
+		for (j = 0; j < n; j++) {
+			l2 = (long long)batch[i + j].target * layer1_size;
+			for (c = 0; c < layer1_size; c++) ctxt[c + l2] += g_tile[j] * w[c];
+		}
+
+		if (batch[i + n - 1].flags & SAMPLE_FLUSH) {
+			for (c = 0; c < layer1_size; c++){
+				word_right[c + l1] += grad_word_right[c];
+				word_left[c + l1] += grad_word_left[c];
+				grad_word_right[c] = 0;
+				grad_word_left[c] = 0;
+			}
+		}
+	}
+}
+
 void *TrainRealBaselineModelThread(void *id) {
 	//Data processing variables
-	long long a, b, d, word, last_word, sentence_length = 0, sentence_position = 0;
-	long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
-	long long l1, l2, i, c, target, label, local_iter = iter, update_word_embs;
-	unsigned long long next_random = (long long)id;
-	clock_t now;
-	long long *batch = (long long *)calloc(sample_size * batch_size, sizeof(long long));
-	FILE *fi = fopen(train_file, "rb");
-	fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+	long long l1, l2, i, c, label, update_word_embs;
+	unsigned int last_word, target;
+	struct train_sample *batch = (struct train_sample *)calloc(batch_size, sizeof(struct train_sample));
+	struct batch_state st;
 	//Init variables for batch generation
-	next_random = next_random * (unsigned long long)25214903917 + 11;
-	b = next_random % window;
-	a = b;
-	d = 0;
-
+	InitBatchState(&st, id);
+
+	//Coalesced execution scratch
+	struct row_scratch word_scratch, ctxt_scratch;
+	real *g_batch = NULL;
+	if (exec_mode == 1) {
+		InitRowScratch(&word_scratch, layer1_size);
+		InitRowScratch(&ctxt_scratch, layer1_size);
+		g_batch = (real *)calloc(batch_size, sizeof(real));
+	}
 
 	//TOMOD: Model variables
 	real f, g, order_sign;
@@ -798,36 +1780,46 @@ void *TrainRealBaselineModelThread(void *id) {
 	for (c = 0; c < layer1_size; c++) grad_word_left[c] = 0;
 	//ENDMOD
 
-
+	//Gathered execution tile
+	real *tile = NULL, *g_tile = NULL;
+	if (exec_mode == 2) {
+		tile = AllocGatherTile(layer1_size);
+		g_tile = (real *)calloc(negative + 1, sizeof(real));
+	}
 
 	while (1) {
 		//Create the next batch
-		BuildNextBatch(batch, &a, &b, &d, &word_count, &last_word_count, &word, &last_word, &sentence_length, &sentence_position, sen, &local_iter, &next_random, &now, fi, id);
+		BuildNextBatch(batch, &st);
+
+		if (st.local_iter == 0) break;
 
-		if (local_iter == 0) break;
+		if (exec_mode == 1) {
+			TrainRealBaselineBatchCoalesced(batch, g_batch, &word_scratch, &ctxt_scratch);
+			continue;
+		}
+		if (exec_mode == 2) {
+			TrainRealBaselineBatchGathered(batch, tile, g_tile, grad_word_right, grad_word_left);
+			continue;
+		}
 
 /*
 		for (i = 0; i < batch_size; i++) {
-			last_word = batch[i*sample_size];
-			target = batch[i*sample_size + 1];
-			label = batch[i*sample_size + 2];
-			imag_part_sign = (real) batch[i*sample_size + 3];
-			update_word_embs = batch[i*sample_size + 4];
-			printf("%i\t%i\t%i\t%f\t%i\n",last_word,target,label,imag_part_sign,update_word_embs);
+			printf("%u\t%u\t%i\t%i\t%i\n",batch[i].word,batch[i].target,batch[i].flags & SAMPLE_LABEL,SAMPLE_SIGN(batch[i]),(batch[i].flags & SAMPLE_FLUSH) != 0);
 		}
 		exit(0);
 */
 
 		for (i = 0; i < batch_size; i++) {
+			PrefetchRealBaselinePair(batch, i);
 			//train skip-gram
-			last_word = batch[i*sample_size];
-			target = batch[i*sample_size + 1];
-			label = batch[i*sample_size + 2];
-			order_sign = batch[i*sample_size + 3];
-			update_word_embs = batch[i*sample_size + 4];
+			last_word = batch[i].word;
+			target = batch[i].target;
+			label = batch[i].flags & SAMPLE_LABEL;
+			order_sign = SAMPLE_SIGN(batch[i]);
+			update_word_embs = (batch[i].flags & SAMPLE_FLUSH) != 0;
 
-			l1 = last_word * layer1_size;
-			l2 = target * layer1_size;
+			l1 = (long long)last_word * layer1_size;
+			l2 = (long long)target * layer1_size;
 
 			
 			//TOMOD: Gradient computations and updates
@@ -890,7 +1882,15 @@ void *TrainRealBaselineModelThread(void *id) {
 			//ENDMOD
 		}
 	}
-	fclose(fi);
+	FreeBatchState(&st);
+	free(batch);
+	if (exec_mode == 1) {
+		FreeRowScratch(&word_scratch);
+		FreeRowScratch(&ctxt_scratch);
+		free(g_batch);
+	}
+	free(tile);
+	free(g_tile);
 	//TOMOD: Free local vectors
 	free(grad_word_right);
 	free(grad_word_left);
@@ -905,22 +1905,148 @@ void *TrainRealBaselineModelThread(void *id) {
 //////////////////////////////////////////////////////////////////////////////////
 
 
+//Prefetches the rows used by the pair -prefetch positions ahead of batch[i]
+static inline void PrefetchComplexPair(struct train_sample *batch, long long i) {
+	int new_word;
+	struct train_sample *s = PrefetchTarget(batch, i, &new_word);
+	if (s == NULL) return;
+	PrefetchRow(ctxt_real + (long long)s->target * layer1_size);
+	PrefetchRow(ctxt_imag + (long long)s->target * layer1_size);
+	if (new_word) {
+		PrefetchRow(word_real + (long long)s->word * layer1_size);
+		PrefetchRow(word_imag + (long long)s->word * layer1_size);
+	}
+}
+
+//Coalesced version of the batch loop (-exec 1), see TrainRealBatchCoalesced.
+//Each scratch row holds the real part gradient followed by the imaginary part gradient.
+void TrainComplexBatchCoalesced(struct train_sample *batch, real *g_batch, struct row_scratch *word_scratch, struct row_scratch *ctxt_scratch) {
+	long long i, c, l1, l2;
+	real f, g, imag_part_sign, dot_real, dot_imag, *grad_word, *grad_ctxt, *grad;
+
+	for (i = 0; i < batch_size; i++) {
+		PrefetchComplexPair(batch, i);
+		l1 = (long long)batch[i].word * layer1_size;
+		l2 = (long long)batch[i].target * layer1_size;
+		dot_real = 0; dot_imag = 0;
+		for (c = 0; c < layer1_size; c++){
+			dot_real += word_real[c + l1] * ctxt_real[c + l2] + word_imag[c + l1] * ctxt_imag[c + l2];
+			dot_imag += word_real[c + l1] * ctxt_imag[c + l2] - word_imag[c + l1] * ctxt_real[c + l2];
+		}
+		f = dot_real + SAMPLE_SIGN(batch[i]) * dot_imag;
+		g_batch[i] = SigmoidGrad(f, batch[i].flags & SAMPLE_LABEL) * alpha;
+	}
+
+	for (i = 0; i < batch_size; i++) {
+		l1 = (long long)batch[i].word * layer1_size;
+		l2 = (long long)batch[i].target * layer1_size;
+		imag_part_sign = SAMPLE_SIGN(batch[i]);
+		grad_word = RowScratchGet(word_scratch, batch[i].word);
+		grad_ctxt = RowScratchGet(ctxt_scratch, batch[i].target);
+		g = g_batch[i];
+		for (c = 0; c < layer1_size; c++){
+			grad_word[c] += g * ( ctxt_real[c + l2] + imag_part_sign * ctxt_imag[c + l2]);
+			grad_word[c + layer1_size] += g * ( ctxt_imag[c + l2] - imag_part_sign * ctxt_real[c + l2]);
+			grad_ctxt[c] += g * ( word_real[c + l1] - imag_part_sign * word_imag[c + l1]);
+			grad_ctxt[c + layer1_size] += g * ( word_imag[c + l1] + imag_part_sign * word_real[c + l1]);
+		}
+	}
+
+	for (i = 0; i < ctxt_scratch->nb_rows; i++) {
+		l2 = ctxt_scratch->keys[i] * layer1_size;
+		grad = ctxt_scratch->grad + i * 2 * layer1_size;
+		for (c = 0; c < layer1_size; c++){
+			ctxt_real[c + l2] += grad[c];
+			ctxt_imag[c + l2] += grad[c + layer1_size];
+		}
+	}
+	for (i = 0; i < word_scratch->nb_rows; i++) {
+		l1 = word_scratch->keys[i] * layer1_size;
+		grad = word_scratch->grad + i * 2 * layer1_size;
+		for (c = 0; c < layer1_size; c++){
+			word_real[c + l1] += grad[c];
+			word_imag[c + l1] += grad[c + layer1_size];
+		}
+	}
+	ResetRowScratch(word_scratch);
+	ResetRowScratch(ctxt_scratch);
+}
+
+//Gathered version of the batch loop (-exec 2), see TrainRealBatchGathered. With s the sign of the group,
+//u = w_re - s * w_im and v = w_im + s * w_re, the scores are tile_re . u + tile_im . v (two products) and
+//the context updates are g * u and g * v. The tile holds the real parts of the group rows then the imaginary parts.
+void TrainComplexBatchGathered(struct train_sample *batch, real *tile, real *g_tile, real *grad_word_real, real *grad_word_imag) {
+	long long i, j, n, c, l1, l2;
+	real imag_part_sign, *tile_re, *tile_im, *u, *v, *sum_re, *sum_im;
+
+	tile_re = tile;
+	tile_im = tile + (negative + 1) * layer1_size;
+	u = tile + 2 * (negative + 1) * layer1_size;
+	v = u + layer1_size;
+	sum_re = v + layer1_size;
+	sum_im = sum_re + layer1_size;
+	for (i = 0; i < batch_size; i += n) {
+		n = GatherRunLength(batch, i);
+		l1 = (long long)batch[i].word * layer1_size;
+		imag_part_sign = SAMPLE_SIGN(batch[i]);
+		for (c = 0; c < layer1_size; c++){
+			u[c] = word_real[c + l1] - imag_part_sign * word_imag[c + l1];
+			v[c] = word_imag[c + l1] + imag_part_sign * word_real[c + l1];
+		}
+		for (j = 0; j < n; j++) {
+			PrefetchComplexPair(batch, i + j);
+			l2 = (long long)batch[i + j].target * layer1_size;
+			memcpy(tile_re + j * layer1_size, ctxt_real + l2, layer1_size * sizeof(real));
+			memcpy(tile_im + j * layer1_size, ctxt_imag + l2, layer1_size * sizeof(real));
+		}
+		TileScores(tile_re, n, u, g_tile, 0);
+		TileScores(tile_im, n, v, g_tile, 1);
+		for (j = 0; j < n; j++) g_tile[j] = SigmoidGrad(g_tile[j], batch[i + j].flags & SAMPLE_LABEL) * alpha;
+
+		//grad_re += sum_re + s * sum_im, grad_im += sum_im - s * sum_re
+		for (c = 0; c < layer1_size; c++) { sum_re[c] = 0; sum_im[c] = 0; }
+		TileWeightedSum(tile_re, n, g_tile, sum_re);
+		TileWeightedSum(tile_im, n, g_tile, sum_im);
+		for (c = 0; c < layer1_size; c++){
+			grad_word_real[c] += sum_re[c] + imag_part_sign * sum_im[c];
+			grad_word_imag[c] += sum_im[c] - imag_part_sign * sum_re[c];
+		}
+		for (j = 0; j < n; j++) {
+			l2 = (long long)batch[i + j].target * layer1_size;
+			for (c = 0; c < layer1_size; c++){
+				ctxt_real[c + l2] += g_tile[j] * u[c];
+				ctxt_imag[c + l2] += g_tile[j] * v[c];
+			}
+		}
+
+		if (batch[i + n - 1].flags & SAMPLE_FLUSH) {
+			for (c = 0; c < layer1_size; c++){
+				word_real[c + l1] += grad_word_real[c];
+				word_imag[c + l1] += grad_word_imag[c];
+				grad_word_real[c] = 0;
+				grad_word_imag[c] = 0;
+			}
+		}
+	}
+}
+
 void *TrainComplexModelThread(void *id) {
 	//Data processing variables
-	long long a, b, d, word, last_word, sentence_length = 0, sentence_position = 0;
-	long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
-	long long l1, l2, i, c, target, label, local_iter = iter, update_word_embs;
-	unsigned long long next_random = (long long)id;
-	clock_t now;
-	long long *batch = (long long *)calloc(sample_size * batch_size, sizeof(long long));
-	FILE *fi = fopen(train_file, "rb");
-	fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+	long long l1, l2, i, c, label, update_word_embs;
+	unsigned int last_word, target;
+	struct train_sample *batch = (struct train_sample *)calloc(batch_size, sizeof(struct train_sample));
+	struct batch_state st;
 	//Init variables for batch generation
-	next_random = next_random * (unsigned long long)25214903917 + 11;
-	b = next_random % window;
-	a = b;
-	d = 0;
-
+	InitBatchState(&st, id);
+
+	//Coalesced execution scratch
+	struct row_scratch word_scratch, ctxt_scratch;
+	real *g_batch = NULL;
+	if (exec_mode == 1) {
+		InitRowScratch(&word_scratch, 2 * layer1_size);
+		InitRowScratch(&ctxt_scratch, 2 * layer1_size);
+		g_batch = (real *)calloc(batch_size, sizeof(real));
+	}
 
 	//TOMOD: Model variables
 	real f, g, imag_part_sign, dot_real, dot_imag;
@@ -932,36 +2058,46 @@ void *TrainComplexModelThread(void *id) {
 	for (c = 0; c < layer1_size; c++) grad_word_imag[c] = 0;
 	//ENDMOD
 
-
+	//Gathered execution tile
+	real *tile = NULL, *g_tile = NULL;
+	if (exec_mode == 2) {
+		tile = AllocGatherTile(2 * layer1_size);
+		g_tile = (real *)calloc(negative + 1, sizeof(real));
+	}
 
 	while (1) {
 		//Create the next batch
-		BuildNextBatch(batch, &a, &b, &d, &word_count, &last_word_count, &word, &last_word, &sentence_length, &sentence_position, sen, &local_iter, &next_random, &now, fi, id);
+		BuildNextBatch(batch, &st);
 
-		if (local_iter == 0) break;
+		if (st.local_iter == 0) break;
+
+		if (exec_mode == 1) {
+			TrainComplexBatchCoalesced(batch, g_batch, &word_scratch, &ctxt_scratch);
+			continue;
+		}
+		if (exec_mode == 2) {
+			TrainComplexBatchGathered(batch, tile, g_tile, grad_word_real, grad_word_imag);
+			continue;
+		}
 
 /*
 		for (i = 0; i < batch_size; i++) {
-			last_word = batch[i*sample_size];
-			target = batch[i*sample_size + 1];
-			label = batch[i*sample_size + 2];
-			imag_part_sign = (real) batch[i*sample_size + 3];
-			update_word_embs = batch[i*sample_size + 4];
-			printf("%i\t%i\t%i\t%f\t%i\n",last_word,target,label,imag_part_sign,update_word_embs);
+			printf("%u\t%u\t%i\t%i\t%i\n",batch[i].word,batch[i].target,batch[i].flags & SAMPLE_LABEL,SAMPLE_SIGN(batch[i]),(batch[i].flags & SAMPLE_FLUSH) != 0);
 		}
 		exit(0);
 */
 
 		for (i = 0; i < batch_size; i++) {
+			PrefetchComplexPair(batch, i);
 			//train skip-gram
-			last_word = batch[i*sample_size];
-			target = batch[i*sample_size + 1];
-			label = batch[i*sample_size + 2];
-			imag_part_sign = batch[i*sample_size + 3];
-			update_word_embs = batch[i*sample_size + 4];
+			last_word = batch[i].word;
+			target = batch[i].target;
+			label = batch[i].flags & SAMPLE_LABEL;
+			imag_part_sign = SAMPLE_SIGN(batch[i]);
+			update_word_embs = (batch[i].flags & SAMPLE_FLUSH) != 0;
 
-			l1 = last_word * layer1_size;
-			l2 = target * layer1_size;
+			l1 = (long long)last_word * layer1_size;
+			l2 = (long long)target * layer1_size;
 
 			
 
@@ -1035,7 +2171,15 @@ void *TrainComplexModelThread(void *id) {
 			//ENDMOD
 		}
 	}
-	fclose(fi);
+	FreeBatchState(&st);
+	free(batch);
+	if (exec_mode == 1) {
+		FreeRowScratch(&word_scratch);
+		FreeRowScratch(&ctxt_scratch);
+		free(g_batch);
+	}
+	free(tile);
+	free(g_tile);
 	//TOMOD: Free local vectors
 	free(tmp_vect);
 	free(grad_word_real);
@@ -1045,6 +2189,125 @@ void *TrainComplexModelThread(void *id) {
 }
 
 
+//////////////////////////////////////////////////////////////////////////////////
+// MODEL OUTPUT: rows formatted in parallel, written in order
+//////////////////////////////////////////////////////////////////////////////////
+
+//Rows formatted by each thread per round
+#define SAVE_CHUNK 4096
+
+struct save_job {
+	long long first, last;
+	char *buf;
+	long long len, size;
+	real *row;
+};
+
+//Writes f followed by a space exactly as printf("%lf ") does. f * 1e6 needs at most 24 + 14 bits of mantissa,
+//so it is exact in a double, and rint rounds it to the nearest integer (ties to even) like printf does.
+static inline int FormatReal(char *out, real f) {
+	double y = (double)f * 1e6;
+	unsigned long long v, ip, frac;
+	char digits[24];
+	int n = 0, i = 0;
+	if (!(fabs(y) < 1e18)) return sprintf(out, "%lf ", f);
+	v = (unsigned long long)fabs(rint(y));
+	if (signbit(f)) out[n++] = '-';
+	ip = v / 1000000;
+	frac = v % 1000000;
+	do {
+		digits[i++] = '0' + ip % 10;
+		ip /= 10;
+	} while (ip > 0);
+	while (i > 0) out[n++] = digits[--i];
+	out[n++] = '.';
+	for (i = 5; i >= 0; i--) {
+		out[n + i] = '0' + frac % 10;
+		frac /= 10;
+	}
+	n += 6;
+	out[n++] = ' ';
+	return n;
+}
+
+//Formats the rows [first, last) of the output file into the job buffer
+void *FormatRows(void *arg) {
+	struct save_job *job = (struct save_job *)arg;
+	long long a, b, need, width = OutputWidth();
+	job->len = 0;
+	for (a = job->first; a < job->last; a++) {
+		//Room for the word, the separators and the longest "%lf " of a float
+		need = job->len + strlen(vocab[a].word) + 2 + width * (binary ? sizeof(real) : 48);
+		if (need > job->size) {
+			job->size = 2 * need;
+			job->buf = (char *)realloc(job->buf, job->size);
+			if (job->buf == NULL) {printf("Memory allocation failed\n"); exit(1);}
+		}
+		job->len += sprintf(job->buf + job->len, "%s ", vocab[a].word);
+		OutputRow(job->row, a);
+		if (binary) {
+			memcpy(job->buf + job->len, job->row, width * sizeof(real));
+			job->len += width * sizeof(real);
+		} else for (b = 0; b < width; b++) job->len += FormatReal(job->buf + job->len, job->row[b]);
+		job->buf[job->len++] = '\n';
+	}
+	pthread_exit(NULL);
+}
+
+//Saves the word vectors in the word2vec format
+void SaveWordVectors(FILE *fo) {
+	long long a, t, first, width = OutputWidth();
+	pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	struct save_job *jobs = (struct save_job *)calloc(num_threads, sizeof(struct save_job));
+	for (t = 0; t < num_threads; t++) jobs[t].row = (real *)malloc(width * sizeof(real));
+	fprintf(fo, "%lld %lld\n", vocab_size, width);
+	for (first = 0; first < vocab_size; first += num_threads * SAVE_CHUNK) {
+		for (t = 0; t < num_threads; t++) {
+			a = first + t * SAVE_CHUNK;
+			jobs[t].first = a < vocab_size ? a : vocab_size;
+			jobs[t].last = a + SAVE_CHUNK < vocab_size ? a + SAVE_CHUNK : vocab_size;
+			pthread_create(&pt[t], NULL, FormatRows, (void *)&jobs[t]);
+		}
+		for (t = 0; t < num_threads; t++) {
+			pthread_join(pt[t], NULL);
+			fwrite(jobs[t].buf, 1, jobs[t].len, fo);
+		}
+	}
+	for (t = 0; t < num_threads; t++) {
+		free(jobs[t].buf);
+		free(jobs[t].row);
+	}
+	free(jobs);
+	free(pt);
+}
+
+
+//Saves the word vectors in the native format of vecfile.h, which the query tools map without parsing
+void SaveNativeModel() {
+	long long a, width = OutputWidth();
+	int model = VEC_MODEL_REAL, layout = VEC_LAYOUT_PLAIN;
+	char **words = (char **)malloc(vocab_size * sizeof(char *));
+	real *row = (real *)malloc(width * sizeof(real));
+	struct vec_writer w;
+	if (StartsWith("complex", model_type)) {
+		model = VEC_MODEL_COMPLEX;
+		layout = VEC_LAYOUT_INTERLEAVED;
+	} else if (StartsWith("2real", model_type)) {
+		model = VEC_MODEL_2REAL;
+		layout = VEC_LAYOUT_INTERLEAVED;
+	}
+	for (a = 0; a < vocab_size; a++) words[a] = vocab[a].word;
+	if (VecWriterOpen(&w, native_file, vocab_size, width, model, layout, VEC_PRECISION_FLOAT32, words)) exit(1);
+	for (a = 0; a < vocab_size; a++) {
+		OutputRow(row, a);
+		VecWriterRow(&w, row);
+	}
+	if (VecWriterClose(&w)) exit(1);
+	free(words);
+	free(row);
+}
+
+
 
 void TrainModel() {
 	long a, b, c, d;
@@ -1057,25 +2320,34 @@ void TrainModel() {
 	if (output_file[0] == 0) return;
 	if (strlen(eval_file) > 0) BuildAnalogyEvaluation();
 	InitNet();
+	worker_words = train_words / num_workers;
+	//One partition per training thread
+	if (neg_partition) neg_partitions = num_threads;
+	if (neg_partitions > 0 && vocab_size - 1 < neg_partitions) {
+		printf("Fewer words than negative sampling partitions, partitioning disabled\n");
+		neg_partitions = 0;
+	}
 	if (negative > 0) InitUnigramTable();
 	start = clock();
 
 	//TOMOD: Starts threads on the corresponding model function
 	//If we're using unique embeddings for word/context, simply redirect the ctxt pointer:
 	if ( strcmp(model_type, "real_unique") == 0 ){
-		free(ctxt_emb);
+		FreeMatrix(ctxt_emb);
 		ctxt_emb = word_emb;
 	} else if ( strcmp(model_type, "complex_unique_asym") == 0 || strcmp(model_type, "complex_unique_alt") == 0 || strcmp(model_type, "complex_unique") == 0){
-		free(ctxt_real);
-		free(ctxt_imag);
+		FreeMatrix(ctxt_real);
+		FreeMatrix(ctxt_imag);
 		ctxt_real = word_real;
 		ctxt_imag = word_imag;
 	} else if ( strcmp(model_type, "2real_unique_asym") == 0 || strcmp(model_type, "2real_unique_alt") == 0 ){
-		free(ctxt_right);
-		free(ctxt_left);
+		FreeMatrix(ctxt_right);
+		FreeMatrix(ctxt_left);
 		ctxt_right = word_right;
 		ctxt_left = word_left;
 	}	
+	if (num_workers > 1) InitSync();
+	if (worker_id == 0 && strlen(eval_file) > 0) pthread_create(&eval_thread, NULL, EvalThread, NULL);
 
 	if ( StartsWith("complex", model_type)){
 		for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainComplexModelThread, (void *)a);
@@ -1088,64 +2360,25 @@ void TrainModel() {
 		for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
 	}
 	//ENMOD
+	if (worker_id == 0 && strlen(eval_file) > 0) StopEvaluation();
+
+	if (num_workers > 1) {
+		//Same number of rounds for every worker (a safety net, thread 0 already runs all the rounds of each epoch),
+		//then a last one once all the local threads are done, so that all workers end with the same model
+		while (sync_rounds < iter * syncs_per_epoch) SyncParameters();
+		SyncParameters();
+		CloseSync();
+	}
+	//The memory-mapped matrices are flushed once they hold the averaged model
+	SyncMatrices();
+	if (worker_id != 0) return;
 
 	fo = fopen(output_file, "wb");
 	if (classes == 0) {
 		// Save the word vectors
-		//TOMOD: Chose how to save the embeddings
-		if ( StartsWith("complex", model_type)){
-			fprintf(fo, "%lld %lld\n", vocab_size, 2*layer1_size); //2 times to concatenate real and imaginary parts
-			for (a = 0; a < vocab_size; a++) {
-				fprintf(fo, "%s ", vocab[a].word);
-				if (binary){
-					for (b = 0; b < layer1_size; b++){
-						fwrite(&word_real[a * layer1_size + b], sizeof(real), 1, fo);
-						fwrite(&word_imag[a * layer1_size + b], sizeof(real), 1, fo);
-					}
-				}
-				else {
-					for (b = 0; b < layer1_size; b++) {
-						fprintf(fo, "%lf ", word_real[a * layer1_size + b]);
-						fprintf(fo, "%lf ", word_imag[a * layer1_size + b]);
-					}
-				}
-				fprintf(fo, "\n");
-			}
-		} else if ( StartsWith("2real", model_type)){
-			fprintf(fo, "%lld %lld\n", vocab_size, 2*layer1_size); //2 times to concatenate real and imaginary parts
-			for (a = 0; a < vocab_size; a++) {
-				fprintf(fo, "%s ", vocab[a].word);
-				if (binary){
-					for (b = 0; b < layer1_size; b++){
-						fwrite(&word_right[a * layer1_size + b], sizeof(real), 1, fo);
-						fwrite(&word_left[a * layer1_size + b], sizeof(real), 1, fo);
-					}
-				}
-				else {
-					for (b = 0; b < layer1_size; b++) {
-						fprintf(fo, "%lf ", word_right[a * layer1_size + b]);
-						fprintf(fo, "%lf ", word_left[a * layer1_size + b]);
-					}
-				}
-				fprintf(fo, "\n");
-			}
-		} else if (StartsWith("real",model_type)) {
-			fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
-			for (a = 0; a < vocab_size; a++) {
-				fprintf(fo, "%s ", vocab[a].word);
-				if (binary){
-					for (b = 0; b < layer1_size; b++){
-						fwrite(&word_emb[a * layer1_size + b], sizeof(real), 1, fo);
-					}
-				}
-				else {
-					for (b = 0; b < layer1_size; b++) {
-						fprintf(fo, "%lf ", word_emb[a * layer1_size + b]);
-					}
-				}
-				fprintf(fo, "\n");
-			}
-		}
+		//TOMOD: Chose how to save the embeddings in OutputRow
+		SaveWordVectors(fo);
+		if (native_file[0] != 0) SaveNativeModel();
 		//ENMOD
 	} else {
 		// Run K-means on the word vectors
@@ -1216,8 +2449,12 @@ int main(int argc, char **argv) {
 		printf("\t\tUse text data from <file> to train the model\n");
 		printf("\t-output <file>\n");
 		printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
+		printf("\t-save-native <file>\n");
+		printf("\t\tAlso save the word vectors to <file> in the native format, mapped in memory by the query tools\n");
 		printf("\t-eval <file>\n");
-		printf("\t\tUse the analogy questions from <file> to produce evaluation every epoch\n");
+		printf("\t\tUse the analogy questions from <file> to produce evaluation every epoch, in a background thread\n");
+		printf("\t-eval-top <int>\n");
+		printf("\t\tRestrict the evaluation to the <int> most frequent words, as compute-accuracy; default is 0 (all)\n");
 		printf("\t-size <int>\n");
 		printf("\t\tSet size of word vectors; default is 100\n");
 		printf("\t-window <int>\n");
@@ -1247,6 +2484,43 @@ int main(int argc, char **argv) {
 		printf("\t\tThe model to use, possible value are 'complex', 'complex_asym', 'complex_alt', 'complex_unique_asym', 'complex_unique_alt', 'real_original', 'real_unique', '2real_asym', '2real_alt', '2real_unique_asym', '2real_unique_alt'\n");
 		printf("\t-adagrad <int>\n");
 		printf("\t\tActivates adagrad learning step if non-zero. Only for the 'real_original' model for the moment.\n");
+		printf("\t-exec <int>\n");
+		printf("\t\tKernel execution mode: 0 = sequential Hogwild updates (default), 1 = coalesced batch updates, the gradients\n");
+		printf("\t\tof a batch are summed per unique row and each row is written once, 2 = gathered word groups, the positive\n");
+		printf("\t\tand negative context rows of a word are scored at once as a small matrix-vector product\n");
+		printf("\t-reorder <int>\n");
+		printf("\t\tReorder each batch for row locality: 0 = generation order (default), 1 = word groups sorted by sign\n");
+		printf("\t\tstream and word, 2 = pairs sorted by sign stream and target row (requires -exec 1)\n");
+		printf("\t-prefetch <int>\n");
+		printf("\t\tPrefetch the rows of the pair <int> positions ahead in the batch; default is 0 (off), typical values 4 - 16\n");
+		printf("\t-neg-buffer <int>\n");
+		printf("\t\tDraw the negatives of each thread in bulk, <int> at a time, from a counter-based generator; default is 0\n");
+		printf("\t\t(off, one serial random step per negative), typical value 4096\n");
+		printf("\t-neg-partition <int>\n");
+		printf("\t\tIf non-zero, split the vocabulary in one partition per thread, all with the same frequency profile, and draw\n");
+		printf("\t\tthe negatives of each thread from its partition to reduce the context rows written by several threads;\n");
+		printf("\t\tdefault is 0 (off)\n");
+		printf("\t-neg-global <float>\n");
+		printf("\t\tFraction of the negatives still drawn from the whole vocabulary with -neg-partition; default is 0.2\n");
+		printf("\t-mmap-dir <dir>\n");
+		printf("\t\tKeep the model matrices in memory-mapped files <dir>/<matrix>.mat (raw floats, rows in the order of\n");
+		printf("\t\t<dir>/vocab.txt) instead of RAM, to train vocabularies larger than memory; with -workers, each worker\n");
+		printf("\t\thas its own files <dir>/<matrix>.w<id>.mat and worker 0 writes <dir>/vocab.txt\n");
+		printf("\t-mlock-words <int>\n");
+		printf("\t\tWith -mmap-dir, lock the rows of the <int> most frequent words in RAM; default is 0\n");
+		printf("\t-workers <int>\n");
+		printf("\t\tNumber of worker processes training together, each one on its shard of the corpus; default is 1\n");
+		printf("\t-worker-id <int>\n");
+		printf("\t\tId of this worker, from 0 to workers - 1; worker 0 writes the output\n");
+		printf("\t-sync <int>\n");
+		printf("\t\tNumber of parameter averaging rounds between the workers per epoch; default is 1\n");
+		printf("\t-sync-shm <name>\n");
+		printf("\t\tAverage the parameters through the POSIX shared memory segment <name> (workers on one host)\n");
+		printf("\t-sync-run <int>\n");
+		printf("\t\tNon-zero id of the run, the same for all its workers and new for each run (e.g. the start time), required\n");
+		printf("\t\twith -sync-shm so that the workers do not join a segment left by an earlier run\n");
+		printf("\t-sync-tcp <host:port>\n");
+		printf("\t\tAverage the parameters through TCP, worker 0 listening on <port> and the others connecting to <host>\n");
 		printf("\t-read-vocab <file>\n");
 		printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
 		printf("\nExamples:\n");
@@ -1259,12 +2533,14 @@ int main(int argc, char **argv) {
 	if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
 	if ((i = ArgPos((char *)"-eval", argc, argv)) > 0) strcpy(eval_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-eval-top", argc, argv)) > 0) eval_top_words = atoll(argv[i + 1]);
 	if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
 	if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
 	if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
 	if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-save-native", argc, argv)) > 0) strcpy(native_file, argv[i + 1]);
 	if ((i = ArgPos((char *)"-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
 	if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
@@ -1274,6 +2550,20 @@ int main(int argc, char **argv) {
 	if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *)"-model", argc, argv)) > 0) strcpy(model_type, argv[i + 1]);
 	if ((i = ArgPos((char *)"-adagrad", argc, argv)) > 0) adagrad = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-exec", argc, argv)) > 0) exec_mode = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-reorder", argc, argv)) > 0) reorder = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-prefetch", argc, argv)) > 0) prefetch_distance = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-neg-buffer", argc, argv)) > 0) neg_buffer_size = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-mmap-dir", argc, argv)) > 0) strcpy(mmap_dir, argv[i + 1]);
+	if ((i = ArgPos((char *)"-mlock-words", argc, argv)) > 0) mlock_words = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *)"-workers", argc, argv)) > 0) num_workers = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-worker-id", argc, argv)) > 0) worker_id = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-sync", argc, argv)) > 0) syncs_per_epoch = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-sync-shm", argc, argv)) > 0) strcpy(sync_shm, argv[i + 1]);
+	if ((i = ArgPos((char *)"-sync-tcp", argc, argv)) > 0) strcpy(sync_tcp, argv[i + 1]);
+	if ((i = ArgPos((char *)"-sync-run", argc, argv)) > 0) sync_run = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *)"-neg-partition", argc, argv)) > 0) neg_partition = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-neg-global", argc, argv)) > 0) neg_global = atof(argv[i + 1]);
 
 	//TOMOD; Add model string id
 	if (! (strcmp(model_type, "complex_alt") == 0 || strcmp(model_type, "complex_asym") == 0
@@ -1288,6 +2578,32 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	if (exec_mode < 0 || exec_mode > 2) {
+		printf("Execution mode %d unknown, choices are: 0 (sequential), 1 (coalesced), 2 (gathered)\n", exec_mode);
+		exit(1);
+	}
+	if (prefetch_distance < 0) {
+		printf("Prefetch distance %d is negative, it must be 0 (off) or a number of pairs ahead\n", prefetch_distance);
+		exit(1);
+	}
+	if (num_workers < 1 || worker_id < 0 || worker_id >= num_workers || syncs_per_epoch < 1) {
+		printf("Invalid worker configuration: -workers %d -worker-id %d -sync %d\n", num_workers, worker_id, syncs_per_epoch);
+		exit(1);
+	}
+	if (sync_shm[0] != 0 && num_workers > 1 && sync_run == 0) {
+		printf("-sync-shm requires a non-zero -sync-run id, new for each run\n");
+		exit(1);
+	}
+	if (sync_shm[0] != 0 && sync_shm[0] != '/') {
+		//POSIX shared memory names start with a slash
+		memmove(sync_shm + 1, sync_shm, strlen(sync_shm) + 1);
+		sync_shm[0] = '/';
+	}
+	if (reorder == 2 && exec_mode != 1) {
+		printf("Reordering mode 2 splits the pairs of a word, it requires the coalesced execution (-exec 1)\n");
+		exit(1);
+	}
+
 	vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
 	vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
 	expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
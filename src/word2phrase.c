@@ -19,22 +19,77 @@
 #include <pthread.h>
 
 #define MAX_STRING 60
-
-const int vocab_hash_size = 500000000; // Maximum 500M entries in the vocabulary
+#define SHARDS 64                      // Bigram tables, merged in parallel
+#define READ_SIZE (1 << 20)
+#define MAX_ORDER 8                    // Longest phrases of -max-order
+#define SKETCH_DEPTH 4                 // Rows of the bigram sketch of -sketch
+#define SKETCH_BUFFER 4096             // Bigrams of a table of a thread added to the sketch at once
+#define REWRITE_SIZE (16 << 20)        // Bytes of the train file rewritten by a thread at once
+#define TRAIN_STRING 100               // MAX_STRING of the training tools, which read the output
 
 typedef float real;                    // Precision of float numbers
 
+// Words of a table: counts, and strings kept one after another in text
 struct vocab_word {
-  long long cn;
-  char *word;
+  long long cn, pos;
+  unsigned long long hash;
+  int len;
+};
+
+// Words by string, open addressing in slots (a power of 2)
+struct word_table {
+  struct vocab_word *words;
+  long long size, max_size, *slots, nb_slots;
+  char *text;
+  long long text_size, max_text_size;
+};
+
+// Bigram counts keyed by the two word indices packed into 64 bits, open addressing (a power of 2 slots)
+struct pair_table {
+  unsigned long long *keys;
+  long long *cn, size, nb_slots;
+};
+
+// N-gram counts of one order n: an n-gram is keyed by the index of its first n - 1 words in the table of order
+// n - 1 (the word index for n = 2) and the index of its last word, packed into 64 bits. Indices follow insertion
+struct gram_table {
+  unsigned long long *keys;
+  long long *cn, size, max_size, *slots, nb_slots;
+};
+
+// Text written by a thread
+struct out_buf {
+  char *data;
+  long long size, max_size;
+};
+
+// Counting job of a thread: the bytes [start, end) of the train file, cut after a newline
+struct chunk {
+  long long start, end, first, last, train_words, *map, *gram_map[MAX_ORDER + 1];
+  struct word_table vocab;
+  struct pair_table pairs[SHARDS];
+  struct gram_table grams[MAX_ORDER + 1];
+};
+
+// Rewriting job of a thread: the bytes [start, end) of the train file, cut after a newline, their output and its
+// words for -save-vocab
+struct rewrite {
+  long long start, end, li, pa, pb, words;
+  int first, dependent;
+  struct out_buf out;
+  struct word_table vocab;
 };
 
-char train_file[MAX_STRING], output_file[MAX_STRING];
-struct vocab_word *vocab;
-int debug_mode = 2, min_count = 5, *vocab_hash, min_reduce = 1;
-long long vocab_max_size = 10000, vocab_size = 0;
-long long train_words = 0;
-real threshold = 100;
+char train_file[MAX_STRING], output_file[MAX_STRING], save_vocab_file[MAX_STRING];
+struct word_table vocab, odd, out_vocab;
+struct pair_table bigrams[SHARDS];
+struct gram_table grams[MAX_ORDER + 1];
+struct chunk *chunks;
+int debug_mode = 2, min_count = 5, num_threads = 12, max_order = 0;
+long long train_words = 0, word_count_actual = 0, sketch_mb = 0, sketch_width;
+unsigned int *sketch = NULL;
+pthread_mutex_t sketch_lock[SHARDS];
+real threshold = 100, thresholds[MAX_ORDER + 1];
 
 unsigned long long next_random = 1;
 
@@ -61,191 +116,899 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
+// Buffered reading of the bytes of a chunk
+struct reader {
+  FILE *fin;
+  char *buf;
+  long long pos, len, left;           // position in buf, bytes in buf, bytes of the chunk after them
+};
+
+static inline int NextByte(struct reader *r) {
+  if (r->pos == r->len) {
+    if (r->left == 0) return -1;
+    r->len = fread(r->buf, 1, r->left < READ_SIZE ? r->left : READ_SIZE, r->fin);
+    if (r->len <= 0) return -1;
+    r->left -= r->len;
+    r->pos = 0;
+  }
+  return (unsigned char)r->buf[r->pos++];
+}
+
+// ReadWord on a chunk, returns -1 at its end. As ReadWord followed by the feof test, a word ended by the end of the
+// file rather than by a boundary is dropped; chunks other than the last end with a newline
+int ReadChunkWord(char *word, struct reader *r) {
+  int a = 0, ch;
+  while ((ch = NextByte(r)) >= 0) {
+    if (ch == 13) continue;
+    if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
+      if (a > 0) {
+        if (ch == '\n') r->pos--;
+        word[a] = 0;
+        return 0;
+      }
+      if (ch == '\n') {
+        strcpy(word, (char *)"</s>");
+        return 0;
+      } else continue;
+    }
+    word[a] = ch;
+    a++;
+    if (a >= MAX_STRING - 1) a--;   // Truncate too long words
+  }
+  return -1;
+}
+
+static inline unsigned long long Mix(unsigned long long h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
 // Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 1;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % vocab_hash_size;
-  return hash;
+unsigned long long GetWordHash(const char *word) {
+  unsigned long long hash = 1;
+  for (; *word; word++) hash = hash * 257 + *word;
+  return Mix(hash);
 }
 
-// Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
-  while (1) {
-    if (vocab_hash[hash] == -1) return -1;
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-    hash = (hash + 1) % vocab_hash_size;
+// Bigram table of a pair of words, from their hashes so that it is the same for the words of every table
+static inline int PairShard(unsigned long long a, unsigned long long b) {
+  return Mix(a * 31 + b) % SHARDS;
+}
+
+static void InitWords(struct word_table *t) {
+  t->size = 0;
+  t->max_size = 1024;
+  t->words = (struct vocab_word *)malloc(t->max_size * sizeof(struct vocab_word));
+  t->nb_slots = 2048;
+  t->slots = (long long *)malloc(t->nb_slots * sizeof(long long));
+  memset(t->slots, -1, t->nb_slots * sizeof(long long));
+  t->text_size = 0;
+  t->max_text_size = 16384;
+  t->text = (char *)malloc(t->max_text_size);
+}
+
+static void FreeWords(struct word_table *t) {
+  free(t->words);
+  free(t->slots);
+  free(t->text);
+}
+
+static inline const char *Word(const struct word_table *t, long long i) {
+  return t->text + t->words[i].pos;
+}
+
+// Returns position of a word in a table; if the word is not found, returns -1
+long long SearchWord(const struct word_table *t, const char *word, unsigned long long hash) {
+  long long s = hash & (t->nb_slots - 1);
+  while (t->slots[s] != -1) {
+    if (t->words[t->slots[s]].hash == hash && !strcmp(word, Word(t, t->slots[s]))) return t->slots[s];
+    s = (s + 1) & (t->nb_slots - 1);
   }
   return -1;
 }
 
-// Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin) {
+// Returns position of a word in a table, adding it with a count of 0 if needed
+long long AddWord(struct word_table *t, const char *word, unsigned long long hash) {
+  long long i = SearchWord(t, word, hash), s, len;
+  if (i != -1) return i;
+  len = strlen(word);
+  if (t->text_size + len + 1 > t->max_text_size) {
+    t->max_text_size = 2 * (t->text_size + len + 1);
+    t->text = (char *)realloc(t->text, t->max_text_size);
+  }
+  if (t->size == t->max_size) {
+    t->max_size *= 2;
+    t->words = (struct vocab_word *)realloc(t->words, t->max_size * sizeof(struct vocab_word));
+  }
+  //Tables stay at most half full
+  if (2 * (t->size + 1) > t->nb_slots) {
+    t->nb_slots *= 2;
+    t->slots = (long long *)realloc(t->slots, t->nb_slots * sizeof(long long));
+    memset(t->slots, -1, t->nb_slots * sizeof(long long));
+    for (i = 0; i < t->size; i++) {
+      s = t->words[i].hash & (t->nb_slots - 1);
+      while (t->slots[s] != -1) s = (s + 1) & (t->nb_slots - 1);
+      t->slots[s] = i;
+    }
+  }
+  i = t->size++;
+  memcpy(t->text + t->text_size, word, len + 1);
+  t->words[i].pos = t->text_size;
+  t->words[i].cn = 0;
+  t->words[i].hash = hash;
+  t->words[i].len = len;
+  t->text_size += len + 1;
+  s = hash & (t->nb_slots - 1);
+  while (t->slots[s] != -1) s = (s + 1) & (t->nb_slots - 1);
+  t->slots[s] = i;
+  return i;
+}
+
+static inline unsigned long long PairKey(long long a, long long b) {
+  return (unsigned long long)a << 32 | b;
+}
+
+static void InitPairs(struct pair_table *t) {
+  t->size = 0;
+  t->nb_slots = 1024;
+  t->keys = (unsigned long long *)malloc(t->nb_slots * sizeof(unsigned long long));
+  t->cn = (long long *)malloc(t->nb_slots * sizeof(long long));
+  memset(t->keys, -1, t->nb_slots * sizeof(unsigned long long));
+}
+
+static void FreePairs(struct pair_table *t) {
+  free(t->keys);
+  free(t->cn);
+  t->keys = NULL;
+  t->cn = NULL;
+}
+
+// Count of a bigram, 0 if it was not seen
+long long SearchPair(const struct pair_table *t, unsigned long long key) {
+  long long s = Mix(key) & (t->nb_slots - 1);
+  while (t->keys[s] != ~0ULL) {
+    if (t->keys[s] == key) return t->cn[s];
+    s = (s + 1) & (t->nb_slots - 1);
+  }
+  return 0;
+}
+
+void AddPair(struct pair_table *t, unsigned long long key, long long cn) {
+  long long s, i, old_slots = t->nb_slots;
+  unsigned long long *old_keys;
+  long long *old_cn;
+  if (2 * (t->size + 1) > t->nb_slots) {
+    old_keys = t->keys;
+    old_cn = t->cn;
+    t->nb_slots *= 2;
+    t->keys = (unsigned long long *)malloc(t->nb_slots * sizeof(unsigned long long));
+    t->cn = (long long *)malloc(t->nb_slots * sizeof(long long));
+    memset(t->keys, -1, t->nb_slots * sizeof(unsigned long long));
+    for (i = 0; i < old_slots; i++) if (old_keys[i] != ~0ULL) {
+      s = Mix(old_keys[i]) & (t->nb_slots - 1);
+      while (t->keys[s] != ~0ULL) s = (s + 1) & (t->nb_slots - 1);
+      t->keys[s] = old_keys[i];
+      t->cn[s] = old_cn[i];
+    }
+    free(old_keys);
+    free(old_cn);
+  }
+  s = Mix(key) & (t->nb_slots - 1);
+  while (t->keys[s] != ~0ULL) {
+    if (t->keys[s] == key) {
+      t->cn[s] += cn;
+      return;
+    }
+    s = (s + 1) & (t->nb_slots - 1);
+  }
+  t->keys[s] = key;
+  t->cn[s] = cn;
+  t->size++;
+}
+
+static void InitGrams(struct gram_table *t) {
+  t->size = 0;
+  t->max_size = 1024;
+  t->keys = (unsigned long long *)malloc(t->max_size * sizeof(unsigned long long));
+  t->cn = (long long *)malloc(t->max_size * sizeof(long long));
+  t->nb_slots = 2048;
+  t->slots = (long long *)malloc(t->nb_slots * sizeof(long long));
+  memset(t->slots, -1, t->nb_slots * sizeof(long long));
+}
+
+static void FreeGrams(struct gram_table *t) {
+  free(t->keys);
+  free(t->cn);
+  free(t->slots);
+}
+
+// Returns the index of an n-gram; if it was not seen, returns -1
+long long SearchGram(const struct gram_table *t, unsigned long long key) {
+  long long s = Mix(key) & (t->nb_slots - 1);
+  while (t->slots[s] != -1) {
+    if (t->keys[t->slots[s]] == key) return t->slots[s];
+    s = (s + 1) & (t->nb_slots - 1);
+  }
+  return -1;
+}
+
+// Returns the index of an n-gram, adding it with a count of 0 if needed
+long long AddGram(struct gram_table *t, unsigned long long key) {
+  long long i = SearchGram(t, key), s;
+  if (i != -1) return i;
+  if (t->size == t->max_size) {
+    t->max_size *= 2;
+    t->keys = (unsigned long long *)realloc(t->keys, t->max_size * sizeof(unsigned long long));
+    t->cn = (long long *)realloc(t->cn, t->max_size * sizeof(long long));
+  }
+  if (2 * (t->size + 1) > t->nb_slots) {
+    t->nb_slots *= 2;
+    t->slots = (long long *)realloc(t->slots, t->nb_slots * sizeof(long long));
+    memset(t->slots, -1, t->nb_slots * sizeof(long long));
+    for (i = 0; i < t->size; i++) {
+      s = Mix(t->keys[i]) & (t->nb_slots - 1);
+      while (t->slots[s] != -1) s = (s + 1) & (t->nb_slots - 1);
+      t->slots[s] = i;
+    }
+  }
+  i = t->size++;
+  t->keys[i] = key;
+  t->cn[i] = 0;
+  s = Mix(key) & (t->nb_slots - 1);
+  while (t->slots[s] != -1) s = (s + 1) & (t->nb_slots - 1);
+  t->slots[s] = i;
+  return i;
+}
+
+static void OpenChunk(struct reader *r, long long start, long long end) {
+  r->fin = fopen(train_file, "rb");
+  r->buf = (char *)malloc(READ_SIZE);
+  r->pos = r->len = 0;
+  r->left = end - start;
+  fseeko(r->fin, start, SEEK_SET);
+}
+
+static void CloseChunk(struct reader *r) {
+  fclose(r->fin);
+  free(r->buf);
+}
+
+static void Put(struct out_buf *o, const char *s, long long len) {
+  if (o->size + len > o->max_size) {
+    o->max_size = 2 * (o->size + len);
+    o->data = (char *)realloc(o->data, o->max_size);
+  }
+  memcpy(o->data + o->size, s, len);
+  o->size += len;
+}
+
+// Writes a word after a space, or after '_' when it is joined to the word before it
+static void PutWord(struct out_buf *o, char sep, const char *word) {
+  Put(o, &sep, 1);
+  Put(o, word, strlen(word));
+}
+
+// Counts a word of a chunk, with the indices of its own table
+static long long CountWord(struct chunk *c, const char *word, long long *last_count) {
+  long long i;
+  c->train_words++;
+  if ((debug_mode > 1) && (c->train_words - *last_count > 100000)) {
+    word_count_actual += c->train_words - *last_count;
+    *last_count = c->train_words;
+    printf("Words processed: %lldK%c", word_count_actual / 1000, 13);
+    fflush(stdout);
+  }
+  i = AddWord(&c->vocab, word, GetWordHash(word));
+  c->vocab.words[i].cn++;
+  return i;
+}
+
+// Count-min sketch of the bigrams (-sketch): SKETCH_DEPTH rows of sketch_width counters, a bigram adds to one
+// counter of each row and its count is the smallest of them. With conservative update, only the counters below the
+// new count are raised, to it. Counts are never underestimated and, for N bigrams in the train file, exceed the true
+// count by at most e * N / sketch_width with probability 1 - exp(-SKETCH_DEPTH) (e = 2.718...). The score of a pair
+// of words with counts pa and pb is then at most e * N * train_words / (sketch_width * pa * pb) too high, a bound
+// that conservative update is usually far below. The row counters of a bigram all lie in the part of their row of
+// its table, so that threads add to the sketch under one lock per table.
+static inline unsigned long long SketchKey(unsigned long long a, unsigned long long b) {
+  unsigned long long key = Mix(a * 31 + b);
+  return key == ~0ULL ? 0 : key;
+}
+
+static inline void SketchCells(unsigned long long key, long long *cell) {
+  long long part = sketch_width / SHARDS, j;
+  unsigned long long h = Mix(key ^ 0x9e3779b97f4a7c15ULL) | 1;
+  for (j = 0; j < SKETCH_DEPTH; j++) cell[j] = j * sketch_width + key % SHARDS * part + (key / SHARDS + j * h) % part;
+}
+
+static void SketchAdd(unsigned long long key, long long cn) {
+  long long cell[SKETCH_DEPTH], j, m;
+  SketchCells(key, cell);
+  m = sketch[cell[0]];
+  for (j = 1; j < SKETCH_DEPTH; j++) if (sketch[cell[j]] < m) m = sketch[cell[j]];
+  m += cn;
+  if (m > 0xffffffffLL) m = 0xffffffffLL;
+  for (j = 0; j < SKETCH_DEPTH; j++) if (sketch[cell[j]] < m) sketch[cell[j]] = m;
+}
+
+long long SketchSearch(unsigned long long key) {
+  long long cell[SKETCH_DEPTH], j, m;
+  SketchCells(key, cell);
+  m = sketch[cell[0]];
+  for (j = 1; j < SKETCH_DEPTH; j++) if (sketch[cell[j]] < m) m = sketch[cell[j]];
+  return m;
+}
+
+// Adds the bigrams of a table of a thread to the sketch and empties it
+static void FlushSketch(struct pair_table *p, int s) {
+  long long i;
+  pthread_mutex_lock(&sketch_lock[s]);
+  for (i = 0; i < p->nb_slots; i++) if (p->keys[i] != ~0ULL) SketchAdd(p->keys[i], p->cn[i]);
+  pthread_mutex_unlock(&sketch_lock[s]);
+  memset(p->keys, -1, p->nb_slots * sizeof(unsigned long long));
+  p->size = 0;
+}
+
+// Counts the words and the bigrams of a chunk; with a sketch, the tables of the thread only gather the bigrams
+// before they are added to it, keyed by the hashes of their words
+void *CountThread(void *id) {
+  struct chunk *c = &chunks[(long long)id];
+  struct reader r;
   char word[MAX_STRING];
-  ReadWord(word, fin);
-  if (feof(fin)) return -1;
-  return SearchVocab(word);
+  long long i, last = -1, last_count = 0;
+  unsigned long long key;
+  int s;
+  OpenChunk(&r, c->start, c->end);
+  while (ReadChunkWord(word, &r) == 0) {
+    if (!strcmp(word, "</s>")) continue;
+    i = CountWord(c, word, &last_count);
+    //Bigrams run across sentences; the first one of the chunk is counted when merging
+    if (last == -1) c->first = i;
+    else if (sketch != NULL) {
+      key = SketchKey(c->vocab.words[last].hash, c->vocab.words[i].hash);
+      s = key % SHARDS;
+      AddPair(&c->pairs[s], key, 1);
+      if (c->pairs[s].size >= SKETCH_BUFFER) FlushSketch(&c->pairs[s], s);
+    } else AddPair(&c->pairs[PairShard(c->vocab.words[last].hash, c->vocab.words[i].hash)], PairKey(last, i), 1);
+    last = i;
+  }
+  c->last = last;
+  if (sketch != NULL) for (s = 0; s < SHARDS; s++) {
+    FlushSketch(&c->pairs[s], s);
+    FreePairs(&c->pairs[s]);
+  }
+  CloseChunk(&r);
+  pthread_exit(NULL);
 }
 
-// Adds a word to the vocabulary
-int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1;
-  if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
-  vocab[vocab_size].cn = 0;
-  vocab_size++;
-  // Reallocate memory if needed
-  if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 10000;
-    vocab=(struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+// Counts the words and the n-grams of orders 2 to max_order of a chunk, within sentences
+void *CountGramsThread(void *id) {
+  struct chunk *c = &chunks[(long long)id];
+  struct reader r;
+  char word[MAX_STRING];
+  long long n, prev[MAX_ORDER + 1], cur[MAX_ORDER + 1], last_count = 0;
+  OpenChunk(&r, c->start, c->end);
+  for (n = 1; n <= max_order; n++) prev[n] = -1;
+  while (ReadChunkWord(word, &r) == 0) {
+    if (!strcmp(word, "</s>")) {
+      for (n = 1; n <= max_order; n++) prev[n] = -1;
+      continue;
+    }
+    cur[1] = CountWord(c, word, &last_count);
+    //The n-gram ending here extends the (n - 1)-gram ending at the previous word
+    for (n = 2; n <= max_order; n++) {
+      if (prev[n - 1] == -1) cur[n] = -1;
+      else {
+        cur[n] = AddGram(&c->grams[n], PairKey(prev[n - 1], cur[1]));
+        c->grams[n].cn[cur[n]]++;
+      }
+    }
+    memcpy(prev, cur, sizeof(prev));
   }
-  hash = GetWordHash(word);
-  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-  vocab_hash[hash]=vocab_size - 1;
-  return vocab_size - 1;
+  CloseChunk(&r);
+  pthread_exit(NULL);
 }
 
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+// Bigram string of the original tool, both words joined by '_' and cut at MAX_STRING - 1 chars
+static void BigramString(char *bigram_word, const char *a, const char *b) {
+  sprintf(bigram_word, "%s_%s", a, b);
+  bigram_word[MAX_STRING - 1] = 0;
 }
 
-// Sorts the vocabulary by frequency using word counts
-void SortVocab() {
-  int a;
-  unsigned int hash;
-  // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
-    // Words occuring less than min_count times will be discarded from the vocab
-    if (vocab[a].cn < min_count) {
-      vocab_size--;
-      free(vocab[vocab_size].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash = GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
+// Merges the bigrams of one table of all the chunks into the global table, with the global word indices
+void *MergeThread(void *id) {
+  long long t, s, i, *map;
+  struct pair_table *p;
+  for (s = (long long)id; s < SHARDS; s += num_threads) {
+    InitPairs(&bigrams[s]);
+    for (t = 0; t < num_threads; t++) {
+      p = &chunks[t].pairs[s];
+      map = chunks[t].map;
+      for (i = 0; i < p->nb_slots; i++) if (p->keys[i] != ~0ULL) {
+        AddPair(&bigrams[s], PairKey(map[p->keys[i] >> 32], map[p->keys[i] & 0xffffffff]), p->cn[i]);
+      }
+      FreePairs(p);
     }
   }
-  vocab = (struct vocab_word *)realloc(vocab, vocab_size * sizeof(struct vocab_word));
+  pthread_exit(NULL);
 }
 
-// Reduces the vocabulary by removing infrequent tokens
-void ReduceVocab() {
-  int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-    vocab[b].cn = vocab[a].cn;
-    vocab[b].word = vocab[a].word;
-    b++;
-  } else free(vocab[a].word);
-  vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  for (a = 0; a < vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(vocab[a].word);
-    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    vocab_hash[hash] = a;
+// Count of a string in the single table of the original tool, where a bigram was its two words joined by '_' (cut
+// at MAX_STRING - 1 chars) and shared the count of an equal string: the string as a word, plus every split of it at
+// a '_' into two words, plus the odd strings. Returns -1 below min_count, as the strings discarded by SortVocab
+long long StringCount(const char *s) {
+  char w[MAX_STRING];
+  long long cn = 0, i, a, b, p;
+  i = SearchWord(&vocab, s, GetWordHash(s));
+  if (i != -1) cn += vocab.words[i].cn;
+  for (p = 0; s[p]; p++) if (s[p] == '_') {
+    memcpy(w, s, p);
+    w[p] = 0;
+    a = SearchWord(&vocab, w, GetWordHash(w));
+    if (a == -1) continue;
+    b = SearchWord(&vocab, s + p + 1, GetWordHash(s + p + 1));
+    if (b == -1) continue;
+    cn += SearchPair(&bigrams[PairShard(vocab.words[a].hash, vocab.words[b].hash)], PairKey(a, b));
   }
-  fflush(stdout);
-  min_reduce++;
+  i = SearchWord(&odd, s, GetWordHash(s));
+  if (i != -1) cn += odd.words[i].cn;
+  return cn < min_count ? -1 : cn;
 }
 
-void LearnVocabFromTrainFile() {
-  char word[MAX_STRING], last_word[MAX_STRING], bigram_word[MAX_STRING * 2];
+// Position of the first line of the train file that starts at or after a; chunks start there, where ReadWord
+// starts afresh
+static long long NextLineStart(FILE *fin, long long a) {
+  int ch;
+  if (a == 0) return 0;
+  fseeko(fin, a - 1, SEEK_SET);
+  while ((ch = fgetc(fin)) != EOF && ch != '\n');
+  return ftello(fin);
+}
+
+// Cuts the train file into one chunk per thread
+void SplitTrainFile() {
   FILE *fin;
-  long long a, i, start = 1;
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  long long a, t, file_size;
   fin = fopen(train_file, "rb");
   if (fin == NULL) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  vocab_size = 0;
-  AddWordToVocab((char *)"</s>");
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    if (!strcmp(word, "</s>")) {
-      start = 1;
-      continue;
-    } else start = 0;
-    train_words++;
-    if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-      printf("Words processed: %lldK     Vocab size: %lldK  %c", train_words / 1000, vocab_size / 1000, 13);
-      fflush(stdout);
+  fseeko(fin, 0, SEEK_END);
+  file_size = ftello(fin);
+  chunks = (struct chunk *)calloc(num_threads, sizeof(struct chunk));
+  for (t = 0; t < num_threads; t++) {
+    a = NextLineStart(fin, file_size * t / num_threads);
+    chunks[t].start = a;
+    if (t > 0) chunks[t - 1].end = a;
+  }
+  chunks[num_threads - 1].end = file_size;
+  fclose(fin);
+}
+
+// Adds the words of a chunk to the global table, in map, and frees its own table
+void MapWords(struct chunk *c) {
+  long long i;
+  c->map = (long long *)malloc(c->vocab.size * sizeof(long long));
+  for (i = 0; i < c->vocab.size; i++) {
+    c->map[i] = AddWord(&vocab, Word(&c->vocab, i), c->vocab.words[i].hash);
+    vocab.words[c->map[i]].cn += c->vocab.words[i].cn;
+  }
+  train_words += c->train_words;
+  FreeWords(&c->vocab);
+}
+
+// Count of a word, -1 below min_count
+long long WordCount(const char *word) {
+  long long i = SearchWord(&vocab, word, GetWordHash(word));
+  if (i == -1 || vocab.words[i].cn < min_count) return -1;
+  return vocab.words[i].cn;
+}
+
+// Estimated count of a bigram from the sketch, -1 below min_count. Bigrams do not run across newlines, which read
+// as a </s> word that is not counted
+long long SketchCount(const char *a, const char *b) {
+  long long cn;
+  if (!strcmp(a, "</s>") || !strcmp(b, "</s>")) return -1;
+  cn = SketchSearch(SketchKey(GetWordHash(a), GetWordHash(b)));
+  return cn < min_count ? -1 : cn;
+}
+
+// Counts the words and the bigrams (pairs of word indices) of the train file over chunks read in parallel. The odd
+// strings are the bigrams that no split of their string gives back: the ones cut at MAX_STRING - 1 chars, and the
+// first one, whose left word is the empty last_word of the original tool
+void LearnVocabFromTrainFile() {
+  char bigram_word[MAX_STRING * 2];
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  long long a, b, i, s, t, prev = -1, nb_cross = 0, *cross, distinct;
+  struct chunk *c;
+  SplitTrainFile();
+  for (t = 0; t < num_threads; t++) {
+    InitWords(&chunks[t].vocab);
+    for (s = 0; s < SHARDS; s++) InitPairs(&chunks[t].pairs[s]);
+    chunks[t].first = chunks[t].last = -1;
+    pthread_create(&pt[t], NULL, CountThread, (void *)t);
+  }
+  for (t = 0; t < num_threads; t++) pthread_join(pt[t], NULL);
+  //Global words in the order of the chunks, and the bigrams across chunks
+  InitWords(&vocab);
+  InitWords(&odd);
+  cross = (long long *)malloc(2 * num_threads * sizeof(long long));
+  for (t = 0; t < num_threads; t++) {
+    c = &chunks[t];
+    MapWords(c);
+    if (c->first != -1) {
+      if (prev == -1) {
+        BigramString(bigram_word, "", Word(&vocab, c->map[c->first]));
+        i = AddWord(&odd, bigram_word, GetWordHash(bigram_word));
+        odd.words[i].cn++;
+      } else {
+        cross[2 * nb_cross] = prev;
+        cross[2 * nb_cross++ + 1] = c->map[c->first];
+      }
+      prev = c->map[c->last];
     }
-    i = SearchVocab(word);
-    if (i == -1) {
-      a = AddWordToVocab(word);
-      vocab[a].cn = 1;
-    } else vocab[i].cn++;
-    if (start) continue;
-    sprintf(bigram_word, "%s_%s", last_word, word);
-    bigram_word[MAX_STRING - 1] = 0;
-    strcpy(last_word, word);
-    i = SearchVocab(bigram_word);
-    if (i == -1) {
-      a = AddWordToVocab(bigram_word);
-      vocab[a].cn = 1;
-    } else vocab[i].cn++;
-    if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
-  }
-  SortVocab();
+  }
+  distinct = vocab.size;
+  if (sketch != NULL) {
+    for (i = 0; i < nb_cross; i++) {
+      a = cross[2 * i];
+      b = cross[2 * i + 1];
+      SketchAdd(SketchKey(vocab.words[a].hash, vocab.words[b].hash), 1);
+    }
+  } else {
+    for (t = 0; t < num_threads && t < SHARDS; t++) pthread_create(&pt[t], NULL, MergeThread, (void *)t);
+    for (t = 0; t < num_threads && t < SHARDS; t++) pthread_join(pt[t], NULL);
+    for (i = 0; i < nb_cross; i++) {
+      a = cross[2 * i];
+      b = cross[2 * i + 1];
+      AddPair(&bigrams[PairShard(vocab.words[a].hash, vocab.words[b].hash)], PairKey(a, b), 1);
+    }
+    for (s = 0; s < SHARDS; s++) {
+      distinct += bigrams[s].size;
+      for (i = 0; i < bigrams[s].nb_slots; i++) if (bigrams[s].keys[i] != ~0ULL) {
+        a = bigrams[s].keys[i] >> 32;
+        b = bigrams[s].keys[i] & 0xffffffff;
+        if (vocab.words[a].len + 1 + vocab.words[b].len <= MAX_STRING - 1) continue;
+        BigramString(bigram_word, Word(&vocab, a), Word(&vocab, b));
+        t = AddWord(&odd, bigram_word, GetWordHash(bigram_word));
+        odd.words[t].cn += bigrams[s].cn[i];
+      }
+    }
+  }
   if (debug_mode > 0) {
-    printf("\nVocab size (unigrams + bigrams): %lld\n", vocab_size);
+    if (sketch != NULL) printf("\nVocab size (unigrams): %lld, bigrams in a sketch of %lld MB\n", distinct, sketch_mb);
+    else printf("\nVocab size (unigrams + bigrams): %lld\n", distinct);
     printf("Words in train file: %lld\n", train_words);
   }
-  fclose(fin);
+  for (t = 0; t < num_threads; t++) free(chunks[t].map);
+  free(chunks);
+  free(cross);
+  free(pt);
 }
 
-void TrainModel() {
-  long long pa = 0, pb = 0, pab = 0, oov, i, li = -1, cn = 0;
+// Counts the words and the n-grams of orders 2 to max_order of the train file over chunks read in parallel
+void LearnGramsFromTrainFile() {
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  long long i, g, n, t, prefix, distinct;
+  struct chunk *c;
+  SplitTrainFile();
+  for (t = 0; t < num_threads; t++) {
+    InitWords(&chunks[t].vocab);
+    for (n = 2; n <= max_order; n++) InitGrams(&chunks[t].grams[n]);
+    pthread_create(&pt[t], NULL, CountGramsThread, (void *)t);
+  }
+  for (t = 0; t < num_threads; t++) pthread_join(pt[t], NULL);
+  //Global indices of each order from the ones of the order below
+  InitWords(&vocab);
+  for (n = 2; n <= max_order; n++) InitGrams(&grams[n]);
+  for (t = 0; t < num_threads; t++) {
+    c = &chunks[t];
+    MapWords(c);
+    c->gram_map[1] = c->map;
+    for (n = 2; n <= max_order; n++) {
+      c->gram_map[n] = (long long *)malloc(c->grams[n].size * sizeof(long long));
+      for (i = 0; i < c->grams[n].size; i++) {
+        prefix = c->gram_map[n - 1][c->grams[n].keys[i] >> 32];
+        g = AddGram(&grams[n], PairKey(prefix, c->map[c->grams[n].keys[i] & 0xffffffff]));
+        grams[n].cn[g] += c->grams[n].cn[i];
+        c->gram_map[n][i] = g;
+      }
+      FreeGrams(&c->grams[n]);
+      if (n > 2) free(c->gram_map[n - 1]);
+    }
+    if (max_order > 1) free(c->gram_map[max_order]);
+    free(c->map);
+  }
+  distinct = vocab.size;
+  for (n = 2; n <= max_order; n++) distinct += grams[n].size;
+  if (debug_mode > 0) {
+    printf("\nVocab size (unigrams + n-grams): %lld\n", distinct);
+    printf("Words in train file: %lld\n", train_words);
+  }
+  free(chunks);
+  free(pt);
+}
+
+// Count of the words [first, first + len) of a sentence, with their index at order len in gram (-1 if they were
+// not seen together, or one of them is not a word of the vocabulary)
+static long long GramCount(const long long *ids, long long first, long long len, long long *gram) {
+  long long n, g = ids[first];
+  for (n = 2; n <= len && g != -1; n++) g = SearchGram(&grams[n], PairKey(g, ids[first + n - 1]));
+  *gram = g;
+  if (g == -1) return 0;
+  return len == 1 ? vocab.words[g].cn : grams[len].cn[g];
+}
+
+// Writes the phrases of up to max_order words of a sentence. Its tokens start as its words; in rounds until none
+// is joined, each token is joined to the previous one, left to right as in RewriteChunk, when the score of the pair
+// from the n-gram counts is above the threshold of the order of the result. As there, a token joined in a round
+// is not joined again in the same round
+static void WriteSentence(struct out_buf *o, const char *text, const long long *pos, const long long *ids,
+                          long long nb, long long *first, long long *len, long long *cn, char *fresh) {
+  long long k, a, out, joined, pab, gram;
+  real score;
+  for (k = 0; k < nb; k++) {
+    first[k] = k;
+    len[k] = 1;
+    cn[k] = ids[k] == -1 ? 0 : vocab.words[ids[k]].cn;
+  }
+  do {
+    joined = 0;
+    for (k = 0, out = 0; k < nb; k++) {
+      if (out > 0 && !fresh[out - 1] && len[out - 1] + len[k] <= max_order && cn[out - 1] >= min_count &&
+          cn[k] >= min_count) {
+        pab = GramCount(ids, first[out - 1], len[out - 1] + len[k], &gram);
+        if (pab < min_count) score = 0;
+        else score = (pab - min_count) / (real)cn[out - 1] / (real)cn[k] * (real)train_words;
+        if (score > thresholds[len[out - 1] + len[k]]) {
+          len[out - 1] += len[k];
+          cn[out - 1] = pab;
+          fresh[out - 1] = 1;
+          joined++;
+          continue;
+        }
+      }
+      first[out] = first[k];
+      len[out] = len[k];
+      cn[out] = cn[k];
+      fresh[out++] = 0;
+    }
+    nb = out;
+    for (k = 0; k < nb; k++) fresh[k] = 0;
+  } while (joined > 0);
+  for (k = 0; k < nb; k++) for (a = 0; a < len[k]; a++) PutWord(o, a == 0 ? ' ' : '_', text + pos[first[k] + a]);
+}
+
+// Rewrites a chunk with the phrases of up to max_order words, one sentence at a time
+static void RewriteGramsChunk(struct rewrite *w) {
+  struct reader r;
+  char word[MAX_STRING], *text = NULL, *fresh = NULL;
+  long long nb = 0, max_nb = 0, text_size = 0, max_text_size = 0, len;
+  long long *pos = NULL, *ids = NULL, *first = NULL, *lens = NULL, *cns = NULL;
+  int end;
+  OpenChunk(&r, w->start, w->end);
+  while (1) {
+    end = ReadChunkWord(word, &r) != 0;
+    if (end || !strcmp(word, "</s>")) {
+      WriteSentence(&w->out, text, pos, ids, nb, first, lens, cns, fresh);
+      nb = text_size = 0;
+      if (end) break;
+      Put(&w->out, "\n", 1);
+      continue;
+    }
+    w->words++;
+    len = strlen(word);
+    if (text_size + len + 1 > max_text_size) {
+      max_text_size = 2 * (text_size + len + 1);
+      text = (char *)realloc(text, max_text_size);
+    }
+    if (nb == max_nb) {
+      max_nb = 2 * max_nb + 1024;
+      pos = (long long *)realloc(pos, max_nb * sizeof(long long));
+      ids = (long long *)realloc(ids, max_nb * sizeof(long long));
+      first = (long long *)realloc(first, max_nb * sizeof(long long));
+      lens = (long long *)realloc(lens, max_nb * sizeof(long long));
+      cns = (long long *)realloc(cns, max_nb * sizeof(long long));
+      fresh = (char *)realloc(fresh, max_nb);
+    }
+    memcpy(text + text_size, word, len + 1);
+    pos[nb] = text_size;
+    ids[nb++] = SearchWord(&vocab, word, GetWordHash(word));
+    text_size += len + 1;
+  }
+  CloseChunk(&r);
+  free(text);
+  free(pos);
+  free(ids);
+  free(first);
+  free(lens);
+  free(cns);
+  free(fresh);
+}
+
+// Rewrites a chunk as the loop of the original tool over the train file, from its state (li, pa, pb) at the start
+// of the chunk, and leaves the state at its end in w. Only the first word of the chunk can read that state: the
+// bigrams run across sentences, but a word that is not counted sets li to -1 and the next word starts afresh.
+// dependent tells if it did, when the first word and its bigram with the </s> before it are both counted
+static void RewriteChunk(struct rewrite *w) {
+  struct reader r;
   char word[MAX_STRING], last_word[MAX_STRING], bigram_word[MAX_STRING * 2];
+  long long pa = w->pa, pb = w->pb, pab = 0, li = w->li, oov, i;
   real score;
-  FILE *fo, *fin;
-  printf("Starting training using file %s\n", train_file);
-  LearnVocabFromTrainFile();
-  fin = fopen(train_file, "rb");
-  fo = fopen(output_file, "wb");
-  word[0] = 0;
+  OpenChunk(&r, w->start, w->end);
+  //The chunks after the first one start after a newline, read as a </s> word
+  strcpy(word, w->first ? "" : "</s>");
   while (1) {
     strcpy(last_word, word);
-    ReadWord(word, fin);
-    if (feof(fin)) break;
+    if (ReadChunkWord(word, &r) != 0) break;
     if (!strcmp(word, "</s>")) {
-      fprintf(fo, "\n");
+      Put(&w->out, "\n", 1);
       continue;
     }
-    cn++;
-    if ((debug_mode > 1) && (cn % 100000 == 0)) {
-      printf("Words written: %lldK%c", cn / 1000, 13);
-      fflush(stdout);
-    }
+    w->words++;
     oov = 0;
-    i = SearchVocab(word);
-    if (i == -1) oov = 1; else pb = vocab[i].cn;
+    i = sketch != NULL ? WordCount(word) : StringCount(word);
+    if (i == -1) oov = 1; else pb = i;
     if (li == -1) oov = 1;
     li = i;
-    sprintf(bigram_word, "%s_%s", last_word, word);
-    bigram_word[MAX_STRING - 1] = 0;
-    i = SearchVocab(bigram_word);
-    if (i == -1) oov = 1; else pab = vocab[i].cn;
+    BigramString(bigram_word, last_word, word);
+    i = sketch != NULL ? SketchCount(last_word, word) : StringCount(bigram_word);
+    if (i == -1) oov = 1; else pab = i;
+    if (w->words == 1 && li != -1 && i != -1) w->dependent = 1;
     if (pa < min_count) oov = 1;
     if (pb < min_count) oov = 1;
     if (oov) score = 0; else score = (pab - min_count) / (real)pa / (real)pb * (real)train_words;
     if (score > threshold) {
-      fprintf(fo, "_%s", word);
+      PutWord(&w->out, '_', word);
       pb = 0;
-    } else fprintf(fo, " %s", word);
+    } else PutWord(&w->out, ' ', word);
     pa = pb;
   }
+  CloseChunk(&r);
+  w->li = li;
+  w->pa = pa;
+  w->pb = pb;
+}
+
+// Counts the words of the output of a chunk as the training tools read them, with their ReadWord: too long words
+// cut as there, and a </s> word at each newline. The output of a chunk ends with a newline, but for the last one,
+// where a word ended by the end of the file is dropped as there
+static void CountOutput(struct rewrite *w) {
+  char word[TRAIN_STRING];
+  long long p, i;
+  int a = 0, ch;
+  InitWords(&w->vocab);
+  for (p = 0; p < w->out.size; p++) {
+    ch = w->out.data[p];
+    if ((ch == ' ') || (ch == '\t') || (ch == '\n')) {
+      if (a > 0) {
+        word[a] = 0;
+        i = AddWord(&w->vocab, word, GetWordHash(word));
+        w->vocab.words[i].cn++;
+        a = 0;
+      }
+      if (ch == '\n') {
+        i = AddWord(&w->vocab, "</s>", GetWordHash("</s>"));
+        w->vocab.words[i].cn++;
+      }
+      continue;
+    }
+    word[a] = ch;
+    a++;
+    if (a >= TRAIN_STRING - 1) a--;
+  }
+}
+
+static void Rewrite(struct rewrite *w) {
+  w->out.size = w->words = w->dependent = 0;
+  if (max_order > 0) RewriteGramsChunk(w);
+  else RewriteChunk(w);
+  if (save_vocab_file[0] != 0) CountOutput(w);
+}
+
+void *RewriteThread(void *arg) {
+  Rewrite((struct rewrite *)arg);
+  pthread_exit(NULL);
+}
+
+// Writes the words of the output with their counts, in the format of -read-vocab of the training tools: </s>
+// first, then the words in the order they first appear, as in their own LearnVocabFromTrainFile, so that their
+// vocabulary is the same as when they count the output
+void SaveVocab() {
+  long long i;
+  FILE *fo = fopen(save_vocab_file, "wb");
+  for (i = 0; i < out_vocab.size; i++) fprintf(fo, "%s %lld\n", Word(&out_vocab, i), out_vocab.words[i].cn);
+  fclose(fo);
+}
+
+// Rewrites the train file in chunks of about REWRITE_SIZE bytes, num_threads at a time, each one into its own
+// buffer, and writes the buffers in order. The chunks of the default mode are rewritten from the state of the loop
+// at the start of the file; in order, the ones whose first word reads the state are rewritten again from the state
+// left by the chunks before them, and the others hand over their own
+void RewriteTrainFile() {
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  struct rewrite *jobs = (struct rewrite *)calloc(num_threads, sizeof(struct rewrite)), *w;
+  long long start = 0, file_size, li = -1, pa = 0, pb = 0, cn = 0, i, a;
+  int t, nb;
+  FILE *fin, *fo;
+  fin = fopen(train_file, "rb");
+  fo = fopen(output_file, "wb");
+  fseeko(fin, 0, SEEK_END);
+  file_size = ftello(fin);
+  InitWords(&out_vocab);
+  AddWord(&out_vocab, "</s>", GetWordHash("</s>"));
+  while (start < file_size) {
+    for (nb = 0; nb < num_threads && start < file_size; nb++) {
+      w = &jobs[nb];
+      w->start = start;
+      start = start + REWRITE_SIZE >= file_size ? file_size : NextLineStart(fin, start + REWRITE_SIZE);
+      w->end = start;
+      w->first = w->start == 0;
+      w->li = -1;
+      w->pa = w->pb = 0;
+      pthread_create(&pt[nb], NULL, RewriteThread, (void *)w);
+    }
+    for (t = 0; t < nb; t++) pthread_join(pt[t], NULL);
+    for (t = 0; t < nb; t++) {
+      w = &jobs[t];
+      if (w->dependent && li != -1) {
+        w->li = li;
+        w->pa = pa;
+        w->pb = pb;
+        if (save_vocab_file[0] != 0) FreeWords(&w->vocab);
+        Rewrite(w);
+      }
+      if (w->words > 0) {
+        li = w->li;
+        pa = w->pa;
+        pb = w->pb;
+      }
+      fwrite(w->out.data, 1, w->out.size, fo);
+      if (save_vocab_file[0] != 0) {
+        for (i = 0; i < w->vocab.size; i++) {
+          a = AddWord(&out_vocab, Word(&w->vocab, i), w->vocab.words[i].hash);
+          out_vocab.words[a].cn += w->vocab.words[i].cn;
+        }
+        FreeWords(&w->vocab);
+      }
+      cn += w->words;
+      if (debug_mode > 1) {
+        printf("Words written: %lldK%c", cn / 1000, 13);
+        fflush(stdout);
+      }
+    }
+  }
   fclose(fo);
   fclose(fin);
+  if (save_vocab_file[0] != 0) SaveVocab();
+  FreeWords(&out_vocab);
+  for (t = 0; t < num_threads; t++) free(jobs[t].out.data);
+  free(jobs);
+  free(pt);
+}
+
+void TrainModel() {
+  printf("Starting training using file %s\n", train_file);
+  if (max_order > 0) LearnGramsFromTrainFile();
+  else LearnVocabFromTrainFile();
+  RewriteTrainFile();
+}
+
+// -threshold: one value, or the values of the orders from 2 to max_order separated by commas (the last one is kept
+// for the orders above)
+void ParseThresholds(char *str) {
+  char *end;
+  int n;
+  for (n = 2; n <= MAX_ORDER; n++) {
+    thresholds[n] = strtod(str, &end);
+    if (*end != ',') break;
+    str = end + 1;
+  }
+  for (n++; n <= MAX_ORDER; n++) thresholds[n] = thresholds[n - 1];
+  threshold = thresholds[2];
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -274,19 +1037,55 @@ int main(int argc, char **argv) {
     printf("\t\tThis will discard words that appear less than <int> times; default is 5\n");
     printf("\t-threshold <float>\n");
     printf("\t\t The <float> value represents threshold for forming the phrases (higher means less phrases); default 100\n");
+    printf("\t-max-order <int>\n");
+    printf("\t\tBuild phrases of up to <int> words (at most %d) with one counting pass, instead of\n", MAX_ORDER);
+    printf("\t\trunning the tool once per length; -threshold then takes one value per length, from 2 words\n");
+    printf("\t\ton, separated by commas\n");
+    printf("\t-sketch <int>\n");
+    printf("\t\tCount the bigrams approximately in <int> MB, in a count-min sketch; default is 0 (exact counts).\n");
+    printf("\t\tBigram counts are never too low, and too high by at most 2.72 * words / (<int> * %d)\n",
+           (int)(1048576 / SKETCH_DEPTH / sizeof(unsigned int)));
+    printf("\t\twith probability 0.98, for the words of the train file; the word counts stay exact\n");
+    printf("\t-save-vocab <file>\n");
+    printf("\t\tThe vocabulary of the output will be saved to <file>, to be given to -read-vocab of the\n");
+    printf("\t\ttraining tools instead of counting the output again\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tUse <int> threads to count the words and bigrams and to rewrite the text (default 12)\n");
     printf("\t-debug <int>\n");
     printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
     printf("\nExamples:\n");
-    printf("./word2phrase -train text.txt -output phrases.txt -threshold 100 -debug 2\n\n");
+    printf("./word2phrase -train text.txt -output phrases.txt -threshold 100 -debug 2\n");
+    printf("./word2phrase -train text.txt -output phrases.txt -max-order 4 -threshold 100 -debug 2\n\n");
     return 0;
   }
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *)"-threshold", argc, argv)) > 0) threshold = atof(argv[i + 1]);
-  vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
+  if ((i = ArgPos((char *)"-threshold", argc, argv)) > 0) ParseThresholds(argv[i + 1]);
+  else ParseThresholds((char *)"100");
+  if ((i = ArgPos((char *)"-max-order", argc, argv)) > 0) max_order = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sketch", argc, argv)) > 0) sketch_mb = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if (num_threads < 1) num_threads = 1;
+  if (max_order < 0 || max_order == 1 || max_order > MAX_ORDER) {
+    printf("-max-order must be between 2 and %d\n", MAX_ORDER);
+    return 0;
+  }
+  if (sketch_mb > 0) {
+    if (max_order > 0) {
+      printf("-sketch only counts the bigrams of the default mode, not the n-grams of -max-order\n");
+      return 0;
+    }
+    sketch_width = sketch_mb * 1048576 / SKETCH_DEPTH / sizeof(unsigned int) / SHARDS * SHARDS;
+    sketch = (unsigned int *)calloc(sketch_width * SKETCH_DEPTH, sizeof(unsigned int));
+    if (sketch == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    for (i = 0; i < SHARDS; i++) pthread_mutex_init(&sketch_lock[i], NULL);
+  }
   TrainModel();
   return 0;
 }